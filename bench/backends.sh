@@ -0,0 +1,66 @@
+#!/bin/sh
+# usage: bench/backends.sh [prompt] [files] [runs] [backend ...]
+# the whole prompt with each backend on the same fixture repositories built with git: clean, dirty, staged and
+# ahead of its upstream, and a work tree of many files clean and dirty; libgit2 is added when the prompt was built
+# with it, make bench passes it then
+set -u
+
+PROMPT=$(cd "$(dirname "${1:-./prompt}")" && pwd)/$(basename "${1:-./prompt}")
+FILES=${2:-20000}
+RUNS=${3:-20}
+shift $(($# < 3 ? $# : 3))
+BACKENDS="native cli $*"
+T=$(mktemp -d)
+trap 'rm -rf "$T"' EXIT
+
+# as the tests do: none of the user's configuration, and a GIT_CONFIG variable keeps a running daemon out of it
+export HOME="$T" USER=bench GIT_CONFIG_NOSYSTEM=1 GIT_CONFIG_GLOBAL="$T/gitconfig" PROMPT_DEADLINE_MS=0
+export GIT_AUTHOR_NAME=bench GIT_AUTHOR_EMAIL=bench@example.com GIT_COMMITTER_NAME=bench
+export GIT_COMMITTER_EMAIL=bench@example.com
+unset GIT_DIR GIT_WORK_TREE GIT_INDEX_FILE PROMPT_STALE
+git config --global init.defaultBranch master
+
+# repo <dir> <files>
+repo() {
+	git init -q "$1"
+	n=0
+	while [ $n -lt "$2" ]; do
+		mkdir -p "$1/d$((n / 100))"
+		echo "$n" > "$1/d$((n / 100))/f$n"
+		n=$((n + 1))
+	done
+	git -C "$1" add .
+	git -C "$1" commit -qm one
+}
+
+repo "$T/clean" 100
+repo "$T/dirty" 100
+echo change >> "$T/dirty/d0/f1"
+repo "$T/staged" 100
+echo change >> "$T/staged/d0/f1"
+git -C "$T/staged" add d0/f1
+git clone -q "$T/clean" "$T/ahead"
+echo change >> "$T/ahead/d0/f1"
+git -C "$T/ahead" commit -qam two
+repo "$T/large" "$FILES"
+git clone -q "$T/large" "$T/large-dirty"
+echo change >> "$T/large-dirty/d$((FILES / 200))/f$((FILES / 2))"
+# nothing racily clean, stat data decides
+sleep 1
+for dir in "$T"/*/; do
+	git -C "$dir" status > /dev/null
+done
+
+for dir in clean dirty staged ahead large large-dirty; do
+	for backend in $BACKENDS; do
+		start=$(date +%s%N)
+		n=0
+		while [ $n -lt "$RUNS" ]; do
+			(cd "$T/$dir" && PWD="$T/$dir" PROMPT_BACKEND=$backend "$PROMPT" 0 > /dev/null)
+			n=$((n + 1))
+		done
+		end=$(date +%s%N)
+		printf '%-40s %8d runs %10.2f ms\n' "backend $backend, $dir" "$RUNS" \
+			"$(echo "$start $end $RUNS" | awk '{ printf "%.2f", ($2 - $1) / $3 / 1e6 }')"
+	done
+done
@@ -0,0 +1,45 @@
+// what the benchmarks share: a clock and one way of printing results
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+static inline double bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// one line per measurement: what was run, how often and what one run took
+static inline void bench_report(const char* name, long runs, double seconds, const char* extra) {
+	double per = seconds / runs;
+	printf("%-40s %8ld runs %10.2f %s%s%s\n", name, runs, per >= 1e-3 ? per * 1e3 : per * 1e6,
+		per >= 1e-3 ? "ms" : "us", extra ? "  " : "", extra ? extra : "");
+}
+
+// a work tree of files in directories of a hundred, added once they are older than the index will be
+static inline int bench_worktree(const char* dir, long files) {
+	char path[PATH_MAX], cmd[PATH_MAX + 64];
+	long n;
+
+	for (n = 0; n < files; ++n) {
+		int fd;
+		if (n % 100 == 0) {
+			snprintf(path, sizeof path, "%s/d%05ld", dir, n / 100);
+			mkdir(path, 0755);
+		}
+		snprintf(path, sizeof path, "%s/d%05ld/f%ld", dir, n / 100, n);
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 || write(fd, path, strlen(path)) < 0) {
+			return -1;
+		}
+		close(fd);
+	}
+	// not racily clean, so that stat data decides every entry
+	sleep(1);
+	snprintf(cmd, sizeof cmd, "cd '%s' && git init -q && git add .", dir);
+	return system(cmd);
+}
@@ -0,0 +1,58 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <linux/limits.h>
+#include "git.h"
+#include "bench.h"
+
+// usage: bench/clean [files] [runs]
+// the dirty check of a clean work tree on 1, 2, 4 ... of the cores this process may use; the pool is sized to the
+// affinity mask, so each step is what a cpuset of that size gets
+
+int main(int argc, char** argv) {
+	long files = argc > 1 ? atol(argv[1]) : 200000;
+	int runs = argc > 2 ? atoi(argv[2]) : 5;
+	char dir[] = "/tmp/bench-clean.XXXXXX", path[PATH_MAX], name[64], cmd[PATH_MAX];
+	cpu_set_t all, some;
+	int cpus, count, cpu, n;
+	git_index index;
+
+	if (!mkdtemp(dir) || bench_worktree(dir, files) != 0 ||
+			index_open(&index, strcat(strcpy(path, dir), "/.git/index"), 20) != 0) {
+		fprintf(stderr, "bench/clean: can't build the work tree in %s\n", dir);
+		return 1;
+	}
+	sched_getaffinity(0, sizeof all, &all);
+	cpus = CPU_COUNT(&all);
+
+	for (count = 1; ; count = count * 2 < cpus ? count * 2 : cpus) {
+		double start;
+		// the first count of the cores allowed, which the workers inherit
+		CPU_ZERO(&some);
+		for (cpu = 0, n = 0; n < count; ++cpu) {
+			if (CPU_ISSET(cpu, &all)) {
+				CPU_SET(cpu, &some);
+				++n;
+			}
+		}
+		sched_setaffinity(0, sizeof some, &some);
+		snprintf(name, sizeof name, "clean %u entries, %d of %d cores", index.count, count, cpus);
+		start = bench_now();
+		for (n = 0; n < runs; ++n) {
+			if (index_clean(&index, dir, NULL) != 1) {
+				fprintf(stderr, "bench/clean: the work tree isn't clean\n");
+				return 1;
+			}
+		}
+		bench_report(name, runs, bench_now() - start, NULL);
+		if (count == cpus) {
+			break;
+		}
+	}
+	sched_setaffinity(0, sizeof all, &all);
+
+	index_close(&index);
+	snprintf(cmd, sizeof cmd, "rm -rf '%s'", dir);
+	return system(cmd);
+}
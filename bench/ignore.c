@@ -0,0 +1,126 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <linux/limits.h>
+#include "git.h"
+#include "bench.h"
+
+// usage: bench/ignore [patterns] [paths]
+// a .gitignore of thousands of patterns, literal names, extensions, directories and globs, against paths of which
+// some match; the bucketed matcher against trying every pattern with fnmatch, the newest first
+
+// what the naive side needs of a pattern
+typedef struct {
+	char text[64];
+	int dir, anchored;
+} naive_pattern;
+
+static void pattern(char* buf, size_t size, long n) {
+	switch (n % 5) {
+	case 0: snprintf(buf, size, "lit%ld", n); break;
+	case 1: snprintf(buf, size, "*.e%ld", n); break;
+	case 2: snprintf(buf, size, "/top%ld/", n); break;
+	case 3: snprintf(buf, size, "a%ld*b?c", n); break;
+	default: snprintf(buf, size, "src%ld/*.o", n); break;
+	}
+}
+
+static void path(char* buf, size_t size, long n, long patterns, int* isdir) {
+	long k = n * 7919 % patterns;
+	*isdir = 0;
+	switch (n % 6) {
+	case 0: snprintf(buf, size, "d%ld/s%ld/lit%ld", n % 13, n % 7, k - k % 5); break;
+	case 1: snprintf(buf, size, "d%ld/x%ld.e%ld", n % 13, n, k - k % 5 + 1); break;
+	case 2: snprintf(buf, size, "top%ld", k - k % 5 + 2); *isdir = 1; break;
+	case 3: snprintf(buf, size, "d%ld/s%ld/t/a%ldzzbqc", n % 13, n % 7, k - k % 5 + 3); break;
+	case 4: snprintf(buf, size, "src%ld/m%ld.o", k - k % 5 + 4, n); break;
+	default: snprintf(buf, size, "d%ld/s%ld/file%ld.c", n % 13, n % 7, n); break;
+	}
+}
+
+static int naive_match(const naive_pattern* patterns, long count, const char* path, int isdir) {
+	const char* slash = strrchr(path, '/');
+	const char* base = slash ? slash + 1 : path;
+	long n;
+
+	for (n = count - 1; n >= 0; --n) {
+		const naive_pattern* p = &patterns[n];
+		if (p->dir && !isdir) {
+			continue;
+		}
+		if (p->anchored ? fnmatch(p->text, path, FNM_PATHNAME) == 0 : fnmatch(p->text, base, 0) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	long patterns = argc > 1 ? atol(argv[1]) : 5000, paths = argc > 2 ? atol(argv[2]) : 5000, n;
+	char dir[] = "/tmp/bench-ignore.XXXXXX", buf[PATH_MAX], name[64], counts[64];
+	naive_pattern* naive = calloc(patterns, sizeof *naive);
+	long matched = 0, naive_matched = 0;
+	git_repo repo;
+	ignore ig;
+	double start;
+	FILE* f;
+	int dirfd, isdir;
+
+	if (!naive || !mkdtemp(dir)) {
+		return 1;
+	}
+	snprintf(buf, sizeof buf, "git init -q '%s'", dir);
+	if (system(buf) != 0 || !(f = fopen(strcat(strcpy(buf, dir), "/.gitignore"), "w"))) {
+		fprintf(stderr, "bench/ignore: can't create a repository in %s\n", dir);
+		return 1;
+	}
+	for (n = 0; n < patterns; ++n) {
+		naive_pattern* p = &naive[n];
+		char* text = p->text;
+		size_t len;
+		pattern(text, sizeof p->text, n);
+		fprintf(f, "%s\n", text);
+		len = strlen(text);
+		// a slash at the end is for directories only, one anywhere else anchors it to the .gitignore's directory
+		if ((p->dir = text[len - 1] == '/')) {
+			text[--len] = 0;
+		}
+		if ((p->anchored = *text == '/')) {
+			memmove(text, text + 1, len--);
+		}
+		p->anchored |= strchr(text, '/') != NULL;
+	}
+	fclose(f);
+	if (repo_discover(&repo, dir) != 0 || (dirfd = open(dir, O_RDONLY | O_DIRECTORY)) == -1 ||
+			ignore_open(&ig, &repo, dirfd) != 0) {
+		fprintf(stderr, "bench/ignore: can't open the repository in %s\n", dir);
+		return 1;
+	}
+
+	snprintf(name, sizeof name, "ignore %ld patterns, bucketed", patterns);
+	start = bench_now();
+	for (n = 0; n < paths; ++n) {
+		path(buf, sizeof buf, n, patterns, &isdir);
+		matched += ignore_match(&ig, buf, isdir) == 1;
+	}
+	snprintf(counts, sizeof counts, "%ld of %ld ignored", matched, paths);
+	bench_report(name, paths, bench_now() - start, counts);
+
+	snprintf(name, sizeof name, "ignore %ld patterns, fnmatch each", patterns);
+	start = bench_now();
+	for (n = 0; n < paths; ++n) {
+		path(buf, sizeof buf, n, patterns, &isdir);
+		naive_matched += naive_match(naive, patterns, buf, isdir);
+	}
+	snprintf(counts, sizeof counts, "%ld of %ld ignored", naive_matched, paths);
+	bench_report(name, paths, bench_now() - start, counts);
+
+	ignore_close(&ig);
+	close(dirfd);
+	free(naive);
+	snprintf(buf, sizeof buf, "rm -rf '%s'", dir);
+	return system(buf) != 0 || matched != naive_matched;
+}
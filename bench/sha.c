@@ -0,0 +1,77 @@
+// usage: bench/sha [MB] [runs]
+// throughput of the SHA-1 and SHA-256 block functions, the portable ones against the SHA-NI or ARMv8 ones where the
+// CPU has them, and of hashing a blob the way the dirty check does through whichever hash_update picks; sha.c is
+// built into this file so that its kernels can be called directly
+#include <stdlib.h>
+#include <string.h>
+#include "../sha.c"
+#include "bench.h"
+
+static void kernel(const char* name, compress_fn fn, const unsigned char* data, size_t size, int runs) {
+	uint32_t state[8] = {0};
+	char rate[32];
+	double start = bench_now(), elapsed;
+	int n;
+
+	for (n = 0; n < runs; ++n) {
+		fn(state, data, size / 64);
+	}
+	elapsed = bench_now() - start;
+	snprintf(rate, sizeof rate, "%.0f MB/s", (double)size * runs / elapsed / 1e6);
+	bench_report(name, runs, elapsed, rate);
+}
+
+static void blob(const char* name, int rawsz, const unsigned char* data, size_t size, int runs) {
+	unsigned char oid[GIT_MAX_RAWSZ];
+	char header[32], rate[32];
+	double start = bench_now(), elapsed;
+	git_hash ctx;
+	int n;
+
+	for (n = 0; n < runs; ++n) {
+		hash_init(&ctx, rawsz);
+		hash_update(&ctx, header, snprintf(header, sizeof header, "blob %zu", size) + 1);
+		hash_update(&ctx, data, size);
+		hash_final(&ctx, oid);
+	}
+	elapsed = bench_now() - start;
+	snprintf(rate, sizeof rate, "%.0f MB/s", (double)size * runs / elapsed / 1e6);
+	bench_report(name, runs, elapsed, rate);
+}
+
+int main(int argc, char** argv) {
+	size_t size = (argc > 1 ? atol(argv[1]) : 64) << 20;
+	int runs = argc > 2 ? atoi(argv[2]) : 5;
+	unsigned char* data = malloc(size);
+	size_t n;
+
+	if (!data) {
+		return 1;
+	}
+	for (n = 0; n < size; ++n) {
+		data[n] = n * 2654435761u >> 24;
+	}
+
+	kernel("sha1 portable", sha1_scalar, data, size, runs);
+	kernel("sha256 portable", sha256_scalar, data, size, runs);
+#ifdef HASH_SHANI
+	if (shani_supported()) {
+		kernel("sha1 SHA-NI", sha1_shani, data, size, runs);
+		kernel("sha256 SHA-NI", sha256_shani, data, size, runs);
+	} else {
+		printf("SHA-NI: not supported by this CPU\n");
+	}
+#endif
+#ifdef HASH_ARMV8
+	if (getauxval(AT_HWCAP) & HWCAP_SHA1) {
+		kernel("sha1 ARMv8", sha1_armv8, data, size, runs);
+	}
+	if (getauxval(AT_HWCAP) & HWCAP_SHA2) {
+		kernel("sha256 ARMv8", sha256_armv8, data, size, runs);
+	}
+#endif
+	blob("blob sha1, as hash_update picks", 20, data, size, runs);
+	blob("blob sha256, as hash_update picks", 32, data, size, runs);
+	free(data);
+	return 0;
+}
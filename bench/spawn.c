@@ -0,0 +1,102 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include "bench.h"
+
+// usage: bench/spawn [runs] [heap MB]
+// what starting a probe costs: fork and exec the way readp used to, against posix_spawn the way startp does it now,
+// with a pipe2(O_CLOEXEC), a /dev/null opened once and what the shell left open closed; the heap is touched first,
+// fork copies its page tables and posix_spawn doesn't
+
+extern char** environ;
+
+static char* cmd[] = {"true", NULL};
+
+static void forked() {
+	int c2p[2], wstatus;
+	char buf[64];
+	pid_t pid;
+
+	if (pipe(c2p) != 0 || (pid = fork()) == -1) {
+		exit(1);
+	}
+	if (pid == 0) {
+		close(c2p[0]);
+		dup2(c2p[1], 1);
+		dup2(open("/dev/null", O_WRONLY), 2);
+		execvp(cmd[0], cmd);
+		exit(1);
+	}
+	close(c2p[1]);
+	while (read(c2p[0], buf, sizeof buf) > 0) {
+	}
+	close(c2p[0]);
+	waitpid(pid, &wstatus, 0);
+}
+
+static void spawned(int devnull) {
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	int c2p[2], wstatus;
+	char buf[64];
+	pid_t pid;
+
+	if (pipe2(c2p, O_CLOEXEC) != 0) {
+		exit(1);
+	}
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, devnull, 0);
+	posix_spawn_file_actions_adddup2(&actions, c2p[1], 1);
+	posix_spawn_file_actions_adddup2(&actions, devnull, 2);
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 34)
+	posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+#endif
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setpgroup(&attr, 0);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+	if (posix_spawnp(&pid, cmd[0], &actions, &attr, cmd, environ) != 0) {
+		exit(1);
+	}
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	close(c2p[1]);
+	while (read(c2p[0], buf, sizeof buf) > 0) {
+	}
+	close(c2p[0]);
+	waitpid(pid, &wstatus, 0);
+}
+
+int main(int argc, char** argv) {
+	long runs = argc > 1 ? atol(argv[1]) : 500, n;
+	size_t heap = (argc > 2 ? atol(argv[2]) : 256) << 20;
+	int devnull = open("/dev/null", O_RDWR | O_CLOEXEC);
+	size_t sizes[] = {0, heap};
+	char name[64];
+	double start;
+	int s;
+
+	for (s = 0; s < 2; ++s) {
+		char* mem = sizes[s] ? malloc(sizes[s]) : NULL;
+		if (mem) {
+			memset(mem, 1, sizes[s]);
+		}
+		snprintf(name, sizeof name, "spawn fork+exec, %zu MB heap", sizes[s] >> 20);
+		start = bench_now();
+		for (n = 0; n < runs; ++n) {
+			forked();
+		}
+		bench_report(name, runs, bench_now() - start, NULL);
+		snprintf(name, sizeof name, "spawn posix_spawn, %zu MB heap", sizes[s] >> 20);
+		start = bench_now();
+		for (n = 0; n < runs; ++n) {
+			spawned(devnull);
+		}
+		bench_report(name, runs, bench_now() - start, NULL);
+		free(mem);
+	}
+	return 0;
+}
@@ -0,0 +1,92 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include "git.h"
+#include "bench.h"
+
+// usage: bench/watch [files] [runs]
+// the dirty check the daemon does with its watcher: the first one, which sets the watches up, one with nothing
+// changed since a clean check, and how long it takes from a file being written until a check sees the change,
+// against a check that stats every entry
+
+// a dirty check the way the daemon does one
+static int watched(const git_index* index, const git_repo* repo) {
+	unsigned long generation;
+	uint64_t* check = watch_check(index, repo, &generation);
+	int clean = index_clean(index, repo->worktree, check);
+
+	if (generation) {
+		watch_settle(generation, index, clean);
+	}
+	free(check);
+	return clean;
+}
+
+int main(int argc, char** argv) {
+	long files = argc > 1 ? atol(argv[1]) : 100000;
+	int runs = argc > 2 ? atoi(argv[2]) : 100;
+	char dir[] = "/tmp/bench-watch.XXXXXX", path[PATH_MAX], name[64], extra[64];
+	double start, elapsed = 0;
+	int n, missed = 0;
+	git_index index;
+	git_repo repo;
+
+	if (!mkdtemp(dir) || bench_worktree(dir, files) != 0 || repo_discover(&repo, dir) != 0 ||
+			index_open(&index, strcat(strcpy(path, repo.gitdir), "/index"), repo.rawsz) != 0) {
+		fprintf(stderr, "bench/watch: can't build the work tree in %s\n", dir);
+		return 1;
+	}
+
+	snprintf(name, sizeof name, "full check, %u entries", index.count);
+	start = bench_now();
+	for (n = 0; n < runs; ++n) {
+		if (index_clean(&index, repo.worktree, NULL) != 1) {
+			fprintf(stderr, "bench/watch: the work tree isn't clean\n");
+			return 1;
+		}
+	}
+	bench_report(name, runs, bench_now() - start, NULL);
+
+	start = bench_now();
+	if (watched(&index, &repo) != 1) {
+		fprintf(stderr, "bench/watch: the work tree isn't clean\n");
+		return 1;
+	}
+	bench_report("watched check, first", 1, bench_now() - start, NULL);
+
+	start = bench_now();
+	for (n = 0; n < runs; ++n) {
+		watched(&index, &repo);
+	}
+	bench_report("watched check, nothing changed", runs, bench_now() - start, NULL);
+
+	// a byte appended to a file, then taken off again, so that the next change starts from a clean work tree
+	for (n = 0; n < runs; ++n) {
+		long k = n * 7919L % files;
+		int fd, tries = 0, clean;
+		snprintf(path, sizeof path, "%s/d%05ld/f%ld", dir, k / 100, k);
+		start = bench_now();
+		if ((fd = open(path, O_WRONLY | O_APPEND)) == -1 || write(fd, "x", 1) != 1) {
+			return 1;
+		}
+		while ((clean = watched(&index, &repo)) != 0 && ++tries < 1000) {
+		}
+		elapsed += bench_now() - start;
+		// a check that came back clean after the write missed it
+		missed += tries > 0;
+		if (ftruncate(fd, strlen(path)) != 0 || watched(&index, &repo) != 1) {
+			fprintf(stderr, "bench/watch: %s isn't clean again\n", path);
+			return 1;
+		}
+		close(fd);
+	}
+	snprintf(extra, sizeof extra, "%d of %d checks missed the write", missed, runs);
+	bench_report("write to a check that sees it", runs, elapsed, extra);
+
+	index_close(&index);
+	snprintf(path, sizeof path, "rm -rf '%s'", dir);
+	return system(path) != 0 || missed != 0;
+}
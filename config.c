@@ -0,0 +1,479 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "git.h"
+
+#define CONFIG_MAXVALUE 4096
+#define CONFIG_MAXDEPTH 10
+
+typedef struct {
+	const char* key;
+	char* buf;
+	size_t size;
+	int found;
+} config_lookup;
+
+// what the files said, in order; names and values are offsets into strings, a value of -1 is a key without one
+typedef struct {
+	ssize_t key;
+	ssize_t value;
+} config_entry;
+
+struct git_config {
+	int loaded;
+	int result;
+	config_entry* entries;
+	int count;
+	int alloc;
+	char* strings;
+	size_t len;
+	size_t cap;
+};
+
+static int iskeychar(int c) {
+	return isalnum(c) || c == '-';
+}
+
+// "~/" and paths relative to the including file
+static int config_path(const char* base, const char* path, char* out) {
+	const char* home = getenv("HOME");
+	const char* slash;
+
+	if (strncmp(path, "~/", 2) == 0 && home) {
+		if (strlen(home) + strlen(path) > PATH_MAX) {
+			return -1;
+		}
+		strcpy(out, home);
+		strcat(out, path + 1);
+	} else if (*path != '/' && (slash = strrchr(base, '/'))) {
+		if ((slash - base) + strlen(path) + 2 > PATH_MAX) {
+			return -1;
+		}
+		memcpy(out, base, slash - base + 1);
+		strcpy(out + (slash - base + 1), path);
+	} else {
+		if (strlen(path) >= PATH_MAX) {
+			return -1;
+		}
+		strcpy(out, path);
+	}
+	return 0;
+}
+
+// includeIf "gitdir:<pattern>", with the same shorthands git has for the pattern
+static int include_matches(const char* cond, int len, const char* base, const char* gitdir) {
+	char pattern[PATH_MAX], tmp[PATH_MAX], dir[PATH_MAX];
+	int icase = 0, plen;
+
+	if (!gitdir) {
+		return 0;
+	}
+	if (len > 9 && strncmp(cond, "gitdir/i:", 9) == 0) {
+		icase = FNM_CASEFOLD;
+		cond += 9;
+		len -= 9;
+	} else if (len > 7 && strncmp(cond, "gitdir:", 7) == 0) {
+		cond += 7;
+		len -= 7;
+	} else {
+		return 0;
+	}
+	if (len >= sizeof tmp - 4) {
+		return 0;
+	}
+	memcpy(tmp, cond, len);
+	tmp[len] = 0;
+	if (*tmp == '.' && tmp[1] == '/') {
+		if (config_path(base, tmp + 2, pattern) != 0) {
+			return 0;
+		}
+	} else if (config_path("", tmp, pattern) != 0) {
+		return 0;
+	}
+	if (*pattern != '/') {
+		memmove(pattern + 3, pattern, strlen(pattern) + 1);
+		memcpy(pattern, "**/", 3);
+	}
+	plen = strlen(pattern);
+	if (pattern[plen - 1] == '/' && plen + 3 < sizeof pattern) {
+		strcpy(pattern + plen, "**");
+	}
+	if (strlen(gitdir) >= sizeof dir) {
+		return 0;
+	}
+	strcpy(dir, gitdir);
+	// without FNM_PATHNAME a star crosses slashes, close enough to "**"
+	return fnmatch(pattern, dir, icase) == 0;
+}
+
+static int parse(const char* path, const char* gitdir, config_fn fn, void* data, int depth) {
+	char key[256], value[CONFIG_MAXVALUE];
+	struct stat st;
+	const char *p, *end, *sect = NULL, *sub = NULL;
+	int sectlen = 0, sublen = 0, result = 0;
+	char* map;
+	int fd;
+
+	if (depth > CONFIG_MAXDEPTH || (fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		return 0;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size == 0 ||
+			(map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return 0;
+	}
+	close(fd);
+
+	p = map;
+	end = map + st.st_size;
+	while (p < end && result == 0) {
+		while (p < end && isspace((unsigned char)*p)) {
+			++p;
+		}
+		if (p == end) {
+			break;
+		}
+		if (*p == '#' || *p == ';') {
+			while (p < end && *p != '\n') {
+				++p;
+			}
+		} else if (*p == '[') {
+			sect = ++p;
+			while (p < end && (iskeychar(*p) || *p == '.')) {
+				++p;
+			}
+			sectlen = p - sect;
+			sub = NULL;
+			sublen = 0;
+			while (p < end && *p == ' ') {
+				++p;
+			}
+			if (p < end && *p == '"') {
+				// subsection names are kept raw, escapes in them are rare enough
+				sub = ++p;
+				while (p < end && *p != '"' && *p != '\n') {
+					p += *p == '\\' ? 2 : 1;
+				}
+				sublen = p - sub;
+			}
+			while (p < end && *p != ']' && *p != '\n') {
+				++p;
+			}
+			if (p < end && *p == ']') {
+				++p;
+			}
+		} else {
+			const char* name = p;
+			char *q = value, *keep = value;
+			int namelen, quoted = 0, n, k = 0;
+
+			while (p < end && iskeychar(*p)) {
+				++p;
+			}
+			namelen = p - name;
+			if (!sect || !namelen || sectlen + sublen + namelen + 3 > sizeof key) {
+				while (p < end && *p != '\n') {
+					++p;
+				}
+				continue;
+			}
+			// "section[.subsection].name", section and name lower cased
+			for (n = 0; n < sectlen; ++n) {
+				key[k++] = tolower((unsigned char)sect[n]);
+			}
+			key[k++] = '.';
+			if (sub) {
+				memcpy(key + k, sub, sublen);
+				k += sublen;
+				key[k++] = '.';
+			}
+			for (n = 0; n < namelen; ++n) {
+				key[k++] = tolower((unsigned char)name[n]);
+			}
+			key[k] = 0;
+
+			while (p < end && (*p == ' ' || *p == '\t')) {
+				++p;
+			}
+			if (p == end || *p != '=') {
+				// a bare name means true
+				while (p < end && *p != '\n') {
+					++p;
+				}
+				result = fn(key, NULL, data);
+				continue;
+			}
+			++p;
+			while (p < end && (*p == ' ' || *p == '\t')) {
+				++p;
+			}
+			while (p < end && *p != '\n') {
+				char c = *p++;
+				if (!quoted && (c == '#' || c == ';')) {
+					while (p < end && *p != '\n') {
+						++p;
+					}
+					break;
+				} else if (c == '"') {
+					quoted = !quoted;
+					continue;
+				} else if (c == '\\' && p < end) {
+					c = *p++;
+					if (c == '\n') {
+						continue;
+					}
+					c = c == 'n' ? '\n' : c == 't' ? '\t' : c == 'b' ? '\b' : c;
+				} else if (c == '\r' && (p == end || *p == '\n')) {
+					continue;
+				}
+				if (q < value + sizeof value - 1) {
+					*(q++) = c;
+					if (quoted || (c != ' ' && c != '\t')) {
+						keep = q;
+					}
+				}
+			}
+			// trailing blanks outside of quotes are not part of the value
+			*keep = 0;
+
+			if (strcmp(key, "include.path") == 0 ||
+					(sectlen == 9 && sub && strncasecmp(sect, "includeif", 9) == 0 && strcasecmp(key + k - 5, ".path") == 0 &&
+					include_matches(sub, sublen, path, gitdir))) {
+				char included[PATH_MAX];
+				if (config_path(path, value, included) == 0) {
+					result = parse(included, gitdir, fn, data, depth + 1);
+				}
+			} else {
+				result = fn(key, value, data);
+			}
+		}
+	}
+
+	munmap(map, st.st_size);
+	return result;
+}
+
+int config_parse(const char* path, const char* gitdir, config_fn fn, void* data) {
+	return parse(path, gitdir, fn, data, 0);
+}
+
+static int lookup(const char* key, const char* value, void* data) {
+	config_lookup* lookup = data;
+	// keys come in lower cased, except for the subsection
+	const char* dot = strchr(lookup->key, '.');
+	const char* last = strrchr(lookup->key, '.');
+	int len = strlen(key);
+
+	if (len != strlen(lookup->key) || strncasecmp(key, lookup->key, dot - lookup->key) != 0 ||
+			strncmp(key + (dot - lookup->key), dot, last - dot) != 0 || strcasecmp(key + (last - lookup->key), last) != 0) {
+		return 0;
+	}
+	if (!value) {
+		value = "true";
+	}
+	if (strlen(value) < lookup->size) {
+		strcpy(lookup->buf, value);
+		lookup->found = 1;
+	}
+	return 0;
+}
+
+const char* config_get(const char* path, const char* gitdir, const char* key, char* buf, size_t size) {
+	config_lookup data = {key, buf, size, 0};
+	config_parse(path, gitdir, lookup, &data);
+	return data.found ? buf : NULL;
+}
+
+// system and global configuration, what the user and not the repository says
+static int user_config_each(const char* gitdir, config_fn fn, void* data) {
+	char path[PATH_MAX];
+	const char* env = getenv("XDG_CONFIG_HOME");
+	const char* home = getenv("HOME");
+	const char* global = getenv("GIT_CONFIG_GLOBAL");
+	int result = 0;
+
+	if (!config_bool(getenv("GIT_CONFIG_NOSYSTEM"), 0)) {
+		const char* system = getenv("GIT_CONFIG_SYSTEM");
+		result = config_parse(system ? system : "/etc/gitconfig", gitdir, fn, data);
+	}
+	if (global) {
+		result = result ? result : config_parse(global, gitdir, fn, data);
+	} else {
+		if (env && strlen(env) + 12 < sizeof path) {
+			strcpy(path, env);
+			strcat(path, "/git/config");
+			result = result ? result : config_parse(path, gitdir, fn, data);
+		} else if (home && strlen(home) + 20 < sizeof path) {
+			strcpy(path, home);
+			strcat(path, "/.config/git/config");
+			result = result ? result : config_parse(path, gitdir, fn, data);
+		}
+		if (home && strlen(home) + 12 < sizeof path) {
+			strcpy(path, home);
+			strcat(path, "/.gitconfig");
+			result = result ? result : config_parse(path, gitdir, fn, data);
+		}
+	}
+	return result;
+}
+
+// system, global, repository and work tree configuration, in the order git reads them
+static int config_read(const git_repo* repo, config_fn fn, void* data) {
+	char path[PATH_MAX];
+	int result = user_config_each(repo->gitdir, fn, data);
+
+	if (strlen(repo->commondir) + 8 > sizeof path) {
+		return result;
+	}
+	strcpy(path, repo->commondir);
+	strcat(path, "/config");
+	result = result ? result : config_parse(path, repo->gitdir, fn, data);
+	if (repo->worktree_config && strlen(repo->gitdir) + 17 < sizeof path) {
+		strcpy(path, repo->gitdir);
+		strcat(path, "/config.worktree");
+		result = result ? result : config_parse(path, repo->gitdir, fn, data);
+	}
+	return result;
+}
+
+static ssize_t config_string(git_config* config, const char* str) {
+	size_t len = strlen(str) + 1;
+	ssize_t at = config->len;
+
+	if (config->len + len > config->cap) {
+		char* strings = realloc(config->strings, (config->cap = (config->len + len) * 2 + 1024));
+		if (!strings) {
+			return -1;
+		}
+		config->strings = strings;
+	}
+	memcpy(config->strings + config->len, str, len);
+	config->len += len;
+	return at;
+}
+
+static int config_collect(const char* key, const char* value, void* data) {
+	git_config* config = data;
+	config_entry* e;
+
+	if (config->count == config->alloc) {
+		config_entry* entries = realloc(config->entries, (config->alloc = config->alloc * 2 + 64) * sizeof *entries);
+		if (!entries) {
+			return -1;
+		}
+		config->entries = entries;
+	}
+	e = &config->entries[config->count];
+	e->value = -1;
+	if ((e->key = config_string(config, key)) == -1 || (value && (e->value = config_string(config, value)) == -1)) {
+		return -1;
+	}
+	++config->count;
+	return 0;
+}
+
+// the same, parsed only once where the repository has a git_config
+int repo_config_each(const git_repo* repo, config_fn fn, void* data) {
+	git_config* config = repo->config;
+	int n, result;
+
+	if (!config) {
+		return config_read(repo, fn, data);
+	}
+	if (!config->loaded) {
+		config->loaded = 1;
+		config->result = config_read(repo, config_collect, config);
+	}
+	for (n = 0, result = 0; n < config->count && result == 0; ++n) {
+		const config_entry* e = &config->entries[n];
+		result = fn(config->strings + e->key, e->value == -1 ? NULL : config->strings + e->value, data);
+	}
+	return result ? result : config->result;
+}
+
+git_config* config_open() {
+	return calloc(1, sizeof(git_config));
+}
+
+void config_close(git_config* config) {
+	if (config) {
+		free(config->entries);
+		free(config->strings);
+		free(config);
+	}
+}
+
+const char* repo_config(const git_repo* repo, const char* key, char* buf, size_t size) {
+	config_lookup data = {key, buf, size, 0};
+	repo_config_each(repo, lookup, &data);
+	return data.found ? buf : NULL;
+}
+
+typedef struct {
+	const char* dir;
+	int safe;
+} safe_lookup;
+
+// "*" for all, "<dir>/*" for everything below it, an empty value forgets what came before
+static int safe_directory(const char* key, const char* value, void* data) {
+	safe_lookup* lookup = data;
+	char path[PATH_MAX], real[PATH_MAX];
+	int len;
+
+	if (strcmp(key, "safe.directory") != 0) {
+		return 0;
+	}
+	if (!value || !*value) {
+		lookup->safe = 0;
+	} else if (strcmp(value, "*") == 0) {
+		lookup->safe = 1;
+	} else if (config_path("", value, path) == 0) {
+		len = strlen(path);
+		if (len >= 2 && strcmp(path + len - 2, "/*") == 0) {
+			path[len - 2] = 0;
+			if (realpath(path, real)) {
+				strcpy(path, real);
+			}
+			len = strlen(path);
+			if (strncmp(lookup->dir, path, len) == 0 && (lookup->dir[len] == '/' || (len == 1 && *path == '/'))) {
+				lookup->safe = 1;
+			}
+		} else if (strcmp(lookup->dir, realpath(path, real) ? real : path) == 0) {
+			lookup->safe = 1;
+		}
+	}
+	return 0;
+}
+
+// 1 when safe.directory in the system or global config vouches for a repository someone else owns, the
+// repository's own config has no say in it
+int config_safe_directory(const char* dir) {
+	safe_lookup data = {dir, 0};
+	char real[PATH_MAX];
+
+	if (realpath(dir, real)) {
+		data.dir = real;
+	}
+	user_config_each(NULL, safe_directory, &data);
+	return data.safe;
+}
+
+int config_bool(const char* value, int def) {
+	if (!value) {
+		return def;
+	}
+	if (!strcasecmp(value, "true") || !strcasecmp(value, "yes") || !strcasecmp(value, "on") || !strcmp(value, "1")) {
+		return 1;
+	}
+	if (!*value || !strcasecmp(value, "false") || !strcasecmp(value, "no") || !strcasecmp(value, "off") || !strcmp(value, "0")) {
+		return 0;
+	}
+	return def;
+}
@@ -0,0 +1,146 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "git.h"
+
+#define DAEMON_MAXEVENTS 64
+
+typedef struct {
+	int fd;
+	daemon_fn compute;
+	daemon_request req;
+} daemon_job;
+
+// abstract, so there is nothing in the file system to clean up, and one per user
+static socklen_t address(struct sockaddr_un* addr) {
+	int len;
+
+	memset(addr, 0, sizeof *addr);
+	addr->sun_family = AF_UNIX;
+	len = snprintf(addr->sun_path + 1, sizeof addr->sun_path - 1, "prompt-%u", (unsigned)getuid());
+	return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+// an abstract socket has no permissions of its own, anyone can connect to it or take its name
+static int same_user(int fd) {
+	struct ucred cred;
+	socklen_t len = sizeof cred;
+	return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+static void* worker(void* data) {
+	daemon_job* job = data;
+	git_state gs;
+
+	job->compute(&job->req, &gs);
+	gs.magic = GIT_STATE_MAGIC;
+	send(job->fd, &gs, sizeof gs, MSG_NOSIGNAL);
+	close(job->fd);
+	free(job);
+	return NULL;
+}
+
+// reads a request off a connection and hands it to a thread of its own, a slow repository holds up nobody else
+static void request(int fd, daemon_fn compute) {
+	daemon_job* job = malloc(sizeof *job);
+	pthread_attr_t attr;
+	pthread_t thread;
+	ssize_t n;
+
+	if (!job || (n = recv(fd, &job->req, sizeof job->req - 1, 0)) <= (ssize_t)DAEMON_HEADER ||
+			job->req.magic != DAEMON_MAGIC) {
+		free(job);
+		close(fd);
+		return;
+	}
+	((char*)&job->req)[n] = 0;
+	job->fd = fd;
+	job->compute = compute;
+	fcntl(fd, F_SETFL, 0);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, worker, job) != 0) {
+		close(fd);
+		free(job);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+// serves until killed, -1 when it can't listen, as when another one already does
+int daemon_serve(daemon_fn compute) {
+	struct epoll_event ev, events[DAEMON_MAXEVENTS];
+	struct sockaddr_un addr;
+	socklen_t len = address(&addr);
+	int lfd, efd, n, i;
+
+	if ((lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) == -1) {
+		return -1;
+	}
+	if (bind(lfd, (struct sockaddr*)&addr, len) != 0 || listen(lfd, SOMAXCONN) != 0 ||
+			(efd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		close(lfd);
+		return -1;
+	}
+	ev.events = EPOLLIN;
+	ev.data.fd = lfd;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, lfd, &ev) != 0) {
+		close(efd);
+		close(lfd);
+		return -1;
+	}
+
+	for (;;) {
+		// git processes killed for being late are reaped once they have gone, now and then
+		n = epoll_wait(efd, events, DAEMON_MAXEVENTS, 1000);
+		deadline_reap();
+		if (n < 0) {
+			continue;
+		}
+		for (i = 0; i < n; ++i) {
+			int fd = events[i].data.fd;
+			if (fd != lfd) {
+				// a connection carries one request, it is the worker's from here on
+				epoll_ctl(efd, EPOLL_CTL_DEL, fd, NULL);
+				request(fd, compute);
+				continue;
+			}
+			while ((fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) != -1) {
+				ev.events = EPOLLIN;
+				ev.data.fd = fd;
+				if (!same_user(fd) || epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+					close(fd);
+				}
+			}
+		}
+	}
+}
+
+// 0 with the state when the daemon answered in time, -1 when there is none or it didn't
+int daemon_ask(const daemon_request* req, git_state* gs) {
+	struct sockaddr_un addr;
+	socklen_t len = address(&addr);
+	size_t size = DAEMON_HEADER + strlen(req->cwd);
+	struct pollfd pfd;
+	int fd, result = -1;
+
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) == -1) {
+		return -1;
+	}
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (connect(fd, (struct sockaddr*)&addr, len) == 0 && same_user(fd) &&
+			send(fd, req, size, MSG_NOSIGNAL) == size && poll(&pfd, 1, deadline_left()) > 0 &&
+			recv(fd, gs, sizeof *gs, 0) == sizeof *gs && gs->magic == GIT_STATE_MAGIC) {
+		result = 0;
+	}
+	close(fd);
+	return result;
+}
@@ -0,0 +1,103 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include "git.h"
+
+// each thread has its own, the daemon serves a prompt per thread
+static __thread struct timespec deadline;
+static __thread int armed;
+
+// children killed and not waited for, which a process that runs for long reaps later
+#define ABANDONED 64
+
+static pid_t abandoned[ABANDONED];
+static pthread_mutex_t abandoned_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// ms from now, 0 or less for none
+void deadline_set(long ms) {
+	armed = ms > 0;
+	if (armed) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += ms / 1000;
+		deadline.tv_nsec += ms % 1000 * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			++deadline.tv_sec;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+}
+
+// for threads doing part of another one's work, zero without a deadline
+struct timespec deadline_get() {
+	struct timespec none = {0, 0};
+	return armed ? deadline : none;
+}
+
+void deadline_adopt(struct timespec from) {
+	deadline = from;
+	armed = from.tv_sec || from.tv_nsec;
+}
+
+// the ms left, 0 once it has passed and -1 without a deadline, as poll takes it
+int deadline_left() {
+	struct timespec now;
+	long ms;
+
+	if (!armed) {
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec + 999999) / 1000000;
+	return ms > 0 ? ms : 0;
+}
+
+// waits for a child started in its own process group, which is killed with all it started if the deadline
+// passes first; 0 once it is reaped, -1 when it was killed and left behind
+int deadline_wait(pid_t pid, int* wstatus) {
+	const struct timespec tick = {0, 1000000};
+	pid_t r;
+
+	if (!armed) {
+		while ((r = waitpid(pid, wstatus, 0)) == -1 && errno == EINTR) {
+		}
+		return r == pid ? 0 : -1;
+	}
+	while ((r = waitpid(pid, wstatus, WNOHANG)) == 0 || (r == -1 && errno == EINTR)) {
+		if (deadline_left() == 0) {
+			// not waited for, it may be stuck where even SIGKILL takes a while
+			deadline_kill(pid);
+			return -1;
+		}
+		nanosleep(&tick, NULL);
+	}
+	return r == pid ? 0 : -1;
+}
+
+// kills a child started in its own process group, with all it started, and leaves it to deadline_reap
+void deadline_kill(pid_t pid) {
+	int n;
+
+	kill(-pid, SIGKILL);
+	pthread_mutex_lock(&abandoned_lock);
+	for (n = 0; n < ABANDONED && abandoned[n]; ++n) {
+	}
+	// with no room it stays a zombie, which only matters to the daemon
+	if (n < ABANDONED) {
+		abandoned[n] = pid;
+	}
+	pthread_mutex_unlock(&abandoned_lock);
+}
+
+void deadline_reap() {
+	int n;
+
+	pthread_mutex_lock(&abandoned_lock);
+	for (n = 0; n < ABANDONED; ++n) {
+		if (abandoned[n] && waitpid(abandoned[n], NULL, WNOHANG) != 0) {
+			abandoned[n] = 0;
+		}
+	}
+	pthread_mutex_unlock(&abandoned_lock);
+}
@@ -0,0 +1,188 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include "git.h"
+
+#define FSMONITOR_VERSION 2
+
+extern char** environ;
+
+static void mark(uint64_t* check, uint32_t n) {
+	check[n / 64] |= (uint64_t)1 << (n % 64);
+}
+
+// the entry itself and, should it be a directory, everything below it; path has room for a slash after it
+void index_mark(const git_index* index, uint64_t* check, char* path, int len) {
+	uint32_t n;
+
+	for (n = index_find(index, path, len); n < index->count; ++n) {
+		const index_entry* e = &index->entries[n];
+		if (e->len != len || memcmp(e->path, path, len) != 0) {
+			break;
+		}
+		mark(check, n);
+	}
+	path[len] = '/';
+	for (n = index_find(index, path, len + 1); n < index->count; ++n) {
+		const index_entry* e = &index->entries[n];
+		if (e->len <= len || memcmp(e->path, path, len + 1) != 0) {
+			break;
+		}
+		mark(check, n);
+	}
+	path[len] = 0;
+}
+
+// runs the hook the way git does, in the work tree and through the shell, and reads all it prints
+static char* run_hook(const git_repo* repo, const char* hook, const char* token, size_t* size) {
+	char* argv[] = {"sh", "-c", NULL, (char*)hook, "2", (char*)token, NULL};
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	struct pollfd pfd;
+	char *cmd, *buf = NULL;
+	size_t cap = 0, len = 0;
+	int c2p[2], wstatus, n = 0, ok = 0, late = 0;
+	pid_t pid = -1;
+
+	if (!(cmd = malloc(strlen(hook) + 8))) {
+		return NULL;
+	}
+	strcpy(cmd, hook);
+	strcat(cmd, " \"$@\"");
+	argv[2] = cmd;
+	if (pipe2(c2p, O_CLOEXEC) != 0) {
+		free(cmd);
+		return NULL;
+	}
+	posix_spawn_file_actions_init(&actions);
+	posix_spawnattr_init(&attr);
+	// its own process group, to be killed with whatever it starts when it runs out of time
+	posix_spawnattr_setpgroup(&attr, 0);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+	posix_spawn_file_actions_adddup2(&actions, c2p[1], 1);
+	posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+	posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 29)
+	if (posix_spawn_file_actions_addchdir_np(&actions, repo->worktree) == 0 &&
+			posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ) != 0) {
+		pid = -1;
+	}
+#endif
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	close(c2p[1]);
+	free(cmd);
+
+	if (pid != -1) {
+		do {
+			if (len + 1 >= cap) {
+				char* tmp;
+				cap = cap ? cap * 2 : 4096;
+				if (!(tmp = realloc(buf, cap))) {
+					break;
+				}
+				buf = tmp;
+			}
+			pfd.fd = c2p[0];
+			pfd.events = POLLIN;
+			if ((n = poll(&pfd, 1, deadline_left())) == 0) {
+				// out of time, everything gets a stat call instead
+				deadline_kill(pid);
+				late = 1;
+				break;
+			}
+			n = n > 0 ? read(c2p[0], buf + len, cap - len - 1) : -1;
+			if (n > 0) {
+				len += n;
+			}
+		} while (n > 0 || (n == -1 && errno == EINTR));
+		close(c2p[0]);
+		// a hook killed for being late is not waited for
+		ok = !late && deadline_wait(pid, &wstatus) == 0 && n == 0 && WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0;
+	} else {
+		close(c2p[0]);
+	}
+	if (!ok) {
+		free(buf);
+		return NULL;
+	}
+	buf[len] = 0;
+	*size = len;
+	return buf;
+}
+
+// the entries the dirty check still has to stat, as a bitmap over the index; NULL when it has to stat them all
+uint64_t* index_fsmonitor(const git_index* index, const git_repo* repo) {
+	char hook[PATH_MAX], tmp[16];
+	const unsigned char *p, *end;
+	const char *version, *token;
+	uint64_t *dirty, *check;
+	uint32_t bits;
+	char *out, *path, *stop;
+	size_t size, words;
+
+	// core.fsmonitor=true is git's own daemon, only hooks are asked
+	if (!repo_config(repo, "core.fsmonitor", hook, sizeof hook) || config_bool(hook, -1) != -1) {
+		return NULL;
+	}
+	version = repo_config(repo, "core.fsmonitorHookVersion", tmp, sizeof tmp);
+	if ((version && atoi(version) != FSMONITOR_VERSION) || !(p = index_extension(index, "FSMN", &size))) {
+		return NULL;
+	}
+
+	// version, the token it was written with and the entries that were not known to be unchanged then
+	end = p + size;
+	if (size < 4 || get_be32(p) != FSMONITOR_VERSION || !(stop = memchr(p + 4, 0, end - p - 4))) {
+		return NULL;
+	}
+	token = (const char*)p + 4;
+	p = (const unsigned char*)stop + 1;
+	if (end - p < 4 || get_be32(p) > end - p - 4) {
+		return NULL;
+	}
+	end = p + 4 + get_be32(p);
+	p += 4;
+	if (!(dirty = ewah_decode(&p, end, &bits))) {
+		return NULL;
+	}
+	words = ((size_t)index->count + 63) / 64;
+	if (bits > index->count || !(check = calloc(words + 1, sizeof *check))) {
+		free(dirty);
+		return NULL;
+	}
+	// the bitmap ends with the last entry that wasn't valid, the ones after it were
+	memcpy(check, dirty, ((size_t)bits + 63) / 64 * sizeof *check);
+	free(dirty);
+
+	// what changed since: a new token, then the paths, all NUL terminated
+	if (!(out = run_hook(repo, hook, token, &size)) ||
+			!(path = memchr(out, 0, size + 1)) || path == out) {
+		free(out);
+		free(check);
+		return NULL;
+	}
+	for (++path; path < out + size; path += strlen(path) + 1) {
+		int len = strlen(path);
+		// "/" means the hook lost track and everything has to be looked at
+		if (strcmp(path, "/") == 0) {
+			free(out);
+			free(check);
+			return NULL;
+		}
+		if (len && path[len - 1] == '/') {
+			path[--len] = 0;
+		}
+		if (len) {
+			index_mark(index, check, path, len);
+		}
+	}
+	free(out);
+	return check;
+}
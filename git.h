@@ -0,0 +1,301 @@
+#ifndef GIT_H
+#define GIT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include <linux/limits.h>
+
+#define GIT_MAX_RAWSZ 32
+// refs looked at for a name for a detached HEAD, past that it is shown as the abbreviated commit
+#define NAME_BUDGET 65536
+
+// index entry flags
+#define CE_VALID 0x8000
+#define CE_EXTENDED 0x4000
+#define CE_STAGEMASK 0x3000
+#define CE_NAMEMASK 0x0fff
+#define CE_SKIP_WORKTREE 0x4000
+#define CE_INTENT_TO_ADD 0x2000
+
+typedef struct {
+	uint32_t ctime_sec, ctime_nsec;
+	uint32_t mtime_sec, mtime_nsec;
+	uint32_t dev, ino, mode, uid, gid, size;
+	const unsigned char* oid;
+	uint16_t flags, xflags;
+	const char* path;
+	int len;
+} index_entry;
+
+// the stat data the dirty check compares, held as columns of the index
+#define STAT_COLUMNS 8
+enum { COL_MTIME_SEC, COL_MTIME_NSEC, COL_CTIME_SEC, COL_CTIME_NSEC, COL_INO, COL_UID, COL_GID, COL_SIZE };
+
+typedef struct git_index {
+	void* map;
+	size_t mapsize;
+	uint32_t version;
+	uint32_t count;
+	uint32_t skipped;
+	int rawsz;
+	struct timespec mtime;
+	index_entry* entries;
+	uint32_t* columns;
+	char* paths;
+	const unsigned char* ext;
+	size_t extsize;
+	// the shared index of a split one, which entries point into
+	struct git_index* shared;
+} git_index;
+
+#define OBJ_COMMIT 1
+#define OBJ_TREE 2
+#define OBJ_BLOB 3
+#define OBJ_TAG 4
+
+typedef struct git_odb git_odb;
+typedef struct git_config git_config;
+
+typedef struct {
+	char gitdir[PATH_MAX];
+	char commondir[PATH_MAX];
+	char objdir[PATH_MAX];
+	char worktree[PATH_MAX];
+	int inside;
+	int bare;
+	int intree;
+	int rawsz;
+	int reftable;
+	int worktree_config;
+	// set by whoever wants objects read through open packs, see odb_open
+	git_odb* odb;
+	// set by whoever asks for more than one key, see config_open
+	git_config* config;
+} git_repo;
+
+typedef struct {
+	char* map;
+	size_t size;
+	const char* records;
+	int sorted;
+	int peeled;
+	int rawsz;
+} packed_refs;
+
+typedef struct {
+	const char* oid;
+	const char* peeled;
+	const char* name;
+	int namelen;
+} packed_ref;
+
+typedef struct {
+	const char* name;
+	int namelen;
+	int entries;
+	int subtrees;
+	int span;
+	const unsigned char* oid;
+} cache_tree;
+
+typedef struct {
+	void* map;
+	size_t size;
+	const unsigned char* fanout;
+	const unsigned char* oids;
+	const unsigned char* data;
+	size_t datasize;
+	const unsigned char* edges;
+	size_t edgecount;
+	uint32_t count;
+	uint32_t base;
+} graph_layer;
+
+typedef struct {
+	graph_layer* layers;
+	int nlayers;
+	uint32_t count;
+	int rawsz;
+} commit_graph;
+
+#define IGNORE_MAXDEPTH 256
+
+typedef struct ignore_file ignore_file;
+
+// the exclude files and the stack of .gitignore files down to the directory last asked about
+typedef struct {
+	int dirfd;
+	ignore_file* info;
+	ignore_file* global;
+	ignore_file** cache;
+	size_t cachesize, cached;
+	ignore_file* files[IGNORE_MAXDEPTH];
+	int lens[IGNORE_MAXDEPTH];
+	int depth;
+	char dir[PATH_MAX];
+} ignore;
+
+typedef struct {
+	int fd;
+	unsigned entries;
+	unsigned pending;
+	void* sq;
+	void* cq;
+	void* sqes;
+	void* cqes;
+	size_t sqsize, cqsize;
+	uint32_t *sqhead, *sqtail, *sqarray, *cqhead, *cqtail;
+	uint32_t sqmask, cqmask;
+} uring;
+
+// a SHA-1 or SHA-256 context, which one going by the object id size
+typedef struct {
+	uint32_t state[8];
+	unsigned char buf[64];
+	uint64_t len;
+	int rawsz;
+} git_hash;
+
+static inline uint32_t get_be16(const unsigned char* p) {
+	return (uint32_t)p[0] << 8 | p[1];
+}
+
+static inline uint32_t get_be32(const unsigned char* p) {
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// where in a repository the prompt is
+enum { REPO_OTHER, REPO_WORKTREE, REPO_GITDIR, REPO_BARE };
+
+// what the prompt asks of a repository, through the handle discover returns; the markers come back as they
+// are shown, NULL when they don't apply
+typedef struct {
+	const char* name;
+	void* (*discover)(const char* cwd);
+	int (*location)(void* repo);
+	const char* (*head)(void* repo, char* buf, size_t size, int* detached);
+	const char* (*operation)(void* repo, char* buf, size_t size, char* branch, size_t bsize);
+	const char* (*dirty)(void* repo);
+	const char* (*staged)(void* repo);
+	const char* (*stash)(void* repo);
+	const char* (*untracked)(void* repo);
+	const char* (*upstream)(void* repo);
+	void (*close)(void* repo);
+} git_backend;
+
+#define GIT_STATE_MAGIC 0x50535431
+
+// the git section as shown, empty strings for what isn't
+typedef struct {
+	uint32_t magic;
+	int location;
+	int detached;
+	char c[8], b[256], w[8], i[8], s[8], u[8], r[256], p[8];
+} git_state;
+
+#define DAEMON_MAGIC 0x50534451
+#define DAEMON_HEADER offsetof(daemon_request, cwd)
+
+// what a prompt asks the daemon, only as much of cwd is sent as there is
+typedef struct {
+	uint32_t magic;
+	// ms, 0 for none
+	uint16_t deadline;
+	uint8_t backend;
+	uint8_t reserved;
+	char cwd[PATH_MAX];
+} daemon_request;
+
+// the state is the answer, location -1 when cwd isn't in a repository; it is called on a thread of its own for every
+// request, so what it keeps beyond the call, like packs and parsed config, is per git_repo or locked
+typedef void (*daemon_fn)(const daemon_request* req, git_state* gs);
+
+int hex2oid(const char* hex, unsigned char* oid, int rawsz);
+char* oid2hex(const unsigned char* oid, int rawsz, char* hex);
+
+typedef int (*config_fn)(const char* key, const char* value, void* data);
+
+int config_parse(const char* path, const char* gitdir, config_fn fn, void* data);
+const char* config_get(const char* path, const char* gitdir, const char* key, char* buf, size_t size);
+int repo_config_each(const git_repo* repo, config_fn fn, void* data);
+const char* repo_config(const git_repo* repo, const char* key, char* buf, size_t size);
+int config_bool(const char* value, int def);
+int config_safe_directory(const char* dir);
+git_config* config_open();
+void config_close(git_config* config);
+
+int repo_discover(git_repo* repo, const char* cwd);
+void repo_operation(const char* gitdir, char* op, size_t size, char* branch, size_t bsize);
+
+int index_open(git_index* index, const char* path, int rawsz);
+void index_close(git_index* index);
+int index_clean(const git_index* index, const char* worktree, const uint64_t* check);
+int index_entry_clean(const git_index* index, uint32_t n, int dirfd);
+uint32_t index_find(const git_index* index, const char* path, int len);
+uint64_t* ewah_decode(const unsigned char** p, const unsigned char* end, uint32_t* bits);
+void stat_compare(const uint32_t* index, size_t stride, const uint32_t* stat, size_t statstride,
+	uint32_t racy, size_t count, unsigned char* out);
+const unsigned char* index_extension(const git_index* index, const char* sig, size_t* size);
+int index_matches_tree(const git_index* index, const git_repo* repo, const unsigned char* tree);
+int index_untracked(const git_index* index, const git_repo* repo);
+int worktree_untracked(const git_index* index, const git_repo* repo);
+uint64_t* index_fsmonitor(const git_index* index, const git_repo* repo);
+void index_mark(const git_index* index, uint64_t* check, char* path, int len);
+uint64_t* watch_check(const git_index* index, const git_repo* repo, unsigned long* generation);
+void watch_settle(unsigned long generation, const git_index* index, int clean);
+
+const char* excludes_file(const git_repo* repo, char* path);
+int ignore_open(ignore* ig, const git_repo* repo, int dirfd);
+void ignore_close(ignore* ig);
+int ignore_match(ignore* ig, const char* path, int isdir);
+
+extern const git_backend libgit2_backend;
+
+void deadline_set(long ms);
+struct timespec deadline_get();
+void deadline_adopt(struct timespec from);
+int deadline_left();
+int deadline_wait(pid_t pid, int* wstatus);
+void deadline_kill(pid_t pid);
+void deadline_reap();
+
+int daemon_serve(daemon_fn compute);
+int daemon_ask(const daemon_request* req, git_state* gs);
+
+void hash_init(git_hash* ctx, int rawsz);
+void hash_update(git_hash* ctx, const void* data, size_t len);
+void hash_final(git_hash* ctx, unsigned char* out);
+
+int uring_open(uring* ring, unsigned entries);
+void uring_close(uring* ring);
+int uring_statx(uring* ring, int dirfd, const char* path, void* buf, uint64_t data);
+int uring_submit(uring* ring, unsigned wait);
+int uring_reap(uring* ring, uint64_t* data, int* result);
+
+int packed_open(packed_refs* packed, const git_repo* repo);
+void packed_close(packed_refs* packed);
+const char* packed_record(const packed_refs* packed, const char* p, packed_ref* ref);
+int packed_find(const packed_refs* packed, const char* name, unsigned char* oid, unsigned char* peeled);
+int reftable_lookup(const char* dir, const char* name, int rawsz, unsigned char* oid, char* target, size_t size);
+int ref_symbolic(const git_repo* repo, const char* name, char* target, size_t size);
+int ref_resolve(const git_repo* repo, const char* name, unsigned char* oid);
+int ref_name_commit(const git_repo* repo, const unsigned char* oid, char* buf, size_t size);
+int ref_upstream(const git_repo* repo, const char* branch, char* upstream, size_t size);
+
+git_odb* odb_open();
+void odb_close(git_odb* odb);
+void* odb_read(const git_repo* repo, const unsigned char* oid, int* type, size_t* size);
+int commit_tree(const git_repo* repo, const unsigned char* commit, unsigned char* tree);
+int commit_parents(const git_repo* repo, const unsigned char* commit, unsigned char* parents, int max);
+
+int graph_open(commit_graph* graph, const git_repo* repo);
+void graph_close(commit_graph* graph);
+int graph_find(const commit_graph* graph, const unsigned char* oid, uint32_t* pos);
+uint32_t graph_generation(const commit_graph* graph, uint32_t pos);
+int graph_parents(const commit_graph* graph, uint32_t pos, uint32_t* parents, int max);
+int graph_ahead_behind(const git_repo* repo, const unsigned char* local, const unsigned char* upstream,
+		int max, int* ahead, int* behind);
+
+#endif
@@ -0,0 +1,403 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+#include "git.h"
+
+#define GRAPH_NO_PARENT 0x70000000
+#define GRAPH_EXTENDED 0x80000000
+#define GRAPH_MAXLAYERS 64
+
+// commits walked before the count is given up on, and commits read from objects
+#define WALK_BUDGET 100000
+#define EXTRA_BUDGET 256
+#define EXTRA_MAXPARENTS 16
+
+enum { LEFT = 1, RIGHT = 2, BOTH = 3, QUEUED = 4, DONE = 8 };
+
+static void layer_close(graph_layer* layer) {
+	if (layer->map) {
+		munmap(layer->map, layer->size);
+		layer->map = NULL;
+	}
+}
+
+static int layer_open(graph_layer* layer, const char* path, int rawsz, uint32_t base) {
+	const unsigned char *map, *chunk;
+	struct stat st;
+	int fd, n, chunks;
+
+	memset(layer, 0, sizeof *layer);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		return -1;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < 8 + 12 ||
+			(layer->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	layer->size = st.st_size;
+	layer->base = base;
+
+	// "CGPH", version 1, hash version, chunk count, base graph count
+	map = layer->map;
+	chunks = map[6];
+	if (memcmp(map, "CGPH", 4) != 0 || map[4] != 1 || map[5] != (rawsz == 32 ? 2 : 1) ||
+			8 + 12 * (chunks + 1) > st.st_size) {
+		layer_close(layer);
+		return -1;
+	}
+	for (n = 0, chunk = map + 8; n < chunks; ++n, chunk += 12) {
+		uint64_t offset = (uint64_t)get_be32(chunk + 4) << 32 | get_be32(chunk + 8);
+		uint64_t next = (uint64_t)get_be32(chunk + 16) << 32 | get_be32(chunk + 20);
+		if (next < offset || next > st.st_size) {
+			layer_close(layer);
+			return -1;
+		}
+		if (memcmp(chunk, "OIDF", 4) == 0 && next - offset == 256 * 4) {
+			layer->fanout = map + offset;
+		} else if (memcmp(chunk, "OIDL", 4) == 0) {
+			layer->oids = map + offset;
+			layer->count = (next - offset) / rawsz;
+		} else if (memcmp(chunk, "CDAT", 4) == 0) {
+			layer->data = map + offset;
+			layer->datasize = next - offset;
+		} else if (memcmp(chunk, "EDGE", 4) == 0) {
+			layer->edges = map + offset;
+			layer->edgecount = (next - offset) / 4;
+		}
+	}
+	if (!layer->fanout || !layer->oids || !layer->data || get_be32(layer->fanout + 255 * 4) != layer->count ||
+			layer->datasize < (size_t)layer->count * (rawsz + 16)) {
+		layer_close(layer);
+		return -1;
+	}
+	return 0;
+}
+
+// a split graph lists its layers base first in commit-graph-chain
+int graph_open(commit_graph* graph, const git_repo* repo) {
+	char path[PATH_MAX], line[2 * GIT_MAX_RAWSZ + 2];
+	size_t len = strlen(repo->objdir);
+	int broken = 0;
+	FILE* chain;
+
+	memset(graph, 0, sizeof *graph);
+	graph->rawsz = repo->rawsz;
+	if (len + 64 + 2 * GIT_MAX_RAWSZ > sizeof path) {
+		return -1;
+	}
+	strcpy(path, repo->objdir);
+	strcat(path, "/info/commit-graphs/commit-graph-chain");
+	if ((chain = fopen(path, "re"))) {
+		if (!(graph->layers = calloc(GRAPH_MAXLAYERS, sizeof *graph->layers))) {
+			fclose(chain);
+			return -1;
+		}
+		while (fgets(line, sizeof line, chain)) {
+			graph_layer* layer = &graph->layers[graph->nlayers];
+			if (strlen(line) != 2 * repo->rawsz + 1 || graph->nlayers == GRAPH_MAXLAYERS) {
+				broken = 1;
+				break;
+			}
+			line[2 * repo->rawsz] = 0;
+			strcpy(path + len, "/info/commit-graphs/graph-");
+			strcat(path, line);
+			strcat(path, ".graph");
+			if (layer_open(layer, path, repo->rawsz, graph->count) != 0) {
+				broken = 1;
+				break;
+			}
+			graph->count += layer->count;
+			++graph->nlayers;
+		}
+		fclose(chain);
+		// parents may point into any lower layer, a missing one spoils the whole chain
+		if (broken || !graph->nlayers) {
+			graph_close(graph);
+			return -1;
+		}
+		return 0;
+	}
+
+	strcpy(path + len, "/info/commit-graph");
+	if (!(graph->layers = calloc(1, sizeof *graph->layers)) || layer_open(graph->layers, path, repo->rawsz, 0) != 0) {
+		free(graph->layers);
+		graph->layers = NULL;
+		return -1;
+	}
+	graph->nlayers = 1;
+	graph->count = graph->layers->count;
+	return 0;
+}
+
+void graph_close(commit_graph* graph) {
+	int n;
+	for (n = 0; n < graph->nlayers; ++n) {
+		layer_close(&graph->layers[n]);
+	}
+	free(graph->layers);
+	graph->layers = NULL;
+	graph->nlayers = 0;
+}
+
+int graph_find(const commit_graph* graph, const unsigned char* oid, uint32_t* pos) {
+	int n, rawsz = graph->rawsz;
+
+	// newer layers first, they are the smaller ones
+	for (n = graph->nlayers - 1; n >= 0; --n) {
+		const graph_layer* layer = &graph->layers[n];
+		uint32_t lo = *oid ? get_be32(layer->fanout + (*oid - 1) * 4) : 0;
+		uint32_t hi = get_be32(layer->fanout + *oid * 4);
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			int cmp = memcmp(layer->oids + (size_t)mid * rawsz, oid, rawsz);
+			if (cmp == 0) {
+				*pos = layer->base + mid;
+				return 0;
+			}
+			if (cmp < 0) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+	}
+	return -1;
+}
+
+static const graph_layer* graph_layer_of(const commit_graph* graph, uint32_t pos) {
+	int n;
+	for (n = graph->nlayers - 1; n > 0 && pos < graph->layers[n].base; --n) {
+	}
+	return &graph->layers[n];
+}
+
+// the topological level, parents always have a lower one
+uint32_t graph_generation(const commit_graph* graph, uint32_t pos) {
+	const graph_layer* layer = graph_layer_of(graph, pos);
+	return get_be32(layer->data + (size_t)(pos - layer->base) * (graph->rawsz + 16) + graph->rawsz + 8) >> 2;
+}
+
+int graph_parents(const commit_graph* graph, uint32_t pos, uint32_t* parents, int max) {
+	const graph_layer* layer = graph_layer_of(graph, pos);
+	const unsigned char* data = layer->data + (size_t)(pos - layer->base) * (graph->rawsz + 16) + graph->rawsz;
+	uint32_t first = get_be32(data), second = get_be32(data + 4), edge;
+	int count = 0;
+
+	if (first == GRAPH_NO_PARENT) {
+		return 0;
+	}
+	if (first >= graph->count || max < 1) {
+		return -1;
+	}
+	parents[count++] = first;
+	if (second == GRAPH_NO_PARENT) {
+		return count;
+	}
+	if (!(second & GRAPH_EXTENDED)) {
+		if (second >= graph->count || max < 2) {
+			return -1;
+		}
+		parents[count++] = second;
+		return count;
+	}
+	// octopus merges keep the rest of their parents in the edge list, the last one marked
+	for (edge = second & ~GRAPH_EXTENDED; edge < layer->edgecount; ++edge) {
+		uint32_t parent = get_be32(layer->edges + edge * 4);
+		if ((parent & ~GRAPH_EXTENDED) >= graph->count || count == max) {
+			return -1;
+		}
+		parents[count++] = parent & ~GRAPH_EXTENDED;
+		if (parent & GRAPH_EXTENDED) {
+			return count;
+		}
+	}
+	return -1;
+}
+
+// commits newer than the graph are read from objects, and numbered after it
+typedef struct {
+	unsigned char oid[GIT_MAX_RAWSZ];
+	uint32_t generation;
+	uint32_t parents[EXTRA_MAXPARENTS];
+	int nparents;
+} extra_commit;
+
+typedef struct {
+	const git_repo* repo;
+	commit_graph graph;
+	extra_commit* extra;
+	int nextra;
+	uint32_t* heap;
+	uint32_t* generations;
+	int heapsize;
+	unsigned char* flags;
+	int nonstale;
+} graph_walk;
+
+static uint32_t generation(const graph_walk* walk, uint32_t node) {
+	return node < walk->graph.count ? graph_generation(&walk->graph, node) : walk->extra[node - walk->graph.count].generation;
+}
+
+static int node_of(graph_walk* walk, const unsigned char* oid, uint32_t* node) {
+	unsigned char parents[EXTRA_MAXPARENTS * GIT_MAX_RAWSZ];
+	uint32_t ids[EXTRA_MAXPARENTS], level = 1;
+	int rawsz = walk->repo->rawsz, count, n;
+	extra_commit* commit;
+
+	if (walk->graph.nlayers && graph_find(&walk->graph, oid, node) == 0) {
+		return 0;
+	}
+	for (n = 0; n < walk->nextra; ++n) {
+		if (memcmp(walk->extra[n].oid, oid, rawsz) == 0) {
+			*node = walk->graph.count + n;
+			return 0;
+		}
+	}
+	if (walk->nextra == EXTRA_BUDGET ||
+			(count = commit_parents(walk->repo, oid, parents, EXTRA_MAXPARENTS)) < 0) {
+		return -1;
+	}
+	// parents first, so the generation is known before the commit is added
+	for (n = 0; n < count; ++n) {
+		uint32_t gen;
+		if (node_of(walk, parents + n * rawsz, &ids[n]) != 0) {
+			return -1;
+		}
+		if ((gen = generation(walk, ids[n]) + 1) > level) {
+			level = gen;
+		}
+	}
+	if (walk->nextra == EXTRA_BUDGET) {
+		return -1;
+	}
+	commit = &walk->extra[walk->nextra];
+	memcpy(commit->oid, oid, rawsz);
+	memcpy(commit->parents, ids, count * sizeof *ids);
+	commit->nparents = count;
+	commit->generation = level;
+	*node = walk->graph.count + walk->nextra++;
+	return 0;
+}
+
+static void heap_push(graph_walk* walk, uint32_t node) {
+	uint32_t gen = generation(walk, node);
+	int n = walk->heapsize++;
+
+	while (n > 0 && walk->generations[(n - 1) / 2] < gen) {
+		walk->heap[n] = walk->heap[(n - 1) / 2];
+		walk->generations[n] = walk->generations[(n - 1) / 2];
+		n = (n - 1) / 2;
+	}
+	walk->heap[n] = node;
+	walk->generations[n] = gen;
+}
+
+static uint32_t heap_pop(graph_walk* walk) {
+	uint32_t top = walk->heap[0], node, gen;
+	int n = 0, child;
+
+	node = walk->heap[--walk->heapsize];
+	gen = walk->generations[walk->heapsize];
+	while ((child = 2 * n + 1) < walk->heapsize) {
+		if (child + 1 < walk->heapsize && walk->generations[child + 1] > walk->generations[child]) {
+			++child;
+		}
+		if (walk->generations[child] <= gen) {
+			break;
+		}
+		walk->heap[n] = walk->heap[child];
+		walk->generations[n] = walk->generations[child];
+		n = child;
+	}
+	walk->heap[n] = node;
+	walk->generations[n] = gen;
+	return top;
+}
+
+static void mark(graph_walk* walk, uint32_t node, int side) {
+	int flags = walk->flags[node];
+
+	if (flags & DONE) {
+		return;
+	}
+	if (!(flags & QUEUED)) {
+		walk->flags[node] = QUEUED | side;
+		walk->nonstale += side != BOTH;
+		heap_push(walk, node);
+	} else if ((flags & BOTH) != BOTH && ((flags | side) & BOTH) == BOTH) {
+		// reachable from both sides now, it no longer keeps the walk going
+		walk->flags[node] |= side;
+		--walk->nonstale;
+	} else {
+		walk->flags[node] |= side;
+	}
+}
+
+// commits only reachable from local and only from upstream, as rev-list --left-right counts them;
+// 1 once both counts reach max, -1 when the graph and the loose objects can't settle it
+int graph_ahead_behind(const git_repo* repo, const unsigned char* local, const unsigned char* upstream,
+		int max, int* ahead, int* behind) {
+	graph_walk walk;
+	uint32_t left, right, parents[EXTRA_MAXPARENTS];
+	int result = -1, visited = 0, count, n;
+
+	memset(&walk, 0, sizeof walk);
+	walk.repo = repo;
+	*ahead = *behind = 0;
+	graph_open(&walk.graph, repo);
+	if (!(walk.extra = malloc(EXTRA_BUDGET * sizeof *walk.extra)) ||
+			node_of(&walk, local, &left) != 0 || node_of(&walk, upstream, &right) != 0 ||
+			!(walk.flags = calloc(walk.graph.count + EXTRA_BUDGET, 1)) ||
+			!(walk.heap = malloc(WALK_BUDGET * 2 * sizeof *walk.heap)) ||
+			!(walk.generations = malloc(WALK_BUDGET * 2 * sizeof *walk.generations))) {
+		goto done;
+	}
+
+	mark(&walk, left, LEFT);
+	mark(&walk, right, RIGHT);
+	// a commit is final once popped, everything that reaches it has a higher generation
+	while (walk.nonstale) {
+		uint32_t node = heap_pop(&walk);
+		int side = walk.flags[node] & BOTH;
+
+		walk.flags[node] |= DONE;
+		if (side != BOTH) {
+			--walk.nonstale;
+			*ahead += side == LEFT;
+			*behind += side == RIGHT;
+		}
+		if (*ahead >= max && *behind >= max) {
+			result = 1;
+			goto done;
+		}
+		if (node < walk.graph.count) {
+			count = graph_parents(&walk.graph, node, parents, EXTRA_MAXPARENTS);
+		} else {
+			extra_commit* commit = &walk.extra[node - walk.graph.count];
+			memcpy(parents, commit->parents, commit->nparents * sizeof *parents);
+			count = commit->nparents;
+		}
+		if (count < 0 || ++visited == WALK_BUDGET || walk.heapsize + count > WALK_BUDGET * 2) {
+			goto done;
+		}
+		for (n = 0; n < count; ++n) {
+			mark(&walk, parents[n], side);
+		}
+	}
+	result = 0;
+
+done:
+	free(walk.generations);
+	free(walk.heap);
+	free(walk.flags);
+	free(walk.extra);
+	graph_close(&walk.graph);
+	return result;
+}
@@ -0,0 +1,599 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "git.h"
+
+#define IGNORE_NEGATIVE 1
+#define IGNORE_MUSTBEDIR 2
+#define IGNORE_NODIR 4
+#define IGNORE_ENDSWITH 8
+
+// the buckets patterns are kept in: whole basenames, extensions, leading directories, and the first
+// character of the basename or path where that's all there is; whatever doesn't fit one is tried in turn
+enum { BUCKET_LITERAL, BUCKET_EXTENSION, BUCKET_PREFIX, BUCKET_BASECHAR, BUCKET_PATHCHAR };
+
+#define WILD_MATCH 1
+#define WILD_NOMATCH 0
+#define WILD_ABORT_ALL -1
+#define WILD_ABORT_TO_STARSTAR -2
+
+typedef struct {
+	const char* text;
+	int len;
+	int prefix;
+	int flags;
+} ignore_pattern;
+
+typedef struct {
+	const char* key;
+	int keylen;
+	int kind;
+	int pattern;
+	int next;
+} ignore_link;
+
+struct ignore_file {
+	char dir[PATH_MAX];
+	int dirlen;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime, ctime;
+	char* buf;
+	ignore_pattern* patterns;
+	int count;
+	// hash chains over the links, newest pattern first
+	int* heads;
+	uint32_t mask;
+	ignore_link* links;
+	int nlinks;
+	int* others;
+	int nothers;
+};
+
+static uint32_t hash(int kind, const char* key, int len) {
+	uint32_t h = 2166136261u ^ kind;
+	int n;
+
+	for (n = 0; n < len; ++n) {
+		h = (h ^ (unsigned char)key[n]) * 16777619u;
+	}
+	return h;
+}
+
+static int wild_class(const char* name, int len, unsigned char c) {
+	static const struct {
+		const char* name;
+		int (*fn)(int);
+	} classes[] = {
+		{"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"cntrl", iscntrl}, {"digit", isdigit},
+		{"graph", isgraph}, {"lower", islower}, {"print", isprint}, {"punct", ispunct}, {"space", isspace},
+		{"upper", isupper}, {"xdigit", isxdigit},
+	};
+	int n;
+
+	for (n = 0; n < sizeof classes / sizeof *classes; ++n) {
+		if (strlen(classes[n].name) == len && strncmp(classes[n].name, name, len) == 0) {
+			return classes[n].fn(c) != 0;
+		}
+	}
+	return -1;
+}
+
+// git's wildmatch with WM_PATHNAME: '*' and '?' stop at slashes, "**" between slashes crosses them
+static int wildmatch(const char* pattern, const char* p, const char* text) {
+	unsigned char pc;
+
+	for (; (pc = *p); ++text, ++p) {
+		unsigned char tc = *text, prev;
+		int matched, slash, negated;
+
+		if (!tc && pc != '*') {
+			return WILD_ABORT_ALL;
+		}
+		switch (pc) {
+		case '\\':
+			pc = *++p;
+			// fall through
+		default:
+			if (tc != pc) {
+				return WILD_NOMATCH;
+			}
+			continue;
+		case '?':
+			if (tc == '/') {
+				return WILD_NOMATCH;
+			}
+			continue;
+		case '*':
+			if (*++p == '*') {
+				const char* before = p - 2;
+				while (*++p == '*') {
+				}
+				if ((before < pattern || *before == '/') && (!*p || *p == '/' || (*p == '\\' && p[1] == '/'))) {
+					// "**/" matches no directory at all as well
+					if (*p == '/' && wildmatch(pattern, p + 1, text) == WILD_MATCH) {
+						return WILD_MATCH;
+					}
+					slash = 1;
+				} else {
+					slash = 0;
+				}
+			} else {
+				slash = 0;
+			}
+			if (!*p) {
+				return slash || !strchr(text, '/') ? WILD_MATCH : WILD_NOMATCH;
+			} else if (!slash && *p == '/') {
+				// the slash itself is matched by the loop
+				if (!(text = strchr(text, '/'))) {
+					return WILD_NOMATCH;
+				}
+				break;
+			}
+			for (; tc; tc = *++text) {
+				if ((matched = wildmatch(pattern, p, text)) != WILD_NOMATCH) {
+					if (!slash || matched != WILD_ABORT_TO_STARSTAR) {
+						return matched;
+					}
+				} else if (!slash && tc == '/') {
+					return WILD_ABORT_TO_STARSTAR;
+				}
+			}
+			return WILD_ABORT_ALL;
+		case '[':
+			pc = *++p;
+			if ((negated = pc == '!' || pc == '^')) {
+				pc = *++p;
+			}
+			prev = 0;
+			matched = 0;
+			do {
+				if (!pc) {
+					return WILD_ABORT_ALL;
+				}
+				if (pc == '\\') {
+					if (!(pc = *++p)) {
+						return WILD_ABORT_ALL;
+					}
+					matched |= tc == pc;
+				} else if (pc == '-' && prev && p[1] && p[1] != ']') {
+					if ((pc = *++p) == '\\' && !(pc = *++p)) {
+						return WILD_ABORT_ALL;
+					}
+					matched |= tc >= prev && tc <= pc;
+					pc = 0;
+				} else if (pc == '[' && p[1] == ':') {
+					const char* name = p + 2;
+					const char* end = strstr(name, ":]");
+					int found;
+					if (!end || (found = wild_class(name, end - name, tc)) < 0) {
+						return WILD_ABORT_ALL;
+					}
+					matched |= found;
+					p = end + 1;
+					pc = 0;
+				} else {
+					matched |= tc == pc;
+				}
+			} while (prev = pc, (pc = *++p) != ']');
+			if (matched == negated || tc == '/') {
+				return WILD_NOMATCH;
+			}
+			continue;
+		}
+	}
+	return *text ? WILD_NOMATCH : WILD_MATCH;
+}
+
+// spaces at the end don't count, unless escaped
+static void trim(char* line) {
+	char *p, *space = NULL;
+
+	for (p = line; *p; ++p) {
+		if (*p == ' ') {
+			if (!space) {
+				space = p;
+			}
+		} else {
+			if (*p == '\\' && !*++p) {
+				return;
+			}
+			space = NULL;
+		}
+	}
+	if (space) {
+		*space = 0;
+	}
+}
+
+static void add_link(ignore_file* file, int kind, const char* key, int keylen, int pattern) {
+	ignore_link* link = &file->links[file->nlinks];
+	uint32_t h = hash(kind, key, keylen) & file->mask;
+
+	link->key = key;
+	link->keylen = keylen;
+	link->kind = kind;
+	link->pattern = pattern;
+	link->next = file->heads[h];
+	file->heads[h] = file->nlinks++;
+}
+
+// parses the patterns and sorts them into buckets, lines are cut up in place
+static int compile(ignore_file* file, char* buf, size_t size) {
+	char *line, *next, *end = buf + size;
+	int lines = 1, n;
+	uint32_t buckets = 16;
+
+	for (line = buf; line < end; ++line) {
+		lines += *line == '\n';
+	}
+	while (buckets < 2 * lines) {
+		buckets *= 2;
+	}
+	if (!(file->patterns = malloc(lines * sizeof *file->patterns)) || !(file->links = malloc(lines * sizeof *file->links)) ||
+			!(file->others = malloc(lines * sizeof *file->others)) || !(file->heads = malloc(buckets * sizeof *file->heads))) {
+		return -1;
+	}
+	file->mask = buckets - 1;
+	memset(file->heads, 0xff, buckets * sizeof *file->heads);
+
+	// a byte order mark is skipped like git does
+	line = size >= 3 && memcmp(buf, "\xef\xbb\xbf", 3) == 0 ? buf + 3 : buf;
+	for (; line < end; line = next) {
+		ignore_pattern* pattern = &file->patterns[file->count];
+		char* text;
+		const char* slash;
+
+		if (!(next = memchr(line, '\n', end - line))) {
+			next = end;
+		}
+		if (next > line && next[-1] == '\r') {
+			next[-1] = 0;
+		}
+		*next++ = 0;
+		if (*line == '#') {
+			continue;
+		}
+		trim(line);
+		text = line;
+		pattern->flags = 0;
+		if (*text == '!') {
+			pattern->flags |= IGNORE_NEGATIVE;
+			++text;
+		}
+		pattern->len = strlen(text);
+		if (pattern->len && text[pattern->len - 1] == '/') {
+			pattern->flags |= IGNORE_MUSTBEDIR;
+			text[--pattern->len] = 0;
+		}
+		if (!pattern->len) {
+			continue;
+		}
+		if (!memchr(text, '/', pattern->len)) {
+			pattern->flags |= IGNORE_NODIR;
+		} else if (*text == '/') {
+			// anchored to the directory of the file, which every path pattern is anyway
+			++text;
+			--pattern->len;
+		}
+		pattern->text = text;
+		pattern->prefix = strcspn(text, "*?[\\");
+		if (*text == '*' && strcspn(text + 1, "*?[\\") == pattern->len - 1) {
+			pattern->flags |= IGNORE_ENDSWITH;
+		}
+
+		n = file->count++;
+		if ((pattern->flags & IGNORE_NODIR) && pattern->prefix == pattern->len) {
+			add_link(file, BUCKET_LITERAL, text, pattern->len, n);
+		} else if ((pattern->flags & (IGNORE_NODIR | IGNORE_ENDSWITH)) == (IGNORE_NODIR | IGNORE_ENDSWITH) &&
+				(slash = strrchr(text, '.'))) {
+			add_link(file, BUCKET_EXTENSION, slash + 1, pattern->len - (slash + 1 - text), n);
+		} else if (!(pattern->flags & IGNORE_NODIR) && (slash = memchr(text, '/', pattern->len)) &&
+				slash - text <= pattern->prefix && slash > text) {
+			add_link(file, BUCKET_PREFIX, text, slash - text, n);
+		} else if (!(pattern->flags & IGNORE_NODIR) && pattern->prefix == pattern->len) {
+			add_link(file, BUCKET_PREFIX, text, pattern->len, n);
+		} else if (pattern->prefix) {
+			add_link(file, pattern->flags & IGNORE_NODIR ? BUCKET_BASECHAR : BUCKET_PATHCHAR, text, 1, n);
+		} else {
+			file->others[file->nothers++] = n;
+		}
+	}
+	return 0;
+}
+
+static void file_free(ignore_file* file) {
+	if (file) {
+		free(file->buf);
+		free(file->patterns);
+		free(file->links);
+		free(file->others);
+		free(file->heads);
+		free(file);
+	}
+}
+
+// the file at path relative to dirfd compiled for the directory dir, NULL when there is none
+static ignore_file* file_load(int dirfd, const char* path, int flags, const char* dir, int dirlen, int* err) {
+	ignore_file* file;
+	struct stat st;
+	ssize_t n = 0;
+	size_t got = 0;
+	int fd;
+
+	*err = 0;
+	if ((fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC | flags)) == -1) {
+		*err = errno == ENOENT || errno == ENOTDIR ? 0 : -1;
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || dirlen >= sizeof file->dir ||
+			!(file = calloc(1, sizeof *file))) {
+		close(fd);
+		*err = -1;
+		return NULL;
+	}
+	memcpy(file->dir, dir, dirlen);
+	file->dir[dirlen] = 0;
+	file->dirlen = dirlen;
+	file->ino = st.st_ino;
+	file->size = st.st_size;
+	file->mtime = st.st_mtim;
+	file->ctime = st.st_ctim;
+	if ((file->buf = malloc(st.st_size + 1))) {
+		while (got < st.st_size && ((n = read(fd, file->buf + got, st.st_size - got)) > 0 || (n == -1 && errno == EINTR))) {
+			got += n > 0 ? n : 0;
+		}
+	}
+	close(fd);
+	if (!file->buf || got != st.st_size || compile(file, file->buf, got) != 0) {
+		file_free(file);
+		*err = -1;
+		return NULL;
+	}
+	return file;
+}
+
+static int pattern_matches(const ignore_file* file, int n, const char* name, const char* base, int isdir) {
+	const ignore_pattern* pattern = &file->patterns[n];
+
+	if ((pattern->flags & IGNORE_MUSTBEDIR) && !isdir) {
+		return 0;
+	}
+	if (pattern->flags & IGNORE_NODIR) {
+		int len = strlen(base);
+		if (pattern->prefix == pattern->len) {
+			return len == pattern->len && memcmp(base, pattern->text, len) == 0;
+		}
+		if (pattern->flags & IGNORE_ENDSWITH) {
+			return len >= pattern->len - 1 && memcmp(base + len - (pattern->len - 1), pattern->text + 1, pattern->len - 1) == 0;
+		}
+		return strncmp(base, pattern->text, pattern->prefix) == 0 &&
+			wildmatch(pattern->text + pattern->prefix, pattern->text + pattern->prefix, base + pattern->prefix) == WILD_MATCH;
+	}
+	// the literal part up front saves most of the matching
+	if (strncmp(name, pattern->text, pattern->prefix) != 0) {
+		return 0;
+	}
+	if (pattern->prefix == pattern->len) {
+		return !name[pattern->prefix];
+	}
+	return wildmatch(pattern->text + pattern->prefix, pattern->text + pattern->prefix, name + pattern->prefix) == WILD_MATCH;
+}
+
+// 1 when the last pattern matching path excludes it, 0 when it is negated, -1 when none matches
+static int file_match(const ignore_file* file, const char* path, const char* base, int isdir) {
+	const char* name = path + file->dirlen;
+	const char* ext = strrchr(base, '.');
+	const char* slash = strchr(name, '/');
+	struct {
+		int kind;
+		const char* key;
+		int len;
+	} keys[] = {
+		{BUCKET_LITERAL, base, strlen(base)},
+		{BUCKET_EXTENSION, ext ? ext + 1 : NULL, ext ? strlen(ext + 1) : 0},
+		{BUCKET_PREFIX, name, slash ? slash - name : strlen(name)},
+		{BUCKET_BASECHAR, base, 1},
+		{BUCKET_PATHCHAR, name, 1},
+	};
+	int best = -1, n, k;
+
+	if (file->dirlen && strncmp(path, file->dir, file->dirlen) != 0) {
+		return -1;
+	}
+	for (k = 0; k < sizeof keys / sizeof *keys; ++k) {
+		if (!keys[k].key) {
+			continue;
+		}
+		for (n = file->heads[hash(keys[k].kind, keys[k].key, keys[k].len) & file->mask]; n != -1; n = file->links[n].next) {
+			const ignore_link* link = &file->links[n];
+			if (link->pattern > best && link->kind == keys[k].kind && link->keylen == keys[k].len &&
+					memcmp(link->key, keys[k].key, link->keylen) == 0 && pattern_matches(file, link->pattern, name, base, isdir)) {
+				best = link->pattern;
+			}
+		}
+	}
+	// the rest newest first, until it can't beat what the buckets found
+	for (n = file->nothers - 1; n >= 0 && file->others[n] > best; --n) {
+		if (pattern_matches(file, file->others[n], name, base, isdir)) {
+			best = file->others[n];
+			break;
+		}
+	}
+	return best < 0 ? -1 : !(file->patterns[best].flags & IGNORE_NEGATIVE);
+}
+
+static int file_fresh(const ignore_file* file, const struct stat* st) {
+	return file->ino == st->st_ino && file->size == st->st_size &&
+		file->mtime.tv_sec == st->st_mtim.tv_sec && file->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+		file->ctime.tv_sec == st->st_ctim.tv_sec && file->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+// the compiled .gitignore of dir, from the cache as long as the file didn't change
+static int dir_file(ignore* ig, const char* dir, int dirlen, ignore_file** out) {
+	char path[PATH_MAX];
+	uint32_t h = hash(0, dir, dirlen), slot;
+	ignore_file* file;
+	struct stat st;
+	int err;
+
+	*out = NULL;
+	if (dirlen + 11 > sizeof path) {
+		return -1;
+	}
+	memcpy(path, dir, dirlen);
+	strcpy(path + dirlen, ".gitignore");
+
+	if (ig->cached * 2 >= ig->cachesize) {
+		size_t size = ig->cachesize ? ig->cachesize * 2 : 64, n;
+		ignore_file** cache = calloc(size, sizeof *cache);
+		if (!cache) {
+			return -1;
+		}
+		for (n = 0; n < ig->cachesize; ++n) {
+			if (ig->cache[n]) {
+				for (slot = hash(0, ig->cache[n]->dir, ig->cache[n]->dirlen) & (size - 1); cache[slot]; slot = (slot + 1) & (size - 1)) {
+				}
+				cache[slot] = ig->cache[n];
+			}
+		}
+		free(ig->cache);
+		ig->cache = cache;
+		ig->cachesize = size;
+	}
+	for (slot = h & (ig->cachesize - 1); (file = ig->cache[slot]); slot = (slot + 1) & (ig->cachesize - 1)) {
+		if (file->dirlen == dirlen && memcmp(file->dir, dir, dirlen) == 0) {
+			break;
+		}
+	}
+
+	// like git, a .gitignore in the work tree is not followed when it is a symbolic link
+	if (fstatat(ig->dirfd, path, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+		return errno == ENOENT || errno == ENOTDIR ? 0 : -1;
+	}
+	if (S_ISLNK(st.st_mode)) {
+		return 0;
+	}
+	if (file && file_fresh(file, &st)) {
+		*out = file;
+		return 0;
+	}
+	if (!(*out = file_load(ig->dirfd, path, O_NOFOLLOW, dir, dirlen, &err))) {
+		return err;
+	}
+	// a changed file takes the place of the stale one
+	file_free(file);
+	ig->cached += !file;
+	ig->cache[slot] = *out;
+	return 0;
+}
+
+// makes the stack hold the .gitignore files from the top of the work tree down to dir
+static int enter(ignore* ig, const char* dir, int dirlen) {
+	while (ig->depth && (ig->lens[ig->depth - 1] > dirlen || memcmp(ig->dir, dir, ig->lens[ig->depth - 1]) != 0)) {
+		--ig->depth;
+	}
+	while (!ig->depth || ig->lens[ig->depth - 1] < dirlen) {
+		int len = 0;
+		if (ig->depth == IGNORE_MAXDEPTH) {
+			return -1;
+		}
+		if (ig->depth) {
+			const char* slash = memchr(dir + ig->lens[ig->depth - 1], '/', dirlen - ig->lens[ig->depth - 1]);
+			len = slash + 1 - dir;
+			memcpy(ig->dir + ig->lens[ig->depth - 1], dir + ig->lens[ig->depth - 1], len - ig->lens[ig->depth - 1]);
+		}
+		if (dir_file(ig, dir, len, &ig->files[ig->depth]) != 0) {
+			return -1;
+		}
+		ig->lens[ig->depth++] = len;
+	}
+	return 0;
+}
+
+// where git looks for core.excludesFile when it isn't set
+const char* excludes_file(const git_repo* repo, char* path) {
+	char value[PATH_MAX];
+	const char* env = getenv("XDG_CONFIG_HOME");
+	const char* home = getenv("HOME");
+
+	if (repo_config(repo, "core.excludesfile", value, sizeof value)) {
+		if (strncmp(value, "~/", 2) == 0 && home && strlen(home) + strlen(value) < PATH_MAX) {
+			strcpy(path, home);
+			strcat(path, value + 1);
+			return path;
+		}
+		return strcpy(path, value);
+	}
+	if (env && strlen(env) + 12 < PATH_MAX) {
+		strcpy(path, env);
+		return strcat(path, "/git/ignore");
+	}
+	if (home && strlen(home) + 20 < PATH_MAX) {
+		strcpy(path, home);
+		return strcat(path, "/.config/git/ignore");
+	}
+	return NULL;
+}
+
+int ignore_open(ignore* ig, const git_repo* repo, int dirfd) {
+	char path[PATH_MAX];
+	int err = 0;
+
+	memset(ig, 0, sizeof *ig);
+	ig->dirfd = dirfd;
+	if (strlen(repo->commondir) + 14 > sizeof path) {
+		return -1;
+	}
+	strcpy(path, repo->commondir);
+	strcat(path, "/info/exclude");
+	ig->info = file_load(AT_FDCWD, path, 0, "", 0, &err);
+	if (!err && excludes_file(repo, path)) {
+		ig->global = file_load(AT_FDCWD, path, 0, "", 0, &err);
+	}
+	if (err) {
+		ignore_close(ig);
+		return -1;
+	}
+	return 0;
+}
+
+void ignore_close(ignore* ig) {
+	size_t n;
+
+	for (n = 0; n < ig->cachesize; ++n) {
+		file_free(ig->cache[n]);
+	}
+	free(ig->cache);
+	file_free(ig->info);
+	file_free(ig->global);
+	memset(ig, 0, sizeof *ig);
+}
+
+// 1 when the path relative to the work tree is ignored, 0 when it isn't and -1 when it can't be told
+int ignore_match(ignore* ig, const char* path, int isdir) {
+	const char* slash = strrchr(path, '/');
+	const char* base = slash ? slash + 1 : path;
+	int n, result;
+
+	// the deepest .gitignore has the say, then info/exclude, then core.excludesFile
+	if (enter(ig, path, base - path) != 0) {
+		return -1;
+	}
+	for (n = ig->depth - 1; n >= 0; --n) {
+		if (ig->files[n] && (result = file_match(ig->files[n], path, base, isdir)) >= 0) {
+			return result;
+		}
+	}
+	if (ig->info && (result = file_match(ig->info, path, base, isdir)) >= 0) {
+		return result;
+	}
+	if (ig->global && (result = file_match(ig->global, path, base, isdir)) >= 0) {
+		return result;
+	}
+	return 0;
+}
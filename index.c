@@ -0,0 +1,912 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <linux/limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "git.h"
+
+#define ENTRY_FIXED 40
+
+// entries are handed out in blocks, and a thread only pays off with a few blocks to do
+#define CLEAN_BLOCK 512
+#define CLEAN_PERTHREAD 8192
+#define CLEAN_MAXTHREADS 32
+#define STAT_NEEDED 2
+#define STAT_COMPARE 3
+
+// statx through io_uring is punted to kernel workers, which only pays off on large trees with cores to spare,
+// so it is asked for with PROMPT_IO_URING and below this it costs more to set up than it saves
+#define CLEAN_BATCHED 4096
+
+// racy entries are hashed rather than handed to git diff, up to this many bytes a scan
+#define HASH_BUDGET (64 << 20)
+
+static uint64_t varint(const unsigned char** p, const unsigned char* end) {
+	const unsigned char* q = *p;
+	uint64_t val;
+	unsigned char c;
+
+	if (q >= end) {
+		return UINT64_MAX;
+	}
+	c = *q++;
+	val = c & 127;
+	while (c & 128) {
+		if (q >= end) {
+			return UINT64_MAX;
+		}
+		c = *q++;
+		val = ((val + 1) << 7) | (c & 127);
+	}
+	*p = q;
+	return val;
+}
+
+static int bit(const uint64_t* bitmap, uint32_t bits, uint32_t n) {
+	return bitmap && n < bits && (bitmap[n / 64] >> (n % 64) & 1);
+}
+
+// by path, then by stage, as git sorts them
+static int entry_cmp(const index_entry* a, const index_entry* b) {
+	int cmp = memcmp(a->path, b->path, a->len < b->len ? a->len : b->len);
+	if (cmp) {
+		return cmp;
+	}
+	if (a->len != b->len) {
+		return a->len < b->len ? -1 : 1;
+	}
+	return (int)(a->flags & CE_STAGEMASK) - (int)(b->flags & CE_STAGEMASK);
+}
+
+// "link" names the shared index these entries are changes to, then which of its entries are deleted and which
+// replaced by the placeholders this index starts with; the entries after those are added
+static int split_merge(git_index* index, const char* path, const unsigned char* link, size_t size) {
+	const unsigned char *p = link + index->rawsz, *end = link + size;
+	char shared[PATH_MAX], hex[2 * GIT_MAX_RAWSZ + 1];
+	uint64_t *deleted = NULL, *replaced = NULL;
+	uint32_t dbits = 0, rbits = 0, count = 0, b, s;
+	index_entry* entries = NULL;
+	const char* slash = strrchr(path, '/');
+	git_index* base;
+	int result = -1, n;
+
+	if (size < index->rawsz) {
+		return -1;
+	}
+	// a null oid is a split index being turned off, everything is here
+	for (n = 0; n < index->rawsz && !link[n]; ++n) {
+	}
+	if (n == index->rawsz) {
+		return 0;
+	}
+	// a shared index is never split itself
+	if (!slash || !strncmp(slash + 1, "sharedindex.", 12) || (slash - path) + 14 + 2 * index->rawsz > sizeof shared || !(base = malloc(sizeof *base))) {
+		return -1;
+	}
+	memcpy(shared, path, slash - path + 1);
+	strcpy(shared + (slash - path + 1), "sharedindex.");
+	strcat(shared, oid2hex(link, index->rawsz, hex));
+	if (index_open(base, shared, index->rawsz) != 0) {
+		free(base);
+		return -1;
+	}
+	index->shared = base;
+	if (p < end && (!(deleted = ewah_decode(&p, end, &dbits)) || !(replaced = ewah_decode(&p, end, &rbits)))) {
+		goto done;
+	}
+	if (dbits > base->count || rbits > base->count ||
+			!(entries = malloc(((size_t)base->count + index->count) * sizeof *entries + 1))) {
+		goto done;
+	}
+
+	// a placeholder has no name of its own, it takes the one of the entry it replaces
+	for (b = s = 0; b < rbits; ++b) {
+		if (bit(replaced, rbits, b)) {
+			index_entry* e = &base->entries[b];
+			const char* name = e->path;
+			int len = e->len;
+			if (s == index->count || index->entries[s].len) {
+				goto done;
+			}
+			*e = index->entries[s++];
+			e->path = name;
+			e->len = len;
+		}
+	}
+	// what is left of both is sorted, an added entry takes the place of one of the same name and stage
+	for (b = 0; b < base->count || s < index->count; ) {
+		int cmp;
+		if (b < base->count && bit(deleted, dbits, b)) {
+			++b;
+			continue;
+		}
+		cmp = b == base->count ? 1 : s == index->count ? -1 : entry_cmp(&base->entries[b], &index->entries[s]);
+		if (cmp < 0) {
+			entries[count++] = base->entries[b++];
+		} else {
+			b += cmp == 0;
+			entries[count++] = index->entries[s++];
+		}
+	}
+	free(index->entries);
+	index->entries = entries;
+	index->count = count;
+	entries = NULL;
+	index->skipped = 0;
+	for (b = 0; b < count; ++b) {
+		index->skipped += (index->entries[b].xflags & CE_SKIP_WORKTREE) != 0;
+	}
+	result = 0;
+
+done:
+	free(entries);
+	free(deleted);
+	free(replaced);
+	return result;
+}
+
+int index_open(git_index* index, const char* path, int rawsz) {
+	struct stat st;
+	const unsigned char *map, *p, *end, *link;
+	size_t pathcap = 0, pathlen = 0, linksize;
+	size_t prevoff = 0;
+	int prevlen = 0;
+	uint32_t n;
+	int fd;
+
+	memset(index, 0, sizeof *index);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		return -1;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < 12 + rawsz ||
+			(index->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		index->map = NULL;
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	map = index->map;
+	index->mapsize = st.st_size;
+	index->mtime = st.st_mtim;
+	index->rawsz = rawsz;
+	index->version = get_be32(map + 4);
+	index->count = get_be32(map + 8);
+	if (memcmp(map, "DIRC", 4) != 0 || index->version < 2 || index->version > 4) {
+		goto fail;
+	}
+
+	p = map + 12;
+	end = map + st.st_size - rawsz;
+	if (!(index->entries = malloc((size_t)index->count * sizeof *index->entries + 1))) {
+		goto fail;
+	}
+	for (n = 0; n < index->count; ++n) {
+		index_entry* e = &index->entries[n];
+		const unsigned char* name;
+		size_t fixed = ENTRY_FIXED + rawsz + 2;
+
+		if (p + fixed > end) {
+			goto fail;
+		}
+		e->ctime_sec = get_be32(p);
+		e->ctime_nsec = get_be32(p + 4);
+		e->mtime_sec = get_be32(p + 8);
+		e->mtime_nsec = get_be32(p + 12);
+		e->dev = get_be32(p + 16);
+		e->ino = get_be32(p + 20);
+		e->mode = get_be32(p + 24);
+		e->uid = get_be32(p + 28);
+		e->gid = get_be32(p + 32);
+		e->size = get_be32(p + 36);
+		e->oid = p + ENTRY_FIXED;
+		e->flags = get_be16(p + ENTRY_FIXED + rawsz);
+		e->xflags = 0;
+		if (e->flags & CE_EXTENDED) {
+			if (index->version < 3 || p + fixed + 2 > end) {
+				goto fail;
+			}
+			e->xflags = get_be16(p + fixed);
+			fixed += 2;
+		}
+		// outside of the sparse checkout, sparse directory entries included
+		if (e->xflags & CE_SKIP_WORKTREE) {
+			++index->skipped;
+		}
+		name = p + fixed;
+
+		if (index->version == 4) {
+			// the name is the previous one minus N trailing bytes, plus a NUL-terminated suffix
+			uint64_t strip = varint(&name, end);
+			const unsigned char* suffix = name;
+			size_t len;
+			char* dst;
+
+			if (strip > (uint64_t)prevlen) {
+				goto fail;
+			}
+			while (name < end && *name) {
+				++name;
+			}
+			if (name == end) {
+				goto fail;
+			}
+			len = prevlen - strip + (name - suffix);
+			if (pathlen + len + 1 > pathcap) {
+				char* paths;
+				pathcap = (pathlen + len + 1) * 2 + 4096;
+				if (!(paths = realloc(index->paths, pathcap))) {
+					goto fail;
+				}
+				index->paths = paths;
+			}
+			// entries keep offsets into the arena until it stops moving
+			dst = index->paths + pathlen;
+			memcpy(dst, index->paths + prevoff, prevlen - strip);
+			memcpy(dst + prevlen - strip, suffix, name - suffix);
+			dst[len] = 0;
+			e->path = (const char*)(uintptr_t)pathlen;
+			e->len = prevlen = len;
+			prevoff = pathlen;
+			pathlen += len + 1;
+			p = name + 1;
+		} else {
+			// NUL padded so that the entry length is a multiple of eight
+			const unsigned char* q = name;
+			while (q < end && *q) {
+				++q;
+			}
+			if (q == end) {
+				goto fail;
+			}
+			e->path = (const char*)name;
+			e->len = q - name;
+			p += (fixed + e->len + 8) & ~7;
+		}
+	}
+
+	if (p > end) {
+		goto fail;
+	}
+	if (index->paths) {
+		for (n = 0; n < index->count; ++n) {
+			index->entries[n].path = index->paths + (uintptr_t)index->entries[n].path;
+		}
+	}
+	index->ext = p;
+	index->extsize = end - p;
+	if ((link = index_extension(index, "link", &linksize)) && split_merge(index, path, link, linksize) != 0) {
+		goto fail;
+	}
+
+	// column c of entry n is columns[c * count + n]
+	if (!(index->columns = malloc((size_t)index->count * STAT_COLUMNS * sizeof *index->columns + 1))) {
+		goto fail;
+	}
+	for (n = 0; n < index->count; ++n) {
+		const index_entry* e = &index->entries[n];
+		uint32_t* column = index->columns + n;
+		column[COL_MTIME_SEC * index->count] = e->mtime_sec;
+		column[COL_MTIME_NSEC * index->count] = e->mtime_nsec;
+		column[COL_CTIME_SEC * index->count] = e->ctime_sec;
+		column[COL_CTIME_NSEC * index->count] = e->ctime_nsec;
+		column[COL_INO * index->count] = e->ino;
+		column[COL_UID * index->count] = e->uid;
+		column[COL_GID * index->count] = e->gid;
+		column[COL_SIZE * index->count] = e->size;
+	}
+	return 0;
+
+fail:
+	index_close(index);
+	return -1;
+}
+
+void index_close(git_index* index) {
+	if (index->map) {
+		munmap(index->map, index->mapsize);
+	}
+	if (index->shared) {
+		index_close(index->shared);
+		free(index->shared);
+	}
+	free(index->entries);
+	free(index->columns);
+	free(index->paths);
+	memset(index, 0, sizeof *index);
+}
+
+// the verdict for entries the work tree has no say in, STAT_NEEDED for the rest
+static int entry_flags(const index_entry* e) {
+	if ((e->flags & CE_VALID) || (e->xflags & CE_SKIP_WORKTREE)) {
+		return 1;
+	}
+	if ((e->flags & CE_STAGEMASK) || (e->xflags & CE_INTENT_TO_ADD)) {
+		return -1;
+	}
+	return STAT_NEEDED;
+}
+
+// what the file type alone settles, 1 clean, 0 changed and -1 unknown, or STAT_COMPARE when it comes down to the stat data
+static int entry_type(const index_entry* e, int dirfd, uint32_t mode, int err) {
+	if (err) {
+		if (err != ENOENT && err != ENOTDIR) {
+			return -1;
+		}
+		// a gitlink that is not checked out is not a change
+		return (e->mode & S_IFMT) == 0160000 ? 1 : 0;
+	}
+
+	switch (e->mode & S_IFMT) {
+	case S_IFREG:
+		if (!S_ISREG(mode)) {
+			return 0;
+		}
+		if ((e->mode ^ mode) & S_IXUSR) {
+			return -1;
+		}
+		return STAT_COMPARE;
+	case S_IFLNK:
+		return S_ISLNK(mode) ? STAT_COMPARE : 0;
+	default:
+		// submodules need to look at their own repository, unless there is none
+		if (S_ISDIR(mode)) {
+			char tmp[PATH_MAX];
+			if (e->len + 6 > sizeof tmp) {
+				return -1;
+			}
+			memcpy(tmp, e->path, e->len);
+			strcpy(tmp + e->len, "/.git");
+			return faccessat(dirfd, tmp, F_OK, AT_SYMLINK_NOFOLLOW) == 0 ? -1 : 1;
+		}
+		return 0;
+	}
+}
+
+static void stat_columns(uint32_t* stats, size_t stride, const struct stat* st) {
+	stats[COL_MTIME_SEC * stride] = st->st_mtim.tv_sec;
+	stats[COL_MTIME_NSEC * stride] = st->st_mtim.tv_nsec;
+	stats[COL_CTIME_SEC * stride] = st->st_ctim.tv_sec;
+	stats[COL_CTIME_NSEC * stride] = st->st_ctim.tv_nsec;
+	stats[COL_INO * stride] = st->st_ino;
+	stats[COL_UID * stride] = st->st_uid;
+	stats[COL_GID * stride] = st->st_gid;
+	stats[COL_SIZE * stride] = st->st_size;
+}
+
+static void statx_columns(uint32_t* stats, size_t stride, const struct statx* sx) {
+	stats[COL_MTIME_SEC * stride] = sx->stx_mtime.tv_sec;
+	stats[COL_MTIME_NSEC * stride] = sx->stx_mtime.tv_nsec;
+	stats[COL_CTIME_SEC * stride] = sx->stx_ctime.tv_sec;
+	stats[COL_CTIME_NSEC * stride] = sx->stx_ctime.tv_nsec;
+	stats[COL_INO * stride] = sx->stx_ino;
+	stats[COL_UID * stride] = sx->stx_uid;
+	stats[COL_GID * stride] = sx->stx_gid;
+	stats[COL_SIZE * stride] = sx->stx_size;
+}
+
+// 1 when the file hashes to the entry's blob the way git would store it, -1 when it doesn't or can't be told, 0
+// when its size changed, which git takes for a change without reading it unless the entry has no size recorded
+static int entry_hashed(const git_index* index, const index_entry* e, int dirfd, atomic_long* budget) {
+	unsigned char oid[GIT_MAX_RAWSZ];
+	char header[32], target[PATH_MAX];
+	const void* data = target;
+	void* map = NULL;
+	git_hash ctx;
+	struct stat st;
+	int fd = -1;
+
+	if (fstatat(dirfd, e->path, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+		return -1;
+	}
+	if ((uint32_t)st.st_size != e->size) {
+		return e->size ? 0 : -1;
+	}
+	if (atomic_fetch_sub_explicit(budget, st.st_size, memory_order_relaxed) < st.st_size) {
+		return -1;
+	}
+	if (S_ISLNK(st.st_mode)) {
+		if (st.st_size >= sizeof target || readlinkat(dirfd, e->path, target, sizeof target) != st.st_size) {
+			return -1;
+		}
+	} else if (st.st_size) {
+		// the file is mapped after the open and checked again, it may have been replaced in between
+		if ((fd = openat(dirfd, e->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) == -1 || fstat(fd, &st) != 0 ||
+				(uint32_t)st.st_size != e->size ||
+				(map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+			if (fd != -1) {
+				close(fd);
+			}
+			return -1;
+		}
+		close(fd);
+		data = map;
+	}
+
+	hash_init(&ctx, index->rawsz);
+	hash_update(&ctx, header, snprintf(header, sizeof header, "blob %lld", (long long)st.st_size) + 1);
+	hash_update(&ctx, data, st.st_size);
+	hash_final(&ctx, oid);
+	if (map) {
+		munmap(map, st.st_size);
+	}
+	return memcmp(oid, e->oid, index->rawsz) == 0 ? 1 : -1;
+}
+
+// the dirty check for a single entry
+int index_entry_clean(const git_index* index, uint32_t n, int dirfd) {
+	const index_entry* e = &index->entries[n];
+	uint32_t stats[STAT_COLUMNS];
+	unsigned char differs;
+	struct stat st;
+	atomic_long budget;
+	int result = entry_flags(e);
+
+	if (result != STAT_NEEDED) {
+		return result;
+	}
+	result = fstatat(dirfd, e->path, &st, AT_SYMLINK_NOFOLLOW) == 0 ?
+		entry_type(e, dirfd, st.st_mode, 0) : entry_type(e, dirfd, 0, errno);
+	if (result != STAT_COMPARE) {
+		return result;
+	}
+	stat_columns(stats, 1, &st);
+	stat_compare(index->columns + n, index->count, stats, 1, index->mtime.tv_sec, 1, &differs);
+	if (!differs) {
+		return 1;
+	}
+	atomic_init(&budget, HASH_BUDGET);
+	return entry_hashed(index, e, dirfd, &budget);
+}
+
+typedef struct {
+	const git_index* index;
+	const uint64_t* check;
+	int dirfd;
+	atomic_uint next;
+	atomic_int stop;
+	atomic_int result;
+	atomic_long budget;
+	int batched;
+	struct timespec deadline;
+} clean_scan;
+
+// the block's stat data is gathered into columns first, then compared in one go
+static int clean_block(clean_scan* scan, uring* ring, struct statx* bufs, uint32_t start, uint32_t end) {
+	const git_index* index = scan->index;
+	// lanes of entries that aren't compared hold zeroes and get ignored
+	uint32_t stats[STAT_COLUMNS * CLEAN_BLOCK] = {0};
+	signed char verdicts[CLEAN_BLOCK];
+	unsigned char differs[CLEAN_BLOCK];
+	int queued = 0, done = 0, result = 1, n;
+	uint64_t data;
+
+	for (n = start; n < end; ++n) {
+		const index_entry* e = &index->entries[n];
+		struct stat st;
+		int verdict = entry_flags(e);
+		// entries the file system monitor vouches for are not looked at
+		if (verdict == STAT_NEEDED && scan->check && !(scan->check[n / 64] >> (n % 64) & 1)) {
+			verdict = 1;
+		}
+		if (verdict == STAT_NEEDED && ring) {
+			if (uring_statx(ring, scan->dirfd, e->path, &bufs[n - start], n) != 0) {
+				return STAT_NEEDED;
+			}
+			++queued;
+		} else if (verdict == STAT_NEEDED) {
+			verdict = fstatat(scan->dirfd, e->path, &st, AT_SYMLINK_NOFOLLOW) == 0 ?
+				entry_type(e, scan->dirfd, st.st_mode, 0) : entry_type(e, scan->dirfd, 0, errno);
+			if (verdict == STAT_COMPARE) {
+				stat_columns(stats + (n - start), CLEAN_BLOCK, &st);
+			}
+		}
+		// anything but clean ends the scan, what is queued is never submitted
+		if (verdict != 1 && verdict != STAT_NEEDED && verdict != STAT_COMPARE) {
+			return verdict;
+		}
+		verdicts[n - start] = verdict;
+	}
+	while (done < queued) {
+		if (uring_submit(ring, queued - done) < 0) {
+			return STAT_NEEDED;
+		}
+		while (uring_reap(ring, &data, &n)) {
+			// every completion is drained before the buffers are used again
+			const struct statx* sx = &bufs[data - start];
+			int verdict = entry_type(&index->entries[data], scan->dirfd, n < 0 ? 0 : sx->stx_mode, n < 0 ? -n : 0);
+			if (verdict == STAT_COMPARE) {
+				statx_columns(stats + (data - start), CLEAN_BLOCK, sx);
+			} else if (verdict != 1 && result == 1) {
+				result = verdict;
+			}
+			verdicts[data - start] = verdict;
+			++done;
+		}
+	}
+	if (result != 1) {
+		return result;
+	}
+
+	stat_compare(index->columns + start, index->count, stats, CLEAN_BLOCK, index->mtime.tv_sec, end - start, differs);
+	for (n = 0; n < end - start; ++n) {
+		if (verdicts[n] == STAT_COMPARE && differs[n] &&
+				(result = entry_hashed(index, &index->entries[start + n], scan->dirfd, &scan->budget)) != 1) {
+			return result;
+		}
+	}
+	return 1;
+}
+
+static void clean_stop(clean_scan* scan, int result) {
+	int clean = 1;
+
+	// a known change beats an unknown one, it saves running git diff
+	if (result == 0) {
+		atomic_store(&scan->result, 0);
+	} else {
+		atomic_compare_exchange_strong(&scan->result, &clean, -1);
+	}
+	atomic_store_explicit(&scan->stop, 1, memory_order_relaxed);
+}
+
+// takes blocks until they run out or some thread finds an entry that isn't clean
+static void* clean_worker(void* data) {
+	clean_scan* scan = data;
+	uint32_t count = scan->index->count, start, end;
+	struct statx* bufs = NULL;
+	uring ring;
+
+	deadline_adopt(scan->deadline);
+	// batched statx where io_uring is there, one fstatat at a time where it isn't
+	ring.fd = -1;
+	if (scan->batched && (bufs = malloc(CLEAN_BLOCK * sizeof *bufs)) && uring_open(&ring, CLEAN_BLOCK) != 0) {
+		free(bufs);
+		bufs = NULL;
+	}
+	while (!atomic_load_explicit(&scan->stop, memory_order_relaxed) &&
+			(start = atomic_fetch_add_explicit(&scan->next, CLEAN_BLOCK, memory_order_relaxed)) < count) {
+		int result;
+		// out of time it is left to git, which won't be started either
+		if (deadline_left() == 0) {
+			clean_stop(scan, -1);
+			break;
+		}
+		end = count - start > CLEAN_BLOCK ? start + CLEAN_BLOCK : count;
+		if (bufs && (result = clean_block(scan, &ring, bufs, start, end)) == STAT_NEEDED) {
+			// statx calls still in flight may write to the buffers, so they are left behind
+			uring_close(&ring);
+			bufs = NULL;
+		}
+		if (!bufs) {
+			result = clean_block(scan, NULL, NULL, start, end);
+		}
+		if (result != 1) {
+			clean_stop(scan, result);
+			break;
+		}
+	}
+	if (bufs) {
+		uring_close(&ring);
+		free(bufs);
+	}
+	return NULL;
+}
+
+// the cores this process may run on, fewer than are online in a cpuset or under taskset
+static long usable_cpus() {
+	cpu_set_t set;
+	return sched_getaffinity(0, sizeof set, &set) == 0 ? CPU_COUNT(&set) : sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+// check, when there is one, has the bits of the entries that need a stat call set
+int index_clean(const git_index* index, const char* worktree, const uint64_t* check) {
+	pthread_t threads[CLEAN_MAXTHREADS];
+	long cpus = usable_cpus();
+	// only entries in the sparse checkout cost a stat call
+	long wanted = (index->count - index->skipped) / CLEAN_PERTHREAD;
+	int started = 0, n;
+	clean_scan scan;
+
+	scan.index = index;
+	scan.check = check;
+	if ((scan.dirfd = open(worktree, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+		return -1;
+	}
+	atomic_init(&scan.next, 0);
+	atomic_init(&scan.stop, 0);
+	atomic_init(&scan.result, 1);
+	atomic_init(&scan.budget, HASH_BUDGET);
+	scan.deadline = deadline_get();
+	scan.batched = index->count >= CLEAN_BATCHED && config_bool(getenv("PROMPT_IO_URING"), 0);
+
+	// the calling thread works too, the others only join on large indexes
+	if (wanted > cpus) {
+		wanted = cpus;
+	}
+	if (wanted > CLEAN_MAXTHREADS) {
+		wanted = CLEAN_MAXTHREADS;
+	}
+	while (started < wanted - 1 && pthread_create(&threads[started], NULL, clean_worker, &scan) == 0) {
+		++started;
+	}
+	clean_worker(&scan);
+	for (n = 0; n < started; ++n) {
+		pthread_join(threads[n], NULL);
+	}
+	close(scan.dirfd);
+	return atomic_load(&scan.result);
+}
+
+// the first entry whose path sorts at or after path, entries of all stages included
+uint32_t index_find(const git_index* index, const char* path, int len) {
+	uint32_t lo = 0, hi = index->count;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		const index_entry* e = &index->entries[mid];
+		int cmp = memcmp(e->path, path, e->len < len ? e->len : len);
+		if (cmp < 0 || (cmp == 0 && e->len < len)) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// an EWAH compressed bitmap as the index extensions store it, expanded into 64 bit words
+uint64_t* ewah_decode(const unsigned char** p, const unsigned char* end, uint32_t* bits) {
+	const unsigned char* q = *p;
+	uint32_t words, n, size;
+	uint64_t* bitmap;
+	size_t pos = 0;
+
+	if (end - q < 8) {
+		return NULL;
+	}
+	*bits = get_be32(q);
+	words = get_be32(q + 4);
+	q += 8;
+	if ((end - q) / 8 < words || end - q - 8 * (size_t)words < 4) {
+		return NULL;
+	}
+	size = (*bits + 63) / 64;
+	if (!(bitmap = calloc(size + 1, sizeof *bitmap))) {
+		return NULL;
+	}
+	// each marker word holds a run of identical words, then says how many literal words follow
+	for (n = 0; n < words; ) {
+		uint64_t marker = (uint64_t)get_be32(q + 8 * n) << 32 | get_be32(q + 8 * n + 4);
+		uint64_t run = marker >> 1 & 0xffffffff, literals = marker >> 33;
+		++n;
+		if (run > size - pos || literals > size - pos - run || literals > words - n) {
+			free(bitmap);
+			return NULL;
+		}
+		if (marker & 1) {
+			memset(bitmap + pos, 0xff, run * sizeof *bitmap);
+		}
+		pos += run;
+		for (; literals; --literals, ++n, ++pos) {
+			bitmap[pos] = (uint64_t)get_be32(q + 8 * n) << 32 | get_be32(q + 8 * n + 4);
+		}
+	}
+	*p = q + 8 * (size_t)words + 4;
+	return bitmap;
+}
+
+const unsigned char* index_extension(const git_index* index, const char* sig, size_t* size) {
+	const unsigned char* p = index->ext;
+	const unsigned char* end = index->ext + index->extsize;
+
+	while (p + 8 <= end) {
+		size_t len = get_be32(p + 4);
+		if (p + 8 + len > end) {
+			break;
+		}
+		if (memcmp(p, sig, 4) == 0) {
+			*size = len;
+			return p + 8;
+		}
+		p += 8 + len;
+	}
+	return NULL;
+}
+
+// decodes one cache-tree node and its subtrees in pre-order, returns the number of nodes
+static int cache_tree_parse(cache_tree* nodes, int max, const unsigned char** p, const unsigned char* end, int rawsz) {
+	cache_tree* node = nodes;
+	const unsigned char* q = *p;
+	char* num;
+	int n, count = 1;
+
+	if (max < 1) {
+		return -1;
+	}
+	node->name = (const char*)q;
+	while (q < end && *q) {
+		++q;
+	}
+	if (q == end) {
+		return -1;
+	}
+	node->namelen = q - (const unsigned char*)node->name;
+	node->entries = strtol((const char*)q + 1, &num, 10);
+	node->subtrees = strtol(num, &num, 10);
+	if ((const unsigned char*)num >= end || *num != '\n' || node->subtrees < 0) {
+		return -1;
+	}
+	q = (const unsigned char*)num + 1;
+	node->oid = NULL;
+	if (node->entries >= 0) {
+		if (q + rawsz > end) {
+			return -1;
+		}
+		node->oid = q;
+		q += rawsz;
+	}
+	*p = q;
+
+	for (n = 0; n < node->subtrees; ++n) {
+		int sub = cache_tree_parse(nodes + count, max - count, p, end, rawsz);
+		if (sub < 0) {
+			return -1;
+		}
+		count += sub;
+	}
+	node->span = count;
+	return count;
+}
+
+typedef struct {
+	const git_index* index;
+	const git_repo* repo;
+	const cache_tree* nodes;
+	uint32_t pos;
+	char path[PATH_MAX];
+} tree_walk;
+
+static const cache_tree* cache_tree_child(const cache_tree* node, const char* name, int namelen) {
+	const cache_tree* child = node + 1;
+	int n;
+
+	for (n = 0; n < node->subtrees; ++n) {
+		if (child->namelen == namelen && memcmp(child->name, name, namelen) == 0) {
+			return child;
+		}
+		child += child->span;
+	}
+	return NULL;
+}
+
+static int has_prefix(const index_entry* e, const char* prefix, int len) {
+	return e->len >= len && memcmp(e->path, prefix, len) == 0;
+}
+
+// 1 when the index entries below path match the tree, 0 when they don't, -1 when it cannot be told
+static int walk_tree(tree_walk* walk, const unsigned char* oid, const cache_tree* node, int pathlen) {
+	const git_index* index = walk->index;
+	const int rawsz = index->rawsz;
+	const char *buf, *p, *end;
+	size_t size;
+	int type, result = 1;
+
+	// a valid cache-tree node already knows the tree its entries make
+	if (node && node->entries >= 0) {
+		if (memcmp(node->oid, oid, rawsz) != 0) {
+			return 0;
+		}
+		walk->pos += node->entries;
+		return 1;
+	}
+
+	if (!(buf = odb_read(walk->repo, oid, &type, &size))) {
+		return -1;
+	}
+	if (type != OBJ_TREE) {
+		free((void*)buf);
+		return -1;
+	}
+
+	// "<octal mode> <name>\0<raw oid>" in the same order the index sorts paths
+	for (p = buf, end = buf + size; p < end && result == 1; ) {
+		const char* name = memchr(p, ' ', end - p);
+		const char* nul;
+		const index_entry* e;
+		unsigned mode = strtoul(p, NULL, 8);
+		int namelen;
+
+		if (!name || !(nul = memchr(name, 0, end - name)) || nul + 1 + rawsz > end) {
+			result = -1;
+			break;
+		}
+		++name;
+		namelen = nul - name;
+		if (pathlen + namelen + 2 > sizeof walk->path) {
+			result = -1;
+			break;
+		}
+		memcpy(walk->path + pathlen, name, namelen);
+		walk->path[pathlen + namelen] = 0;
+		oid = (const unsigned char*)nul + 1;
+		p = nul + 1 + rawsz;
+		e = walk->pos < index->count ? &index->entries[walk->pos] : NULL;
+
+		if (S_ISDIR(mode)) {
+			walk->path[pathlen + namelen] = '/';
+			if (e && S_ISDIR(e->mode) && e->len == pathlen + namelen + 1 && has_prefix(e, walk->path, e->len)) {
+				// a sparse directory entry stands for the whole tree, it is never expanded
+				if (memcmp(e->oid, oid, rawsz) != 0) {
+					result = 0;
+				} else {
+					++walk->pos;
+				}
+			} else if (!e || !has_prefix(e, walk->path, pathlen + namelen + 1)) {
+				result = 0;
+			} else {
+				result = walk_tree(walk, oid, node ? cache_tree_child(node, name, namelen) : NULL, pathlen + namelen + 1);
+			}
+		} else if (!e || e->len != pathlen + namelen || memcmp(e->path, walk->path, e->len) != 0 ||
+				e->mode != mode || memcmp(e->oid, oid, rawsz) != 0) {
+			result = 0;
+		} else {
+			++walk->pos;
+		}
+	}
+
+	// anything left under this directory is not in the tree
+	if (result == 1 && walk->pos < index->count && has_prefix(&index->entries[walk->pos], walk->path, pathlen)) {
+		result = 0;
+	}
+
+	free((void*)buf);
+	return result;
+}
+
+int index_matches_tree(const git_index* index, const git_repo* repo, const unsigned char* tree) {
+	const unsigned char *ext, *end;
+	cache_tree* nodes = NULL;
+	tree_walk walk;
+	size_t size;
+	uint32_t n;
+	int result;
+
+	// conflicts and intent-to-add entries are left to git
+	for (n = 0; n < index->count; ++n) {
+		if ((index->entries[n].flags & CE_STAGEMASK) || (index->entries[n].xflags & CE_INTENT_TO_ADD)) {
+			return -1;
+		}
+	}
+
+	if ((ext = index_extension(index, "TREE", &size)) && size) {
+		// every node takes at least four bytes
+		int max = size / 4 + 1;
+		end = ext + size;
+		if (!(nodes = malloc(max * sizeof *nodes)) || cache_tree_parse(nodes, max, &ext, end, index->rawsz) < 0) {
+			free(nodes);
+			nodes = NULL;
+		}
+	}
+
+	walk.index = index;
+	walk.repo = repo;
+	walk.nodes = nodes;
+	walk.pos = 0;
+	*walk.path = 0;
+	result = walk_tree(&walk, tree, nodes, 0);
+	if (result == 1 && walk.pos != index->count) {
+		result = 0;
+	}
+
+	free(nodes);
+	return result;
+}
@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <git2.h>
+#include "git.h"
+
+typedef struct {
+	git_repository* repo;
+	char cwd[PATH_MAX];
+	// from one status pass, which stops once both are found
+	int scanned, dirty, staged;
+} libgit2_repo;
+
+static int within(const char* path, const char* dir) {
+	int len = strlen(dir);
+
+	// libgit2 ends its directories with a slash
+	if (len && dir[len - 1] == '/') {
+		--len;
+	}
+	return strncmp(path, dir, len) == 0 && (path[len] == 0 || path[len] == '/');
+}
+
+// a tag, branch or remote-tracking branch pointing right at the commit, picked and named as ref_name_commit does
+static int name_commit(git_repository* repo, const git_oid* oid, char* buf, size_t size) {
+	static const char* const prefixes[] = {"refs/tags/", "refs/heads/", "refs/remotes/"};
+	char best[PATH_MAX] = "";
+	git_reference_iterator* it;
+	git_reference* ref;
+	int kind, best_kind = 0, count = 0, err;
+
+	if (git_reference_iterator_new(&it, repo) != 0) {
+		return -1;
+	}
+	while ((err = git_reference_next(&ref, it)) == 0) {
+		const char* name = git_reference_name(ref);
+		const git_oid* target = git_reference_target(ref);
+		git_object* peeled = NULL;
+		char short_name[PATH_MAX];
+		int annotated = 0;
+
+		for (kind = 0; kind < 3 && strncmp(name, prefixes[kind], strlen(prefixes[kind])) != 0; ++kind);
+		if (kind < 3 && ++count > NAME_BUDGET) {
+			git_reference_free(ref);
+			break;
+		}
+		// an annotated tag names the commit it is on as <tag>^0
+		if (kind == 0 && target && git_reference_peel(&peeled, ref, GIT_OBJECT_COMMIT) == 0) {
+			annotated = !git_oid_equal(git_object_id(peeled), target);
+			target = git_object_id(peeled);
+		}
+		if (kind < 3 && target && git_oid_equal(target, oid) &&
+				snprintf(short_name, sizeof short_name, "%s%s", name + (kind == 1 ? 11 : 5),
+					annotated ? "^0" : "") < sizeof short_name &&
+				(!*best || kind < best_kind || (kind == best_kind && strcmp(short_name, best) < 0))) {
+			strcpy(best, short_name);
+			best_kind = kind;
+		}
+		git_object_free(peeled);
+		git_reference_free(ref);
+	}
+	git_reference_iterator_free(it);
+	if (err != GIT_ITEROVER || !*best || strlen(best) >= size) {
+		return -1;
+	}
+	strcpy(buf, best);
+	return 0;
+}
+
+static void* libgit2_discover(const char* cwd) {
+	libgit2_repo* lr = calloc(1, sizeof *lr);
+
+	if (!lr || strlen(cwd) >= sizeof lr->cwd) {
+		free(lr);
+		return NULL;
+	}
+	git_libgit2_init();
+	if (git_repository_open_ext(&lr->repo, cwd, 0, NULL) != 0) {
+		git_libgit2_shutdown();
+		free(lr);
+		return NULL;
+	}
+	strcpy(lr->cwd, cwd);
+	return lr;
+}
+
+static int libgit2_location(void* data) {
+	libgit2_repo* lr = data;
+	const char* workdir = git_repository_workdir(lr->repo);
+
+	if (within(lr->cwd, git_repository_path(lr->repo))) {
+		return git_repository_is_bare(lr->repo) ? REPO_BARE : REPO_GITDIR;
+	}
+	return workdir && within(lr->cwd, workdir) ? REPO_WORKTREE : REPO_OTHER;
+}
+
+static const char* libgit2_head(void* data, char* buf, size_t size, int* detached) {
+	libgit2_repo* lr = data;
+	git_reference* ref;
+	const char* result = NULL;
+
+	*detached = 0;
+	if (git_reference_lookup(&ref, lr->repo, "HEAD") != 0) {
+		return NULL;
+	}
+	if (git_reference_type(ref) == GIT_REFERENCE_SYMBOLIC) {
+		if (strlen(git_reference_symbolic_target(ref)) < size) {
+			result = strcpy(buf, git_reference_symbolic_target(ref));
+		}
+	} else if (size >= 12) {
+		*detached = 1;
+		*buf = '(';
+		// a ref pointing right at it names it, otherwise it is the abbreviated commit
+		if (name_commit(lr->repo, git_reference_target(ref), buf + 1, size - 2) != 0) {
+			git_oid_tostr(buf + 1, 8, git_reference_target(ref));
+			strcat(buf, "...");
+		}
+		strcat(buf, ")");
+		result = buf;
+	}
+	git_reference_free(ref);
+	return result;
+}
+
+static const char* libgit2_operation(void* data, char* buf, size_t size, char* branch, size_t bsize) {
+	repo_operation(git_repository_path(((libgit2_repo*)data)->repo), buf, size, branch, bsize);
+	return buf;
+}
+
+static int changes(const char* path, unsigned int status, void* data) {
+	libgit2_repo* lr = data;
+
+	if (status & (GIT_STATUS_INDEX_NEW | GIT_STATUS_INDEX_MODIFIED | GIT_STATUS_INDEX_DELETED |
+			GIT_STATUS_INDEX_RENAMED | GIT_STATUS_INDEX_TYPECHANGE | GIT_STATUS_CONFLICTED)) {
+		lr->staged = 1;
+	}
+	if (status & (GIT_STATUS_WT_MODIFIED | GIT_STATUS_WT_DELETED | GIT_STATUS_WT_RENAMED |
+			GIT_STATUS_WT_TYPECHANGE | GIT_STATUS_CONFLICTED)) {
+		lr->dirty = 1;
+	}
+	return lr->staged && lr->dirty;
+}
+
+static libgit2_repo* scan(void* data) {
+	libgit2_repo* lr = data;
+	git_status_options opts = GIT_STATUS_OPTIONS_INIT;
+
+	if (!lr->scanned) {
+		opts.show = GIT_STATUS_SHOW_INDEX_AND_WORKDIR;
+		opts.flags = 0;
+		// a failed scan shows as changed, like the other backends
+		if (git_status_foreach_ext(lr->repo, &opts, changes, lr) < 0) {
+			lr->staged = lr->dirty = 1;
+		}
+		lr->scanned = 1;
+	}
+	return lr;
+}
+
+static const char* libgit2_dirty(void* data) {
+	return scan(data)->dirty ? "*" : NULL;
+}
+
+static const char* libgit2_staged(void* data) {
+	libgit2_repo* lr = scan(data);
+	return lr->staged ? "+" : git_repository_head_unborn(lr->repo) == 1 ? "#" : NULL;
+}
+
+static const char* libgit2_stash(void* data) {
+	git_oid oid;
+	return git_reference_name_to_id(&oid, ((libgit2_repo*)data)->repo, "refs/stash") == 0 ? "$" : NULL;
+}
+
+static int untracked(const char* path, unsigned int status, void* data) {
+	return (status & GIT_STATUS_WT_NEW) != 0;
+}
+
+// libgit2 doesn't read the untracked cache, so untracked files are only looked for when asked for
+static const char* libgit2_untracked(void* data) {
+	libgit2_repo* lr = data;
+	git_status_options opts = GIT_STATUS_OPTIONS_INIT;
+	git_config* config;
+	int show = 0;
+
+	if (git_repository_config_snapshot(&config, lr->repo) == 0) {
+		if (git_config_get_bool(&show, config, "bash.showUntrackedFiles") != 0) {
+			show = 0;
+		}
+		git_config_free(config);
+	}
+	if (!show) {
+		return NULL;
+	}
+	opts.show = GIT_STATUS_SHOW_WORKDIR_ONLY;
+	opts.flags = GIT_STATUS_OPT_INCLUDE_UNTRACKED | GIT_STATUS_OPT_EXCLUDE_SUBMODULES;
+	return git_status_foreach_ext(lr->repo, &opts, untracked, NULL) > 0 ? "%" : NULL;
+}
+
+static const char* libgit2_upstream(void* data) {
+	libgit2_repo* lr = data;
+	git_reference *head, *upstream;
+	const char* arrow = NULL;
+	size_t ahead, behind;
+
+	if (git_repository_head(&head, lr->repo) != 0) {
+		return NULL;
+	}
+	if (git_branch_upstream(&upstream, head) == 0) {
+		if (git_reference_target(head) && git_reference_target(upstream) &&
+				git_graph_ahead_behind(&ahead, &behind, lr->repo, git_reference_target(head),
+					git_reference_target(upstream)) == 0) {
+			arrow = ahead && behind ? "\u2195" : ahead ? "\u2191" : behind ? "\u2193" : "";
+		}
+		git_reference_free(upstream);
+	}
+	git_reference_free(head);
+	return arrow;
+}
+
+static void libgit2_close(void* data) {
+	libgit2_repo* lr = data;
+
+	git_repository_free(lr->repo);
+	free(lr);
+	git_libgit2_shutdown();
+}
+
+const git_backend libgit2_backend = {
+	"libgit2", libgit2_discover, libgit2_location, libgit2_head, libgit2_operation,
+	libgit2_dirty, libgit2_staged, libgit2_stash, libgit2_untracked, libgit2_upstream, libgit2_close,
+};
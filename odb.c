@@ -0,0 +1,754 @@
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+#include <zlib.h>
+#include "git.h"
+
+#define OBJ_OFS_DELTA 6
+#define OBJ_REF_DELTA 7
+
+// deltas deeper than this are left to git, it writes 50 by default and 250 when aggressive
+#define MAX_CHAIN 1024
+#define DELTA_CACHE 64
+#define DELTA_CACHE_MAXSIZE (1 << 20)
+
+typedef struct {
+	char path[PATH_MAX];
+	unsigned char* idx;
+	size_t idxsize;
+	uint32_t count;
+	unsigned char* data;
+	size_t size;
+	int failed;
+} pack_file;
+
+typedef struct {
+	unsigned char* map;
+	size_t size;
+	const unsigned char* fanout;
+	const unsigned char* oids;
+	const unsigned char* offsets;
+	const unsigned char* large;
+	size_t nlarge;
+	uint32_t count;
+	uint32_t npacks;
+	int* packs;
+	const char* names;
+	size_t namesize;
+} multi_pack;
+
+typedef struct {
+	const pack_file* pack;
+	uint64_t offset;
+	char* buf;
+	size_t size;
+	int type;
+} delta_base;
+
+// packs stay open between reads, until the pack directory changes; one per repository and never shared between
+// threads, the daemon serves each prompt with its own
+struct git_odb {
+	struct timespec mtime;
+	int loaded;
+	pack_file* packs;
+	int npacks;
+	multi_pack midx;
+	delta_base cache[DELTA_CACHE];
+};
+
+static int type_from_name(const char* name) {
+	return strcmp(name, "commit") == 0 ? OBJ_COMMIT :
+		strcmp(name, "tree") == 0 ? OBJ_TREE :
+		strcmp(name, "blob") == 0 ? OBJ_BLOB :
+		strcmp(name, "tag") == 0 ? OBJ_TAG :
+		-1;
+}
+
+static void* loose_read(const git_repo* repo, const unsigned char* oid, int* type, size_t* size) {
+	char path[PATH_MAX], hex[2 * GIT_MAX_RAWSZ + 1], hdr[64];
+	struct stat st;
+	unsigned char* map;
+	char* buf = NULL;
+	z_stream zs;
+	size_t len;
+	int fd;
+
+	oid2hex(oid, repo->rawsz, hex);
+	if (strlen(repo->objdir) + 2 * repo->rawsz + 3 > sizeof path) {
+		return NULL;
+	}
+	strcpy(path, repo->objdir);
+	strcat(path, "/");
+	len = strlen(path);
+	path[len] = hex[0];
+	path[len + 1] = hex[1];
+	path[len + 2] = '/';
+	strcpy(path + len + 3, hex + 2);
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size == 0 ||
+			(map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	memset(&zs, 0, sizeof zs);
+	if (inflateInit(&zs) != Z_OK) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	zs.next_in = map;
+	zs.avail_in = st.st_size;
+
+	// "<type> <size>\0" comes first, then the payload
+	zs.next_out = (unsigned char*)hdr;
+	zs.avail_out = sizeof hdr;
+	if (inflate(&zs, Z_SYNC_FLUSH) >= Z_OK) {
+		char* nul = memchr(hdr, 0, sizeof hdr - zs.avail_out);
+		char* sp = memchr(hdr, ' ', sizeof hdr);
+		if (nul && sp && sp < nul) {
+			size_t have = sizeof hdr - zs.avail_out - (nul + 1 - hdr);
+			*sp = 0;
+			*type = type_from_name(hdr);
+			*size = strtoul(sp + 1, NULL, 10);
+			if (*type > 0 && have <= *size && (buf = malloc(*size + 1))) {
+				memcpy(buf, nul + 1, have);
+				zs.next_out = (unsigned char*)buf + have;
+				zs.avail_out = *size - have;
+				if (*size > have && inflate(&zs, Z_FINISH) != Z_STREAM_END) {
+					free(buf);
+					buf = NULL;
+				} else {
+					buf[*size] = 0;
+				}
+			}
+		}
+	}
+
+	inflateEnd(&zs);
+	munmap(map, st.st_size);
+	return buf;
+}
+
+static void* map_file(const char* path, size_t* size) {
+	struct stat st;
+	void* map;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size == 0 ||
+			(map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	*size = st.st_size;
+	return map;
+}
+
+static uint64_t get_be64(const unsigned char* p) {
+	return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+// position of oid in a sorted table with a 256 entry fanout in front, -1 if absent
+static int64_t fanout_find(const unsigned char* fanout, const unsigned char* oids, int rawsz, const unsigned char* oid) {
+	uint32_t lo = *oid ? get_be32(fanout + (*oid - 1) * 4) : 0;
+	uint32_t hi = get_be32(fanout + *oid * 4);
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		int cmp = memcmp(oids + (size_t)mid * rawsz, oid, rawsz);
+		if (cmp == 0) {
+			return mid;
+		}
+		if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return -1;
+}
+
+static void odb_free(git_odb* odb) {
+	int n;
+
+	for (n = 0; n < DELTA_CACHE; ++n) {
+		free(odb->cache[n].buf);
+	}
+	memset(odb->cache, 0, sizeof odb->cache);
+	for (n = 0; n < odb->npacks; ++n) {
+		if (odb->packs[n].idx) {
+			munmap(odb->packs[n].idx, odb->packs[n].idxsize);
+		}
+		if (odb->packs[n].data) {
+			munmap(odb->packs[n].data, odb->packs[n].size);
+		}
+	}
+	free(odb->packs);
+	odb->packs = NULL;
+	odb->npacks = 0;
+	if (odb->midx.map) {
+		munmap(odb->midx.map, odb->midx.size);
+	}
+	free(odb->midx.packs);
+	memset(&odb->midx, 0, sizeof odb->midx);
+	odb->loaded = 0;
+}
+
+// "MIDX", version, hash version, chunk count, base count, pack count, then the chunk table
+static void midx_open(multi_pack* midx, const char* path, int rawsz) {
+	const unsigned char *map, *chunk;
+	uint32_t n, chunks;
+
+	if (!(midx->map = map_file(path, &midx->size))) {
+		return;
+	}
+	map = midx->map;
+	chunks = map[6];
+	if (midx->size < 12 || memcmp(map, "MIDX", 4) != 0 || map[4] != 1 || map[5] != (rawsz == 32 ? 2 : 1) ||
+			map[7] != 0 || 12 + 12 * (chunks + 1) > midx->size) {
+		goto fail;
+	}
+	midx->npacks = get_be32(map + 8);
+	for (n = 0, chunk = map + 12; n < chunks; ++n, chunk += 12) {
+		uint64_t offset = get_be64(chunk + 4), next = get_be64(chunk + 16);
+		if (next < offset || next > midx->size) {
+			goto fail;
+		}
+		if (memcmp(chunk, "OIDF", 4) == 0 && next - offset == 256 * 4) {
+			midx->fanout = map + offset;
+		} else if (memcmp(chunk, "OIDL", 4) == 0) {
+			midx->oids = map + offset;
+			midx->count = (next - offset) / rawsz;
+		} else if (memcmp(chunk, "OOFF", 4) == 0) {
+			midx->offsets = map + offset;
+			if ((next - offset) / 8 < midx->count) {
+				goto fail;
+			}
+		} else if (memcmp(chunk, "LOFF", 4) == 0) {
+			midx->large = map + offset;
+			midx->nlarge = (next - offset) / 8;
+		} else if (memcmp(chunk, "PNAM", 4) == 0) {
+			// the names are what the packs get matched against once the directory is read
+			const char* name = (const char*)map + offset;
+			if (!(midx->packs = malloc(midx->npacks * sizeof *midx->packs))) {
+				goto fail;
+			}
+			for (n = 0; n < midx->npacks; ++n) {
+				midx->packs[n] = -1;
+			}
+			midx->names = name;
+			midx->namesize = next - offset;
+		}
+	}
+	if (midx->fanout && midx->oids && midx->offsets && midx->packs &&
+			get_be32(midx->fanout + 255 * 4) == midx->count) {
+		return;
+	}
+
+fail:
+	munmap(midx->map, midx->size);
+	free(midx->packs);
+	memset(midx, 0, sizeof *midx);
+}
+
+// the midx pack id of an .idx name, -1 when the midx doesn't cover it
+static int midx_pack(const multi_pack* midx, const char* idxname) {
+	const char *p = midx->names, *end = p + midx->namesize;
+	uint32_t n;
+
+	for (n = 0; n < midx->npacks && p < end; ++n) {
+		size_t len = strnlen(p, end - p);
+		if (strcmp(p, idxname) == 0) {
+			return n;
+		}
+		p += len + 1;
+	}
+	return -1;
+}
+
+static int idx_open(pack_file* pack, const char* path, int rawsz) {
+	const unsigned char* idx;
+
+	if (!(pack->idx = map_file(path, &pack->idxsize))) {
+		return -1;
+	}
+	// version 2: magic, version, fanout, names, crcs, offsets, large offsets, checksums
+	idx = pack->idx;
+	if (pack->idxsize < 8 + 256 * 4 + 2 * rawsz || memcmp(idx, "\377tOc", 4) != 0 || get_be32(idx + 4) != 2 ||
+			(pack->count = get_be32(idx + 8 + 255 * 4),
+			pack->idxsize < 8 + 256 * 4 + (size_t)pack->count * (rawsz + 8) + 2 * rawsz)) {
+		munmap(pack->idx, pack->idxsize);
+		pack->idx = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static int pack_cmp(const void* a, const void* b) {
+	return strcmp(((const pack_file*)a)->path, ((const pack_file*)b)->path);
+}
+
+static void odb_load(git_odb* odb, const git_repo* repo) {
+	char path[PATH_MAX];
+	struct stat st;
+	struct dirent* de;
+	DIR* dir;
+	size_t len = strlen(repo->objdir);
+	int alloc = 0, n;
+
+	odb_free(odb);
+	odb->loaded = 1;
+	if (len + 6 + NAME_MAX + 1 > sizeof path) {
+		return;
+	}
+	strcpy(path, repo->objdir);
+	strcat(path, "/pack");
+	if (stat(path, &st) != 0 || !(dir = opendir(path))) {
+		return;
+	}
+	odb->mtime = st.st_mtim;
+	strcpy(path + len + 5, "/multi-pack-index");
+	midx_open(&odb->midx, path, repo->rawsz);
+
+	while ((de = readdir(dir))) {
+		size_t namelen = strlen(de->d_name);
+		pack_file* pack;
+		if (namelen < 6 || strcmp(de->d_name + namelen - 5, ".pack") != 0) {
+			continue;
+		}
+		if (odb->npacks == alloc) {
+			pack_file* packs = realloc(odb->packs, (alloc = alloc ? 2 * alloc : 8) * sizeof *packs);
+			if (!packs) {
+				break;
+			}
+			odb->packs = packs;
+		}
+		pack = &odb->packs[odb->npacks];
+		memset(pack, 0, sizeof *pack);
+		path[len + 5] = '/';
+		strcpy(path + len + 6, de->d_name);
+		strcpy(pack->path, path);
+		++odb->npacks;
+	}
+	closedir(dir);
+	qsort(odb->packs, odb->npacks, sizeof *odb->packs, pack_cmp);
+
+	// packs the midx covers don't need their own index
+	for (n = 0; n < odb->npacks; ++n) {
+		pack_file* pack = &odb->packs[n];
+		char* name = strrchr(pack->path, '/') + 1;
+		int id;
+		strcpy(pack->path + strlen(pack->path) - 5, ".idx");
+		if (odb->midx.map && (id = midx_pack(&odb->midx, name)) >= 0) {
+			odb->midx.packs[id] = n;
+		} else if (idx_open(pack, pack->path, repo->rawsz) != 0) {
+			pack->failed = 1;
+		}
+		strcpy(pack->path + strlen(pack->path) - 4, ".pack");
+	}
+}
+
+// where an object sits in the packs, the midx first
+static pack_file* pack_find(git_odb* odb, const unsigned char* oid, int rawsz, uint64_t* offset) {
+	int64_t pos;
+	int n;
+
+	if (odb->midx.map && (pos = fanout_find(odb->midx.fanout, odb->midx.oids, rawsz, oid)) >= 0) {
+		const unsigned char* entry = odb->midx.offsets + pos * 8;
+		uint32_t id = get_be32(entry), ofs = get_be32(entry + 4);
+		if (id < odb->midx.npacks && odb->midx.packs[id] >= 0) {
+			if (!(ofs & 0x80000000)) {
+				*offset = ofs;
+				return &odb->packs[odb->midx.packs[id]];
+			}
+			if ((ofs & 0x7fffffff) < odb->midx.nlarge) {
+				*offset = get_be64(odb->midx.large + (ofs & 0x7fffffff) * 8);
+				return &odb->packs[odb->midx.packs[id]];
+			}
+		}
+	}
+	for (n = 0; n < odb->npacks; ++n) {
+		pack_file* pack = &odb->packs[n];
+		const unsigned char* offsets;
+		uint32_t ofs;
+		if (!pack->idx || (pos = fanout_find(pack->idx + 8, pack->idx + 8 + 256 * 4, rawsz, oid)) < 0) {
+			continue;
+		}
+		offsets = pack->idx + 8 + 256 * 4 + (size_t)pack->count * (rawsz + 4);
+		ofs = get_be32(offsets + pos * 4);
+		if (!(ofs & 0x80000000)) {
+			*offset = ofs;
+			return pack;
+		}
+		offsets += (size_t)pack->count * 4 + (size_t)(ofs & 0x7fffffff) * 8;
+		if (offsets + 8 > pack->idx + pack->idxsize) {
+			return NULL;
+		}
+		*offset = get_be64(offsets);
+		return pack;
+	}
+	return NULL;
+}
+
+static void* inflate_object(const unsigned char* in, size_t avail, size_t size) {
+	char* buf = malloc(size + 1);
+	z_stream zs;
+	int status;
+
+	if (!buf) {
+		return NULL;
+	}
+	memset(&zs, 0, sizeof zs);
+	if (inflateInit(&zs) != Z_OK) {
+		free(buf);
+		return NULL;
+	}
+	zs.next_in = (unsigned char*)in;
+	zs.avail_in = avail;
+	zs.next_out = (unsigned char*)buf;
+	zs.avail_out = size;
+	status = inflate(&zs, Z_FINISH);
+	inflateEnd(&zs);
+	if (status != Z_STREAM_END || zs.total_out != size) {
+		free(buf);
+		return NULL;
+	}
+	buf[size] = 0;
+	return buf;
+}
+
+static size_t delta_size(const unsigned char** p, const unsigned char* end) {
+	size_t size = 0;
+	int shift = 0;
+
+	while (*p < end && shift < 64) {
+		unsigned char c = *((*p)++);
+		size |= (size_t)(c & 0x7f) << shift;
+		shift += 7;
+		if (!(c & 0x80)) {
+			break;
+		}
+	}
+	return size;
+}
+
+// copies from the base and literal inserts, against sizes given up front
+static char* delta_apply(const char* base, size_t basesize, const unsigned char* delta, size_t deltasize, size_t* size) {
+	const unsigned char *p = delta, *end = delta + deltasize;
+	char *buf, *out;
+
+	if (delta_size(&p, end) != basesize) {
+		return NULL;
+	}
+	*size = delta_size(&p, end);
+	if (!(buf = out = malloc(*size + 1))) {
+		return NULL;
+	}
+	while (p < end) {
+		unsigned char cmd = *(p++);
+		if (cmd & 0x80) {
+			size_t offset = 0, len = 0;
+			int n;
+			for (n = 0; n < 4; ++n) {
+				if (cmd & (1 << n)) {
+					offset |= (size_t)(p < end ? *(p++) : 0) << (8 * n);
+				}
+			}
+			for (n = 0; n < 3; ++n) {
+				if (cmd & (0x10 << n)) {
+					len |= (size_t)(p < end ? *(p++) : 0) << (8 * n);
+				}
+			}
+			if (!len) {
+				len = 0x10000;
+			}
+			if (offset + len > basesize || len > *size - (out - buf)) {
+				break;
+			}
+			memcpy(out, base + offset, len);
+			out += len;
+		} else if (cmd && cmd <= end - p && cmd <= *size - (out - buf)) {
+			memcpy(out, p, cmd);
+			out += cmd;
+			p += cmd;
+		} else {
+			break;
+		}
+	}
+	if (p != end || out != buf + *size) {
+		free(buf);
+		return NULL;
+	}
+	*out = 0;
+	return buf;
+}
+
+static delta_base* cache_slot(git_odb* odb, const pack_file* pack, uint64_t offset) {
+	return &odb->cache[(offset ^ (offset >> 7) ^ (uintptr_t)pack >> 4) % DELTA_CACHE];
+}
+
+static char* cache_get(git_odb* odb, const pack_file* pack, uint64_t offset, int* type, size_t* size) {
+	delta_base* entry = cache_slot(odb, pack, offset);
+	char* buf;
+
+	if (!entry->buf || entry->pack != pack || entry->offset != offset || !(buf = malloc(entry->size + 1))) {
+		return NULL;
+	}
+	memcpy(buf, entry->buf, entry->size + 1);
+	*type = entry->type;
+	*size = entry->size;
+	return buf;
+}
+
+static void cache_put(git_odb* odb, const pack_file* pack, uint64_t offset, const char* buf, int type, size_t size) {
+	delta_base* entry = cache_slot(odb, pack, offset);
+	char* copy;
+
+	if (size > DELTA_CACHE_MAXSIZE || !(copy = malloc(size + 1))) {
+		return;
+	}
+	memcpy(copy, buf, size + 1);
+	free(entry->buf);
+	entry->pack = pack;
+	entry->offset = offset;
+	entry->buf = copy;
+	entry->size = size;
+	entry->type = type;
+}
+
+static void* odb_read_depth(git_odb* odb, const git_repo* repo, const unsigned char* oid, int* type, size_t* size, int depth);
+
+// the type and size bits, then the base reference of deltas; returns the start of the zlib data
+static const unsigned char* pack_header(const git_repo* repo, const pack_file* pack, uint64_t offset,
+		int* type, size_t* size, uint64_t* base, const unsigned char** baseoid) {
+	const unsigned char *p = pack->data + offset, *end = pack->data + pack->size - repo->rawsz;
+	unsigned char c;
+	int shift = 4;
+
+	if (offset < 12 || p >= end) {
+		return NULL;
+	}
+	c = *(p++);
+	*type = c >> 4 & 7;
+	*size = c & 15;
+	while (c & 0x80 && p < end && shift < 64) {
+		c = *(p++);
+		*size |= (size_t)(c & 0x7f) << shift;
+		shift += 7;
+	}
+	if (*type == OBJ_OFS_DELTA) {
+		uint64_t ofs;
+		if (p == end) {
+			return NULL;
+		}
+		c = *(p++);
+		ofs = c & 0x7f;
+		while (c & 0x80 && p < end) {
+			c = *(p++);
+			ofs = ((ofs + 1) << 7) | (c & 0x7f);
+		}
+		if (ofs == 0 || ofs > offset) {
+			return NULL;
+		}
+		*base = offset - ofs;
+	} else if (*type == OBJ_REF_DELTA) {
+		if (end - p < repo->rawsz) {
+			return NULL;
+		}
+		*baseoid = p;
+		p += repo->rawsz;
+	} else if (*type < OBJ_COMMIT || *type > OBJ_TAG) {
+		return NULL;
+	}
+	return p < end ? p : NULL;
+}
+
+static void* pack_read(git_odb* odb, const git_repo* repo, pack_file* pack, uint64_t offset, int* type, size_t* size, int depth) {
+	uint64_t chain[MAX_CHAIN];
+	const unsigned char* data;
+	char* buf = NULL;
+	int n = 0, base;
+
+	if (!pack->data) {
+		if (pack->failed || !(pack->data = map_file(pack->path, &pack->size)) ||
+				pack->size < 12 + repo->rawsz || memcmp(pack->data, "PACK", 4) != 0) {
+			if (pack->data) {
+				munmap(pack->data, pack->size);
+				pack->data = NULL;
+			}
+			pack->failed = 1;
+			return NULL;
+		}
+	}
+	if (offset >= pack->size) {
+		return NULL;
+	}
+
+	// down the chain to a base, or something cached on the way
+	while (n < MAX_CHAIN) {
+		const unsigned char* baseoid = NULL;
+		uint64_t next = 0;
+		if ((buf = cache_get(odb, pack, offset, type, size))) {
+			break;
+		}
+		if (!(data = pack_header(repo, pack, offset, type, size, &next, &baseoid))) {
+			return NULL;
+		}
+		if (*type == OBJ_OFS_DELTA) {
+			chain[n++] = offset;
+			offset = next;
+		} else if (*type == OBJ_REF_DELTA) {
+			unsigned char oid[GIT_MAX_RAWSZ];
+			chain[n++] = offset;
+			// bases in the same pack continue the chain, others are read whole
+			if (pack_find(odb, baseoid, repo->rawsz, &next) == pack) {
+				offset = next;
+				continue;
+			}
+			memcpy(oid, baseoid, repo->rawsz);
+			if (depth > 8 || !(buf = odb_read_depth(odb, repo, oid, type, size, depth + 1))) {
+				return NULL;
+			}
+			break;
+		} else {
+			if (!(buf = inflate_object(data, pack->data + pack->size - data, *size))) {
+				return NULL;
+			}
+			cache_put(odb, pack, offset, buf, *type, *size);
+			break;
+		}
+	}
+	if (!buf) {
+		return NULL;
+	}
+
+	// and back up applying the deltas, caching what could be the next chain's base
+	for (base = n - 1; base >= 0; --base) {
+		const unsigned char* baseoid;
+		uint64_t next;
+		size_t deltasize, outsize;
+		int deltatype;
+		char *delta, *out;
+		if (!(data = pack_header(repo, pack, chain[base], &deltatype, &deltasize, &next, &baseoid)) ||
+				!(delta = inflate_object(data, pack->data + pack->size - data, deltasize))) {
+			free(buf);
+			return NULL;
+		}
+		out = delta_apply(buf, *size, (unsigned char*)delta, deltasize, &outsize);
+		free(delta);
+		free(buf);
+		if (!(buf = out)) {
+			return NULL;
+		}
+		*size = outsize;
+		if (base > 0) {
+			cache_put(odb, pack, chain[base], buf, *type, *size);
+		}
+	}
+	return buf;
+}
+
+static void* odb_read_depth(git_odb* odb, const git_repo* repo, const unsigned char* oid, int* type, size_t* size, int depth) {
+	struct timespec mtime;
+	char path[PATH_MAX];
+	struct stat st;
+	pack_file* pack;
+	uint64_t offset;
+	void* buf;
+
+	if (!odb->loaded) {
+		odb_load(odb, repo);
+	}
+	if ((pack = pack_find(odb, oid, repo->rawsz, &offset)) && (buf = pack_read(odb, repo, pack, offset, type, size, depth))) {
+		return buf;
+	}
+	if ((buf = loose_read(repo, oid, type, size))) {
+		return buf;
+	}
+	// a repack may have moved it, look again if the packs changed
+	strcpy(path, repo->objdir);
+	strcat(path, "/pack");
+	if (stat(path, &st) != 0) {
+		return NULL;
+	}
+	mtime = st.st_mtim;
+	if (mtime.tv_sec == odb->mtime.tv_sec && mtime.tv_nsec == odb->mtime.tv_nsec) {
+		return NULL;
+	}
+	odb_load(odb, repo);
+	return (pack = pack_find(odb, oid, repo->rawsz, &offset)) ? pack_read(odb, repo, pack, offset, type, size, depth) : NULL;
+}
+
+// the packs are only looked at once something is read
+git_odb* odb_open() {
+	return calloc(1, sizeof(git_odb));
+}
+
+void odb_close(git_odb* odb) {
+	if (odb) {
+		odb_free(odb);
+		free(odb);
+	}
+}
+
+// through the repository's odb, or one just for this read when it has none
+void* odb_read(const git_repo* repo, const unsigned char* oid, int* type, size_t* size) {
+	git_odb* odb = repo->odb ? repo->odb : odb_open();
+	void* buf = odb ? odb_read_depth(odb, repo, oid, type, size, 0) : NULL;
+
+	if (odb != repo->odb) {
+		odb_close(odb);
+	}
+	return buf;
+}
+
+int commit_tree(const git_repo* repo, const unsigned char* commit, unsigned char* tree) {
+	size_t size;
+	int type, rawsz = repo->rawsz, result = -1;
+	char* buf = odb_read(repo, commit, &type, &size);
+
+	if (buf) {
+		if (type == OBJ_COMMIT && size > 5 + 2 * rawsz && strncmp(buf, "tree ", 5) == 0) {
+			result = hex2oid(buf + 5, tree, rawsz);
+		}
+		free(buf);
+	}
+	return result;
+}
+
+// the parents of a commit in order, -1 when the commit can't be read
+int commit_parents(const git_repo* repo, const unsigned char* commit, unsigned char* parents, int max) {
+	size_t size;
+	int type, rawsz = repo->rawsz, count = -1;
+	char* buf = odb_read(repo, commit, &type, &size);
+	char* p;
+
+	if (buf) {
+		if (type == OBJ_COMMIT && (p = strchr(buf, '\n'))) {
+			count = 0;
+			while (strncmp(p + 1, "parent ", 7) == 0 && count >= 0) {
+				p += 8;
+				if (count == max || hex2oid(p, parents + count * rawsz, rawsz) != 0 || p[2 * rawsz] != '\n') {
+					count = -1;
+				} else {
+					++count;
+					p += 2 * rawsz;
+				}
+			}
+		}
+		free(buf);
+	}
+	return count;
+}
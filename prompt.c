@@ -1,13 +1,22 @@
+#define _GNU_SOURCE
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <poll.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/file.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/utsname.h>
 #include <linux/limits.h>
+#include "git.h"
 
 typedef struct {
 	const char* user;
@@ -17,18 +26,73 @@ typedef struct {
 	int error;
 } prompt_data;
 
-static char* rev_parse[] = {"git", "rev-parse", "--git-dir", "--is-inside-git-dir", "--is-bare-repository", "--is-inside-work-tree", "--short", "HEAD", NULL};
-static char* diff[] = {"git", "diff", "--no-ext-diff", "--quiet", NULL};
-static char* diff_cached[] = {"git", "diff", "--no-ext-diff", "--quiet", "--cached", NULL};
-static char* check_stash[] = {"git", "rev-parse", "--verify", "--quiet", "refs/stash", NULL};
-static char* read_head[] = {"git", "symbolic-ref", "HEAD", NULL};
+// returns 1 once it has heard enough
+typedef int (*record_fn)(void* data, const char* record);
+
+typedef struct {
+	pid_t pid;
+	int fd;
+	int single;
+	char* buf;
+	char* p;
+	size_t size;
+	int status;
+	// with a parser the output is handed over a NUL terminated record at a time, as it comes
+	record_fn parse;
+	void* data;
+	int cut;
+	// killed or never started for want of time, what it was to tell is unknown
+	int late;
+} probe;
+
+// what git status has told so far, -1 where it hasn't yet
+typedef struct {
+	int clean, unchanged, counted;
+	const char* arrow;
+	int renamed;
+} status_scan;
+
+// the branch header is only asked for when the upstream needs counting, see native_discover
+static char* status[] = {"git", "--no-optional-locks", "status", "--porcelain=v2", "-z", "--untracked-files=no",
+	NULL};
+static char* others[] = {"git", "ls-files", "--others", "--exclude-standard", "--directory", "--no-empty-directory",
+	"--error-unmatch", "--", ":/*", NULL};
+// what the cli backend asks git for the rest
+static char* rev_parse[] = {"git", "rev-parse", "--absolute-git-dir", "--is-inside-git-dir", "--is-bare-repository",
+	"--is-inside-work-tree", "--short", "HEAD", NULL};
+static char* symbolic_ref[] = {"git", "symbolic-ref", "HEAD", NULL};
 static char* describe[] = {"git", "describe", "--contains", "--all", "HEAD", NULL};
-static char* upstream[] = {"git", "rev-list", "--count", "--left-right", "@{upstream}...HEAD", NULL};
+static char* check_stash[] = {"git", "rev-parse", "--verify", "--quiet", "refs/stash", NULL};
+static char* show_untracked[] = {"git", "config", "--bool", "bash.showUntrackedFiles", NULL};
+
+extern char** environ;
 
 static char prompt[4096];
 static char* current = prompt;
 static int remaining = sizeof prompt;
 static const char* lastbg = NULL;
+static int devnull = -1;
+static const char unknown[] = "?";
+
+// the daemon keeps indexes open between prompts, for as long as the file is the one they were read from
+#define KEPT_INDEXES 16
+
+typedef struct {
+	char path[PATH_MAX];
+	struct stat st;
+	git_index* index;
+	int users;
+	unsigned long used;
+} kept_index;
+
+static kept_index kept[KEPT_INDEXES];
+static pthread_mutex_t kept_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long kept_tick;
+static int keeping;
+static int watching;
+
+// how long a background refresh may take
+#define PROMPT_REFRESH_MS 30000
 
 void append(const char* src, ...) {
 	va_list ap;
@@ -94,82 +158,355 @@ const char* strcatv(char* dst, ...) {
 	return dst;
 }
 
-int readp(char* const* cmd, int single, char* buf, size_t size) {
-	int c2p[2], wstatus = 0;
-	pid_t pid;
-	char* p = buf;
+void startp(probe* pr, char* const* cmd, int single, char* buf, size_t size) {
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	int c2p[2];
+
+	pr->pid = -1;
+	pr->fd = -1;
+	pr->single = single;
+	pr->buf = pr->p = buf;
+	pr->size = size;
+	pr->status = -1;
+	pr->parse = NULL;
+	pr->cut = 0;
+	pr->late = 0;
+	*buf = 0;
 
-	if (pipe(c2p) == 0 && (pid = fork()) != -1) {
-		if (pid == 0) {
-			// child
+	if (!cmd) {
+		return;
+	}
+	if (deadline_left() == 0) {
+		pr->late = 1;
+		return;
+	}
+	// the daemon's threads may get here together, only one of them keeps its descriptor
+	if (__atomic_load_n(&devnull, __ATOMIC_ACQUIRE) == -1) {
+		int fd = open("/dev/null", O_RDWR | O_CLOEXEC), none = -1;
+		if (!__atomic_compare_exchange_n(&devnull, &none, fd, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			close(fd);
+		}
+	}
+
+	if (pipe2(c2p, O_CLOEXEC) == 0) {
+		// posix_spawn uses CLONE_VM|CLONE_VFORK, no page tables are copied
+		posix_spawn_file_actions_init(&actions);
+		posix_spawn_file_actions_adddup2(&actions, devnull, 0); // stdin
+		posix_spawn_file_actions_adddup2(&actions, c2p[1], 1); // stdout
+		posix_spawn_file_actions_adddup2(&actions, devnull, 2); // stderr
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 34)
+		// don't leak whatever the shell left open, closes with close_range
+		posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+#endif
+		// a process group of its own, so whatever git starts goes when it is killed
+		posix_spawnattr_init(&attr);
+		posix_spawnattr_setpgroup(&attr, 0);
+		posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+		if (posix_spawnp(&pr->pid, cmd[0], &actions, &attr, cmd, environ) != 0) {
+			pr->pid = -1;
+		}
+		posix_spawnattr_destroy(&attr);
+		posix_spawn_file_actions_destroy(&actions);
+		close(c2p[1]);
+		if (pr->pid == -1) {
 			close(c2p[0]);
-			dup2(c2p[1], 1); // stdout
-			dup2(open("/dev/null", O_WRONLY), 2); // stderr
-			execvp(cmd[0], cmd);
-			exit(1);
 		} else {
-			// parent
-			int n, r = size - 1;
-			close(c2p[1]);
-			while (r > 0 && (n = read(c2p[0], p, r)) > 0) {
-				p += n;
-				r -= n;
+			fcntl(c2p[0], F_SETFL, O_NONBLOCK);
+			pr->fd = c2p[0];
+		}
+	}
+}
+
+// hands over the complete records read so far and keeps the rest for the next read
+static int records(probe* pr) {
+	char* start = pr->buf;
+	char* end;
+
+	while ((end = memchr(start, 0, pr->p - start))) {
+		if (pr->parse(pr->data, start)) {
+			return 1;
+		}
+		start = end + 1;
+	}
+	memmove(pr->buf, start, pr->p - start);
+	pr->p = pr->buf + (pr->p - start);
+	return 0;
+}
+
+// reads until every probe is done or the deadline passes, when those still running are killed
+void waitp(probe* probes, int count) {
+	struct pollfd fds[count];
+	int i, open, ready;
+
+	do {
+		open = 0;
+		for (i = 0; i < count; ++i) {
+			fds[i].fd = probes[i].fd;
+			fds[i].events = POLLIN;
+			fds[i].revents = 0;
+			if (probes[i].fd != -1) {
+				++open;
 			}
-			close(c2p[0]);
-			waitpid(pid, &wstatus, 0);
-			if (single && p != buf) {
-				--p;
+		}
+		if (open && (ready = poll(fds, count, deadline_left())) == 0) {
+			for (i = 0; i < count; ++i) {
+				probe* pr = &probes[i];
+				if (pr->fd != -1) {
+					deadline_kill(pr->pid);
+					close(pr->fd);
+					pr->fd = -1;
+					pr->late = 1;
+				}
+			}
+		} else if (open && ready > 0) {
+			for (i = 0; i < count; ++i) {
+				probe* pr = &probes[i];
+				if (fds[i].revents) {
+					int n = 0, r;
+					do {
+						r = pr->size - 1 - (pr->p - pr->buf);
+						while (r > 0 && (n = read(pr->fd, pr->p, r)) > 0) {
+							pr->p += n;
+							r -= n;
+						}
+						// the rest of the output isn't waited for once the parser has what it needs
+						if (pr->parse && (pr->cut = records(pr))) {
+							kill(-pr->pid, SIGTERM);
+						}
+					} while (pr->parse && !pr->cut && r <= 0 && pr->p != pr->buf + pr->size - 1);
+					// a full buffer is as good as EOF, the child gets SIGPIPE
+					if (pr->cut || r <= 0 || n == 0 || (n == -1 && errno != EAGAIN)) {
+						close(pr->fd);
+						pr->fd = -1;
+					}
+				}
 			}
 		}
+	} while (open);
+
+	for (i = 0; i < count; ++i) {
+		probe* pr = &probes[i];
+		if (pr->pid != -1) {
+			int wstatus;
+			// one killed for being late is left behind, it may be stuck where SIGKILL takes a while
+			if (pr->late || deadline_wait(pr->pid, &wstatus) != 0) {
+				pr->late = 1;
+			} else if (WIFEXITED(wstatus)) {
+				pr->status = WEXITSTATUS(wstatus);
+			}
+			if (pr->single && pr->p != pr->buf) {
+				--pr->p;
+			}
+		}
+		*pr->p = 0;
 	}
+}
 
-	*p = 0;
-	return WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1;
+int readp(char* const* cmd, int single, char* buf, size_t size) {
+	probe pr;
+	startp(&pr, cmd, single, buf, size);
+	waitp(&pr, 1);
+	return pr.status;
 }
 
-const char* readf(const char* path, char* buf, size_t size) {
-	char* p = buf;
-	int r = size - 1;
-	int fd = open(path, O_RDONLY);
+int islnk(const char* path) {
+	struct stat statbuf;
+	return lstat(path, &statbuf) == 0 && S_ISLNK(statbuf.st_mode);
+}
 
-	if (fd != -1) {
-		int n;
-		while ((n = read(fd, p, r)) > 0) {
-			p += n;
-			r -= n;
+static int same_file(const struct stat* a, const struct stat* b) {
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+		a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+		a->st_ctim.tv_sec == b->st_ctim.tv_sec && a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+// the repository's index, in the daemon one already open where the file hasn't changed since; NULL when it can't
+// be read
+git_index* acquire_index(const git_repo* repo) {
+	char tpath[PATH_MAX];
+	const char* path = getenv("GIT_INDEX_FILE");
+	kept_index* slot = NULL;
+	git_index* index;
+	struct stat st;
+	int known = 0, n;
+
+	if (!path) {
+		path = strcatv(tpath, repo->gitdir, "/index", NULL);
+	}
+	if (keeping && strlen(path) < sizeof slot->path && (known = stat(path, &st) == 0)) {
+		pthread_mutex_lock(&kept_lock);
+		for (n = 0; n < KEPT_INDEXES; ++n) {
+			kept_index* k = &kept[n];
+			if (k->index && strcmp(k->path, path) == 0 && same_file(&k->st, &st) && k->index->rawsz == repo->rawsz) {
+				++k->users;
+				k->used = ++kept_tick;
+				pthread_mutex_unlock(&kept_lock);
+				return k->index;
+			}
 		}
-		close(fd);
-		if (p != buf) {
-			--p;
+		pthread_mutex_unlock(&kept_lock);
+	}
+	if (!(index = malloc(sizeof *index)) || index_open(index, path, repo->rawsz) != 0) {
+		free(index);
+		return NULL;
+	}
+	if (!known) {
+		return index;
+	}
+
+	// older copies of the same file go, then the slot least recently used, as long as nobody is reading them
+	pthread_mutex_lock(&kept_lock);
+	for (n = 0; n < KEPT_INDEXES; ++n) {
+		kept_index* k = &kept[n];
+		if (k->index && !k->users && strcmp(k->path, path) == 0) {
+			index_close(k->index);
+			free(k->index);
+			k->index = NULL;
+		}
+		if (!k->users && (!slot || !k->index || (slot->index && k->used < slot->used))) {
+			slot = k;
+		}
+	}
+	if (slot) {
+		if (slot->index) {
+			index_close(slot->index);
+			free(slot->index);
+		}
+		strcpy(slot->path, path);
+		slot->st = st;
+		slot->index = index;
+		slot->users = 1;
+		slot->used = ++kept_tick;
+	}
+	pthread_mutex_unlock(&kept_lock);
+	return index;
+}
+
+void release_index(git_index* index) {
+	int n;
+
+	pthread_mutex_lock(&kept_lock);
+	for (n = 0; n < KEPT_INDEXES; ++n) {
+		if (kept[n].index == index) {
+			--kept[n].users;
+			pthread_mutex_unlock(&kept_lock);
+			return;
 		}
 	}
+	pthread_mutex_unlock(&kept_lock);
+	index_close(index);
+	free(index);
+}
 
-	*p = 0;
-	return buf;
+// 1 when the index matches HEAD, 0 when it doesn't, -1 when git has to tell
+int index_unchanged(const git_repo* repo, const git_index* idx, const unsigned char* head) {
+	unsigned char tree[GIT_MAX_RAWSZ];
+
+	if (!head) {
+		return idx->count == 0;
+	}
+	if (commit_tree(repo, head, tree) != 0) {
+		return -1;
+	}
+	return index_matches_tree(idx, repo, tree);
 }
 
-const char *split(char** next, char sep) {
-	char *buf = *next;
-	while (**next && **next != sep)
-		++*next;
-	**next = 0;
-	++*next;
+// the abbreviated HEAD as git rev-parse --short would print it, NULL when HEAD is unborn
+const char* short_head(const git_repo* repo, unsigned char* oid, char* buf) {
+	char tmp[16];
+	const char* abbrev = repo_config(repo, "core.abbrev", tmp, sizeof tmp);
+	int len = abbrev ? atoi(abbrev) : 0;
+
+	if (ref_resolve(repo, "HEAD", oid) != 0) {
+		return NULL;
+	}
+	if (len < 4 || len > 2 * repo->rawsz) {
+		len = 7;
+	}
+	oid2hex(oid, repo->rawsz, buf);
+	buf[len] = 0;
 	return buf;
 }
 
-int isdir(const char* path) {
-	struct stat statbuf;
-	return lstat(path, &statbuf) == 0 && S_ISDIR(statbuf.st_mode);
+// how HEAD stands against its upstream: ahead, behind, both or level, and -1 when git has to count
+int upstream_status(const git_repo* repo, const unsigned char* head, const char** arrow) {
+	char branch[256], upstream[PATH_MAX];
+	unsigned char oid[GIT_MAX_RAWSZ];
+	int ahead, behind;
+
+	*arrow = NULL;
+	if (!head || ref_symbolic(repo, "HEAD", branch, sizeof branch) != 0 ||
+			ref_upstream(repo, branch, upstream, sizeof upstream) != 0 || ref_resolve(repo, upstream, oid) != 0) {
+		return 0;
+	}
+	// only the direction is shown, so the walk can stop as soon as both sides have a commit
+	if (graph_ahead_behind(repo, head, oid, 1, &ahead, &behind) < 0) {
+		return -1;
+	}
+	*arrow = ahead && behind ? "\u2195" : ahead ? "\u2191" : behind ? "\u2193" : "";
+	return 0;
 }
 
-int isreg(const char* path) {
-	struct stat statbuf;
-	return lstat(path, &statbuf) == 0 && S_ISREG(statbuf.st_mode);
+// git status --porcelain=v2 -z: the branch headers first, then a record per changed path
+static int status_record(void* data, const char* record) {
+	status_scan* st = data;
+
+	// the path a rename or copy came from is a record of its own
+	if (st->renamed) {
+		st->renamed = 0;
+		return 0;
+	}
+	if (record[0] == '#') {
+		if (strncmp(record, "# branch.ab +", 13) == 0) {
+			char* end;
+			long ahead = strtol(record + 13, &end, 10);
+			long behind = strncmp(end, " -", 2) == 0 ? strtol(end + 2, NULL, 10) : 0;
+			st->arrow = ahead && behind ? "\u2195" : ahead ? "\u2191" : behind ? "\u2193" : "";
+			st->counted = 0;
+		}
+		return 0;
+	}
+	// without an ab header there is no upstream to count against
+	st->counted = 0;
+	switch (record[0]) {
+	case '2':
+		st->renamed = 1;
+		// fall through
+	case '1':
+		if (record[2] != '.') {
+			st->unchanged = 0;
+		}
+		if (record[3] != '.') {
+			st->clean = 0;
+		}
+		break;
+	case 'u':
+		st->unchanged = 0;
+		st->clean = 0;
+		break;
+	}
+	return st->clean != -1 && st->unchanged != -1 && st->counted != -1;
 }
 
-int islnk(const char* path) {
-	struct stat statbuf;
-	return lstat(path, &statbuf) == 0 && S_ISLNK(statbuf.st_mode);
+// what is still unknown once git status is done, had its output cut short or failed
+static void status_settle(status_scan* st, const probe* pr) {
+	int ok = pr->cut || pr->status == 0;
+
+	// what a late git status didn't get to tell stays unknown
+	if (pr->late) {
+		return;
+	}
+	// a failing git status shows as changed, the way a failing git diff did
+	if (st->clean == -1) {
+		st->clean = ok;
+	}
+	if (st->unchanged == -1) {
+		st->unchanged = ok;
+	}
+	if (st->counted == -1 && ok) {
+		st->counted = 0;
+	}
 }
 
 void title_section(const prompt_data* data) {
@@ -229,125 +566,583 @@ void venv_section() {
 	}
 }
 
-void git_section() {
-	char rpbuf[256];
-	int status = readp(rev_parse, 0, rpbuf, sizeof rpbuf);
-	if (*rpbuf != 0) {
-		char tpath[PATH_MAX], tmp1[256], tmp2[256], tmp3[256], tmp4[256];
-		char* next = rpbuf;
-		const char* git = split(&next, '\n');
-		const char* inside = split(&next, '\n');
-		const char* bare = split(&next, '\n');
-		const char* intree = split(&next, '\n');
-		const char* ssha = status == 0 ? split(&next, '\n') : NULL;
-		const char *r = NULL, *b = NULL, *w = NULL, *i = NULL, *s = NULL, *c = NULL, *p = NULL, *step = NULL, *total = NULL;
-		int detached = 0;
-
-		if (isdir(strcatv(tpath, git, "/rebase-merge", NULL))) {
-			b = readf(strcatv(tpath, git, "/rebase-merge/head-name", NULL), tmp1, sizeof tmp1);
-			step = readf(strcatv(tpath, git, "/rebase-merge/msgnum", NULL), tmp2, sizeof tmp2);
-			total = readf(strcatv(tpath, git, "/rebase-merge/end", NULL), tmp3, sizeof tmp3);
-		} else {
-			if (isdir(strcatv(tpath, git, "/rebase-apply", NULL))) {
-				step = readf(strcatv(tpath, git, "/rebase-apply/next", NULL), tmp2, sizeof tmp2);
-				total = readf(strcatv(tpath, git, "/rebase-apply/last", NULL), tmp3, sizeof tmp3);
-				if (isreg(strcatv(tpath, git, "/rebase-apply/rebasing", NULL))) {
-					b = readf(strcatv(tpath, git, "/rebase-apply/head-name", NULL), tmp1, sizeof tmp1);
-					r = "|REBASE";
-				} else if (isreg(strcatv(tpath, git, "/rebase-apply/applying", NULL))) {
-					r = "|AM";
-				} else {
-					r = "|AM/REBASE";
-				}
-			} else if (isreg(strcatv(tpath, git, "/MERGE_HEAD", NULL))) {
-				r = "|MERGING";
-			} else if (isreg(strcatv(tpath, git, "/CHERRY_PICK_HEAD", NULL))) {
-				r = "|CHERRY-PICKING";
-			} else if (isreg(strcatv(tpath, git, "/REVERT_HEAD", NULL))) {
-				r = "|REVERTING";
-			} else if (isreg(strcatv(tpath, git, "/BISECT_LOG", NULL))) {
-				r = "|BISECTING";
-			}
+// the native backend reads the index, refs and commit graph itself and only runs git for what they can't tell
+typedef struct {
+	git_repo repo;
+	char cwd[PATH_MAX];
+	char* argv[2][16];
+	unsigned char head[GIT_MAX_RAWSZ];
+	char hex[2 * GIT_MAX_RAWSZ + 1];
+	const char* ssha;
+	int untracked, waited;
+	const char* arrow;
+	status_scan st;
+	probe probes[2];
+	char sbuf[2 * PATH_MAX], ubuf[16];
+} builtin_repo;
 
-			if (!b) {
-				if (islnk(strcatv(tpath, git, "/HEAD", NULL))) {
-					// symlink symbolic ref
-					if (readp(read_head, 1, tmp1, sizeof tmp1) == 0) {
-						b = tmp1;
-					}
-				} else {
-					const char* head = readf(strcatv(tpath, git, "/HEAD", NULL), tmp1, sizeof tmp1);
-					// is it a symbolic ref?
-					if (strncmp(head, "ref: ", 5) == 0) {
-						b = head + 5;
-					} else {
-						detached = 1;
-						*tmp1 = '(';
-						if (readp(describe, 1, tmp1 + 1, sizeof tmp1 - 2) != 0) {
-							strcatv(tmp1 + 1, ssha, "...", NULL);
-						}
-						int len = strlen(tmp1);
-						*(tmp1 + len) = ')';
-						*(tmp1 + len + 1) = 0;
-						b = tmp1;
-					}
-				}
+// the command run in dir, which needn't be the directory this process is in, with one more argument when there is one
+static char* const* command(char** argv, const char* dir, char* const* cmd, char* extra) {
+	int n = 0;
+
+	argv[n++] = cmd[0];
+	argv[n++] = "-C";
+	argv[n++] = (char*)dir;
+	while (*++cmd) {
+		argv[n++] = *cmd;
+	}
+	argv[n++] = extra;
+	argv[n] = NULL;
+	return argv;
+}
+
+static void* native_discover(const char* cwd) {
+	builtin_repo* br = malloc(sizeof *br);
+	char tmp[16];
+	int clean = -1, unchanged = -1;
+
+	if (!br || strlen(cwd) >= sizeof br->cwd || repo_discover(&br->repo, cwd) != 0) {
+		free(br);
+		return NULL;
+	}
+	strcpy(br->cwd, cwd);
+	// the prompt's object reads share their packs and its config lookups one parse, no other one does
+	br->repo.odb = odb_open();
+	br->repo.config = config_open();
+	br->ssha = short_head(&br->repo, br->head, br->hex);
+	br->untracked = 0;
+	br->waited = 0;
+	br->arrow = NULL;
+
+	br->st.clean = -1;
+	br->st.unchanged = -1;
+	br->st.counted = -1;
+	br->st.arrow = NULL;
+	br->st.renamed = 0;
+	startp(&br->probes[0], NULL, 0, br->sbuf, sizeof br->sbuf);
+	startp(&br->probes[1], NULL, 0, br->ubuf, sizeof br->ubuf);
+
+	// the work tree probes are independent, let them run while the rest is worked out
+	if (br->repo.intree) {
+		const git_repo* repo = &br->repo;
+		const unsigned char* head = br->ssha ? br->head : NULL;
+		git_index* idx = acquire_index(repo);
+		// the index usually settles both without running git
+		if (idx) {
+			uint64_t* check = index_fsmonitor(idx, repo);
+			unsigned long generation = 0;
+			// without a hook the daemon watches the work tree itself
+			if (!check && watching) {
+				check = watch_check(idx, repo, &generation);
+			}
+			clean = index_clean(idx, repo->worktree, check);
+			if (generation) {
+				watch_settle(generation, idx, clean);
 			}
+			free(check);
+			unchanged = index_unchanged(repo, idx, head);
 		}
+		// one git status tells whatever is left and is stopped once it has, it runs while the work tree is walked
+		br->st.clean = clean;
+		br->st.unchanged = unchanged;
+		br->st.counted = upstream_status(repo, head, &br->arrow);
+		if (clean == -1 || unchanged == -1 || br->st.counted == -1) {
+			startp(&br->probes[0], command(br->argv[0], cwd, status, br->st.counted == -1 ? "--branch" : NULL), 0,
+				br->sbuf, sizeof br->sbuf);
+			br->probes[0].parse = status_record;
+			br->probes[0].data = &br->st;
+		}
+		// untracked files are only shown when asked for, as with git-prompt.sh; the untracked cache answers where it can
+		if (config_bool(repo_config(repo, "bash.showUntrackedFiles", tmp, sizeof tmp), 0)) {
+			// without the cache, or where it can't tell, the work tree is walked until the first one
+			br->untracked = idx ? index_untracked(idx, repo) : -1;
+			if (idx && br->untracked == -1) {
+				br->untracked = worktree_untracked(idx, repo);
+			}
+		}
+		if (idx) {
+			release_index(idx);
+		}
+		if (br->untracked == -1) {
+			startp(&br->probes[1], command(br->argv[1], cwd, others, NULL), 0, br->ubuf, sizeof br->ubuf);
+		}
+	}
+	return br;
+}
+
+static builtin_repo* builtin_wait(void* data) {
+	builtin_repo* br = data;
 
-		if (b && strncmp(b, "refs/heads/", 11) == 0) {
-			b += 11;
+	if (!br->waited) {
+		waitp(br->probes, 2);
+		status_settle(&br->st, &br->probes[0]);
+		br->waited = 1;
+	}
+	return br;
+}
+
+static int builtin_location(void* data) {
+	const git_repo* repo = &((builtin_repo*)data)->repo;
+	return repo->inside ? (repo->bare ? REPO_BARE : REPO_GITDIR) : repo->intree ? REPO_WORKTREE : REPO_OTHER;
+}
+
+static const char* builtin_head(void* data, char* buf, size_t size, int* detached) {
+	builtin_repo* br = data;
+	char tpath[PATH_MAX];
+	int len;
+
+	*detached = 0;
+	// is it a symbolic ref? symlinks and reftable included
+	if (ref_symbolic(&br->repo, "HEAD", buf, size) == 0) {
+		return buf;
+	}
+	// nor a commit, as when the refs can't be read
+	if (!br->ssha || islnk(strcatv(tpath, br->repo.gitdir, "/HEAD", NULL)) || size < 2 * GIT_MAX_RAWSZ + 6) {
+		return NULL;
+	}
+	*detached = 1;
+	*buf = '(';
+	// a ref pointing right at it names it, walking the history for one could take the whole deadline
+	if (ref_name_commit(&br->repo, br->head, buf + 1, size - 2) != 0) {
+		strcatv(buf + 1, br->ssha, "...", NULL);
+	}
+	len = strlen(buf);
+	buf[len] = ')';
+	buf[len + 1] = 0;
+	return buf;
+}
+
+static const char* builtin_operation(void* data, char* buf, size_t size, char* branch, size_t bsize) {
+	repo_operation(((builtin_repo*)data)->repo.gitdir, buf, size, branch, bsize);
+	return buf;
+}
+
+static const char* builtin_dirty(void* data) {
+	builtin_repo* br = builtin_wait(data);
+	return br->st.clean == 0 ? "*" : br->st.clean == -1 ? unknown : NULL;
+}
+
+static const char* builtin_staged(void* data) {
+	builtin_repo* br = builtin_wait(data);
+	return br->st.unchanged == 0 ? "+" : br->st.unchanged == -1 ? unknown : !br->ssha ? "#" : NULL;
+}
+
+static const char* builtin_stash(void* data) {
+	unsigned char oid[GIT_MAX_RAWSZ];
+	return ref_resolve(&((builtin_repo*)data)->repo, "refs/stash", oid) == 0 ? "$" : NULL;
+}
+
+static const char* builtin_untracked(void* data) {
+	builtin_repo* br = builtin_wait(data);
+	if (br->untracked == -1 && br->probes[1].late) {
+		return unknown;
+	}
+	return br->untracked == 1 || (br->untracked == -1 && br->probes[1].status == 0) ? "%" : NULL;
+}
+
+static const char* builtin_upstream(void* data) {
+	builtin_repo* br = builtin_wait(data);
+	return br->arrow ? br->arrow : br->st.counted == -1 ? unknown : br->st.arrow;
+}
+
+static void builtin_close(void* data) {
+	builtin_repo* br = builtin_wait(data);
+
+	odb_close(br->repo.odb);
+	config_close(br->repo.config);
+	free(br);
+}
+
+static const git_backend native_backend = {
+	"native", native_discover, builtin_location, builtin_head, builtin_operation,
+	builtin_dirty, builtin_staged, builtin_stash, builtin_untracked, builtin_upstream, builtin_close,
+};
+
+// the cli backend asks git for all of it, the way the prompt did before it read repositories itself
+typedef struct {
+	char cwd[PATH_MAX];
+	char rpbuf[2 * PATH_MAX];
+	const char* gitdir;
+	const char* ssha;
+	int location, untracked, waited;
+	char* argv[3][16];
+	status_scan st;
+	probe probes[3];
+	char sbuf[2 * PATH_MAX], ubuf[16], stbuf[2 * GIT_MAX_RAWSZ + 2];
+} cli_repo;
+
+static void* cli_discover(const char* cwd) {
+	cli_repo* cr = malloc(sizeof *cr);
+	const char *inside, *bare, *intree;
+	char* argv[16];
+	char* next;
+	int found;
+
+	if (!cr || strlen(cwd) >= sizeof cr->cwd) {
+		free(cr);
+		return NULL;
+	}
+	// the lines before HEAD are there for an unborn one too, it is only the last that fails
+	found = readp(command(argv, cwd, rev_parse, NULL), 0, cr->rpbuf, sizeof cr->rpbuf);
+	next = cr->rpbuf;
+	cr->gitdir = strsep(&next, "\n");
+	inside = next ? strsep(&next, "\n") : NULL;
+	bare = next ? strsep(&next, "\n") : NULL;
+	intree = next ? strsep(&next, "\n") : NULL;
+	if (!*cr->gitdir || !intree) {
+		free(cr);
+		return NULL;
+	}
+	cr->ssha = found == 0 && next ? strsep(&next, "\n") : NULL;
+	cr->location = strcmp(inside, "true") == 0 ? (strcmp(bare, "true") == 0 ? REPO_BARE : REPO_GITDIR) :
+		strcmp(intree, "true") == 0 ? REPO_WORKTREE : REPO_OTHER;
+	strcpy(cr->cwd, cwd);
+	cr->untracked = 0;
+	cr->waited = 0;
+
+	cr->st.clean = -1;
+	cr->st.unchanged = -1;
+	cr->st.counted = -1;
+	cr->st.arrow = NULL;
+	cr->st.renamed = 0;
+	startp(&cr->probes[0], NULL, 0, cr->sbuf, sizeof cr->sbuf);
+	startp(&cr->probes[1], NULL, 0, cr->ubuf, sizeof cr->ubuf);
+	startp(&cr->probes[2], NULL, 0, cr->stbuf, sizeof cr->stbuf);
+	if (cr->location == REPO_WORKTREE) {
+		startp(&cr->probes[0], command(cr->argv[0], cwd, status, "--branch"), 0, cr->sbuf, sizeof cr->sbuf);
+		cr->probes[0].parse = status_record;
+		cr->probes[0].data = &cr->st;
+		startp(&cr->probes[2], command(cr->argv[2], cwd, check_stash, NULL), 1, cr->stbuf, sizeof cr->stbuf);
+		if (readp(command(argv, cwd, show_untracked, NULL), 1, cr->ubuf, sizeof cr->ubuf) == 0 &&
+				strcmp(cr->ubuf, "true") == 0) {
+			cr->untracked = -1;
+			startp(&cr->probes[1], command(cr->argv[1], cwd, others, NULL), 0, cr->ubuf, sizeof cr->ubuf);
 		}
+	}
+	return cr;
+}
+
+static cli_repo* cli_wait(void* data) {
+	cli_repo* cr = data;
+
+	if (!cr->waited) {
+		waitp(cr->probes, 3);
+		status_settle(&cr->st, &cr->probes[0]);
+		cr->waited = 1;
+	}
+	return cr;
+}
 
-		if (step && total) {
-			r = strcatv(tmp4, r, " ", step, "/", total, NULL);
+static int cli_location(void* data) {
+	return ((cli_repo*)data)->location;
+}
+
+static const char* cli_head(void* data, char* buf, size_t size, int* detached) {
+	cli_repo* cr = data;
+	char* argv[8];
+	int len;
+
+	*detached = 0;
+	if (readp(command(argv, cr->cwd, symbolic_ref, NULL), 1, buf, size) == 0) {
+		return buf;
+	}
+	if (!cr->ssha || size < 2 * GIT_MAX_RAWSZ + 6) {
+		return NULL;
+	}
+	*detached = 1;
+	*buf = '(';
+	if (readp(command(argv, cr->cwd, describe, NULL), 1, buf + 1, size - 2) != 0 || !buf[1]) {
+		strcatv(buf + 1, cr->ssha, "...", NULL);
+	}
+	len = strlen(buf);
+	buf[len] = ')';
+	buf[len + 1] = 0;
+	return buf;
+}
+
+static const char* cli_operation(void* data, char* buf, size_t size, char* branch, size_t bsize) {
+	repo_operation(((cli_repo*)data)->gitdir, buf, size, branch, bsize);
+	return buf;
+}
+
+static const char* cli_dirty(void* data) {
+	cli_repo* cr = cli_wait(data);
+	return cr->st.clean == 0 ? "*" : cr->st.clean == -1 ? unknown : NULL;
+}
+
+static const char* cli_staged(void* data) {
+	cli_repo* cr = cli_wait(data);
+	return cr->st.unchanged == 0 ? "+" : cr->st.unchanged == -1 ? unknown : !cr->ssha ? "#" : NULL;
+}
+
+static const char* cli_stash(void* data) {
+	cli_repo* cr = cli_wait(data);
+	return cr->probes[2].late ? unknown : cr->probes[2].status == 0 ? "$" : NULL;
+}
+
+static const char* cli_untracked(void* data) {
+	cli_repo* cr = cli_wait(data);
+	if (cr->untracked == -1 && cr->probes[1].late) {
+		return unknown;
+	}
+	return cr->untracked == -1 && cr->probes[1].status == 0 ? "%" : NULL;
+}
+
+static const char* cli_upstream(void* data) {
+	cli_repo* cr = cli_wait(data);
+	return cr->st.counted == -1 ? unknown : cr->st.arrow;
+}
+
+static void cli_close(void* data) {
+	free(cli_wait(data));
+}
+
+static const git_backend cli_backend = {
+	"cli", cli_discover, cli_location, cli_head, cli_operation,
+	cli_dirty, cli_staged, cli_stash, cli_untracked, cli_upstream, cli_close,
+};
+
+static const git_backend* backends[] = {
+	&native_backend,
+	&cli_backend,
+#ifdef HAVE_LIBGIT2
+	&libgit2_backend,
+#endif
+};
+
+#define BACKENDS (sizeof backends / sizeof *backends)
+
+// PROMPT_BACKEND picks one by name, the native one is the default
+static int backend() {
+	const char* name = getenv("PROMPT_BACKEND");
+	int n;
+
+	for (n = 0; name && n < BACKENDS; ++n) {
+		if (strcmp(backends[n]->name, name) == 0) {
+			return n;
 		}
+	}
+	return 0;
+}
 
-		if (strcmp(inside, "true") == 0) {
-			if (strcmp(bare, "true") == 0) {
-				c = "BARE:";
-			} else {
-				b = "GIT_DIR!";
-			}
-		} else if (strcmp(intree, "true") == 0) {
-			char tmp[256];
-			if (readp(diff, 0, tmp, sizeof tmp) != 0) {
-				w = "*";
-			}
-			if (readp(diff_cached, 0, tmp, sizeof tmp) != 0) {
-				i = "+";
-			} else if (!ssha) {
-				i = "#";
-			}
-			if (readp(check_stash, 0, tmp, sizeof tmp) == 0) {
-				s = "$";
-			}
-			if (readp(upstream, 1, tmp, sizeof tmp) == 0) {
-				if (strcmp(tmp, "0\t0") == 0) {
-					p = "";
-				} else {
-					next = tmp;
-					const char* rmt = split(&next, '\t');
-					const char* loc = split(&next, '\t');
-					p = strcmp(rmt, "0") == 0 ? "\u2191" :
-						strcmp(loc, "0") == 0 ? "\u2193" :
-						"\u2195";
-				}
+// copies what a backend said, NULL being nothing
+static void keep(char* dst, size_t size, const char* src) {
+	snprintf(dst, size, "%s", src ? src : "");
+}
+
+// what the git section shows for the repository cwd is in, -1 when it is in none
+static int git_state_compute(const git_backend* be, const char* cwd, git_state* gs) {
+	char branch[256], op[256];
+	const char* b;
+	void* repo;
+
+	memset(gs, 0, sizeof *gs);
+	if (!(repo = be->discover(cwd))) {
+		return -1;
+	}
+	keep(gs->r, sizeof gs->r, be->operation(repo, op, sizeof op, branch, sizeof branch));
+	// a rebase knows the branch it is on, HEAD doesn't
+	b = *branch ? branch : be->head(repo, branch, sizeof branch, &gs->detached);
+	if (b && strncmp(b, "refs/heads/", 11) == 0) {
+		b += 11;
+	}
+	keep(gs->b, sizeof gs->b, b);
+
+	gs->location = be->location(repo);
+	if (gs->location == REPO_BARE) {
+		keep(gs->c, sizeof gs->c, "BARE:");
+	} else if (gs->location == REPO_GITDIR) {
+		keep(gs->b, sizeof gs->b, "GIT_DIR!");
+	} else if (gs->location == REPO_WORKTREE) {
+		keep(gs->w, sizeof gs->w, be->dirty(repo));
+		keep(gs->i, sizeof gs->i, be->staged(repo));
+		keep(gs->s, sizeof gs->s, be->stash(repo));
+		keep(gs->u, sizeof gs->u, be->untracked(repo));
+		keep(gs->p, sizeof gs->p, be->upstream(repo));
+	}
+	be->close(repo);
+	return 0;
+}
+
+// a state from the cache is marked, it is from some earlier prompt
+static void git_state_render(const git_state* gs, int stale) {
+	int dirty = gs->detached || *gs->w || *gs->i || *gs->s || *gs->u;
+
+	section(dirty ? "15" : "0", dirty ? "125" : "148");
+	append(gs->c, gs->b, NULL);
+	if (*gs->w || *gs->i || *gs->s || *gs->u) {
+		append(" ", gs->w, gs->i, gs->s, gs->u, NULL);
+	}
+	append(gs->r, gs->p, NULL);
+	if (stale) {
+		append("\u00b7", NULL);
+	}
+}
+
+// the daemon has none of this shell's environment, so where one of these is set it is worked out here
+static const char* const locations[] = {"GIT_DIR=", "GIT_WORK_TREE=", "GIT_INDEX_FILE=", "GIT_COMMON_DIR=",
+	"GIT_OBJECT_DIRECTORY=", "GIT_ALTERNATE_OBJECT_DIRECTORIES=", "GIT_CEILING_DIRECTORIES=",
+	"GIT_DISCOVERY_ACROSS_FILESYSTEM=", "GIT_NAMESPACE=", "GIT_CONFIG"};
+
+static int git_environment() {
+	char** env;
+	int n;
+
+	for (env = environ; *env; ++env) {
+		for (n = 0; strncmp(*env, "GIT_", 4) == 0 && n < sizeof locations / sizeof *locations; ++n) {
+			if (strncmp(*env, locations[n], strlen(locations[n])) == 0) {
+				return 1;
 			}
 		}
+	}
+	return 0;
+}
+
+// from the daemon where one runs, worked out here where none does or it doesn't answer in time
+static int git_state_get(int be, const char* cwd, git_state* gs) {
+	daemon_request req;
+	int left = deadline_left();
+
+	if (left != 0 && !git_environment() && strlen(cwd) < sizeof req.cwd) {
+		memset(&req, 0, DAEMON_HEADER);
+		req.magic = DAEMON_MAGIC;
+		req.deadline = left < 0 ? 0 : left > UINT16_MAX ? UINT16_MAX : left;
+		req.backend = be;
+		strcpy(req.cwd, cwd);
+		if (daemon_ask(&req, gs) == 0) {
+			return gs->location == -1 ? -1 : 0;
+		}
+	}
+	return git_state_compute(backends[be], cwd, gs);
+}
+
+// the daemon's side, under the deadline the prompt asking has left
+static void daemon_compute(const daemon_request* req, git_state* gs) {
+	deadline_set(req->deadline);
+	if (req->backend >= BACKENDS || git_state_compute(backends[req->backend], req->cwd, gs) != 0) {
+		memset(gs, 0, sizeof *gs);
+		gs->location = -1;
+	}
+}
+
+// one file per work tree, named for its git dir and work tree, where it doesn't cost a trip to a network home
+static int cache_path(const git_repo* repo, char* path) {
+	const char* runtime = getenv("XDG_RUNTIME_DIR");
+	const char* cache = getenv("XDG_CACHE_HOME");
+	const char* home = getenv("HOME");
+	unsigned char oid[20];
+	char hex[41], dir[PATH_MAX];
+	git_hash ctx;
+
+	if (runtime && *runtime && strlen(runtime) < PATH_MAX - 64) {
+		strcatv(dir, runtime, "/prompt", NULL);
+	} else if (cache && *cache && strlen(cache) < PATH_MAX - 64) {
+		strcatv(dir, cache, "/prompt", NULL);
+	} else if (home && strlen(home) < PATH_MAX - 64) {
+		strcatv(dir, home, "/.cache/prompt", NULL);
+	} else {
+		return -1;
+	}
+	if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+		return -1;
+	}
+	hash_init(&ctx, 20);
+	hash_update(&ctx, repo->gitdir, strlen(repo->gitdir) + 1);
+	hash_update(&ctx, repo->worktree, strlen(repo->worktree));
+	hash_final(&ctx, oid);
+	strcatv(path, dir, "/", oid2hex(oid, 20, hex), NULL);
+	return 0;
+}
+
+static int cache_read(const char* path, git_state* gs) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	int n = -1;
+
+	if (fd != -1) {
+		n = read(fd, gs, sizeof *gs);
+		close(fd);
+	}
+	// a state from another build of the prompt doesn't have the same size, or the same magic
+	return n == sizeof *gs && gs->magic == GIT_STATE_MAGIC ? 0 : -1;
+}
+
+// written aside and renamed into place, a prompt reading it sees the old state or the new one
+static void cache_write(const char* path, git_state* gs) {
+	char tmp[PATH_MAX + 16];
+	int fd;
+
+	gs->magic = GIT_STATE_MAGIC;
+	snprintf(tmp, sizeof tmp, "%s.%d", path, (int)getpid());
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) == -1) {
+		return;
+	}
+	if (write(fd, gs, sizeof *gs) != sizeof *gs || close(fd) != 0 || rename(tmp, path) != 0) {
+		unlink(tmp);
+	}
+}
+
+// works the state out again in a detached process, for the next prompt; one at a time per work tree
+static void cache_refresh(int be, const char* cwd, const char* path) {
+	char lock[PATH_MAX + 8];
+	git_state gs;
+	pid_t pid;
+	int fd;
+
+	if ((pid = fork()) != 0) {
+		if (pid > 0) {
+			waitpid(pid, NULL, 0);
+		}
+		return;
+	}
+	// the second fork leaves it to init, the new session out of reach of the terminal's signals
+	setsid();
+	if (fork() != 0) {
+		_exit(0);
+	}
+	// the shell reads the prompt until every copy of its stdout is closed
+	fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+	dup2(fd, 0);
+	dup2(fd, 1);
+	dup2(fd, 2);
+	strcatv(lock, path, ".lock", NULL);
+	if ((fd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1 || flock(fd, LOCK_EX | LOCK_NB) != 0) {
+		_exit(0);
+	}
+	// nobody waits for it, but a git stuck on a network file system isn't waited for forever either
+	deadline_set(PROMPT_REFRESH_MS);
+	if (git_state_get(be, cwd, &gs) == 0 && gs.location == REPO_WORKTREE) {
+		cache_write(path, &gs);
+	}
+	_exit(0);
+}
+
+void git_section() {
+	int be = backend();
+	char cwd[PATH_MAX], path[PATH_MAX];
+	git_state gs;
+	git_repo repo;
 
-		int dirty = detached || w || i || s;
-		section(dirty ? "15" : "0", dirty ? "125" : "148");
-		if (c) append(c, NULL);
-		if (b) append(b, NULL);
-		if (w || i || s) {
-			append(" ", NULL);
-			if (w) append(w, NULL);
-			if (i) append(i, NULL);
-			if (s) append(s, NULL);
+	if (!getcwd(cwd, sizeof cwd)) {
+		return;
+	}
+	// with PROMPT_STALE the last state shows at once and is brought up to date behind the prompt
+	if (config_bool(getenv("PROMPT_STALE"), 0) && repo_discover(&repo, cwd) == 0 && repo.intree &&
+			cache_path(&repo, path) == 0) {
+		if (cache_read(path, &gs) == 0) {
+			git_state_render(&gs, 1);
+			cache_refresh(be, cwd, path);
+			return;
+		}
+		if (git_state_get(be, cwd, &gs) == 0) {
+			if (gs.location == REPO_WORKTREE) {
+				cache_write(path, &gs);
+			}
+			git_state_render(&gs, 0);
 		}
-		if (r) append(r, NULL);
-		if (p) append(p, NULL);
+		return;
+	}
+	if (git_state_get(be, cwd, &gs) == 0) {
+		git_state_render(&gs, 0);
 	}
 }
 
@@ -357,6 +1152,21 @@ void final_section() {
 
 int main(int argc, char** argv, char** envp) {
 	prompt_data data;
+	const char* deadline = getenv("PROMPT_DEADLINE_MS");
+
+	// the daemon keeps what it has read between prompts and answers for every shell of this user
+	if (argc == 2 && strcmp(argv[1], "--daemon") == 0) {
+		keeping = 1;
+		watching = config_bool(getenv("PROMPT_WATCH"), 1);
+		// out of the way of file systems being unmounted
+		if (chdir("/") != 0) {
+			return 1;
+		}
+		return daemon_serve(daemon_compute) == 0 ? 0 : 1;
+	}
+
+	// git gets what is left of the budget, markers it can't tell in time show as unknown
+	deadline_set(deadline ? atol(deadline) : 1000);
 
 	struct utsname name;
 	uname(&name);
@@ -0,0 +1,593 @@
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+#include "git.h"
+
+static const char hexdigits[] = "0123456789abcdef";
+
+static int hexval(char c) {
+	return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+}
+
+int hex2oid(const char* hex, unsigned char* oid, int rawsz) {
+	int n;
+	for (n = 0; n < rawsz; ++n) {
+		int hi = hexval(hex[2 * n]), lo = hi < 0 ? -1 : hexval(hex[2 * n + 1]);
+		if (lo < 0) {
+			return -1;
+		}
+		oid[n] = hi << 4 | lo;
+	}
+	return 0;
+}
+
+char* oid2hex(const unsigned char* oid, int rawsz, char* hex) {
+	int n;
+	for (n = 0; n < rawsz; ++n) {
+		hex[2 * n] = hexdigits[oid[n] >> 4];
+		hex[2 * n + 1] = hexdigits[oid[n] & 15];
+	}
+	hex[2 * rawsz] = 0;
+	return hex;
+}
+
+static int readref(const char* path, char* buf, size_t size) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	int n = 0, r;
+
+	if (fd == -1) {
+		return -1;
+	}
+	while (n < size - 1 && (r = read(fd, buf + n, size - 1 - n)) > 0) {
+		n += r;
+	}
+	close(fd);
+	// a directory where the ref would be, the ref can still be packed
+	if (r < 0) {
+		return -1;
+	}
+	while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == '\r' || buf[n - 1] == ' ')) {
+		--n;
+	}
+	buf[n] = 0;
+	return n;
+}
+
+int packed_open(packed_refs* packed, const git_repo* repo) {
+	char path[PATH_MAX];
+	struct stat st;
+	int fd;
+
+	memset(packed, 0, sizeof *packed);
+	packed->rawsz = repo->rawsz;
+	if (strlen(repo->commondir) + 13 > sizeof path) {
+		return -1;
+	}
+	strcpy(path, repo->commondir);
+	strcat(path, "/packed-refs");
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		return -1;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size == 0 ||
+			(packed->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		packed->map = NULL;
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	packed->size = st.st_size;
+	packed->records = packed->map;
+	// "# pack-refs with: peeled fully-peeled sorted "
+	if (st.st_size > 18 && strncmp(packed->map, "# pack-refs with:", 17) == 0) {
+		const char* eol = memchr(packed->map, '\n', st.st_size);
+		const char* trait;
+		if (!eol) {
+			eol = packed->map + st.st_size;
+		}
+		for (trait = packed->map + 17; trait < eol; ) {
+			const char* sp = memchr(trait, ' ', eol - trait);
+			int len = (sp ? sp : eol) - trait;
+			if (len == 6 && strncmp(trait, "sorted", 6) == 0) {
+				packed->sorted = 1;
+			} else if (len == 12 && strncmp(trait, "fully-peeled", 12) == 0) {
+				packed->peeled = 1;
+			}
+			trait += len + 1;
+		}
+		packed->records = eol < packed->map + st.st_size ? eol + 1 : eol;
+	}
+	return 0;
+}
+
+void packed_close(packed_refs* packed) {
+	if (packed->map) {
+		munmap(packed->map, packed->size);
+	}
+	packed->map = NULL;
+}
+
+static const char* next_line(const char* p, const char* end) {
+	const char* eol = memchr(p, '\n', end - p);
+	return eol ? eol + 1 : end;
+}
+
+// decodes the record at p, returns the start of the next one
+const char* packed_record(const packed_refs* packed, const char* p, packed_ref* ref) {
+	const char* end = packed->map + packed->size;
+	const char* eol = memchr(p, '\n', end - p);
+	int hexsz = 2 * packed->rawsz;
+
+	if (!eol) {
+		eol = end;
+	}
+	ref->name = NULL;
+	ref->peeled = NULL;
+	if (eol - p > hexsz + 1 && p[hexsz] == ' ') {
+		ref->oid = p;
+		ref->name = p + hexsz + 1;
+		ref->namelen = eol - ref->name;
+	}
+	p = eol < end ? eol + 1 : end;
+	if (p + hexsz < end && *p == '^') {
+		ref->peeled = p + 1;
+		p = next_line(p, end);
+	}
+	return p;
+}
+
+static int namecmp(const packed_ref* ref, const char* name, int namelen) {
+	int len = ref->namelen < namelen ? ref->namelen : namelen;
+	int cmp = memcmp(ref->name, name, len);
+	return cmp ? cmp : ref->namelen - namelen;
+}
+
+int packed_find(const packed_refs* packed, const char* name, unsigned char* oid, unsigned char* peeled) {
+	const char* end = packed->map + packed->size;
+	const char *p = packed->records, *found = NULL;
+	int namelen = strlen(name);
+	packed_ref ref;
+
+	if (!packed->map) {
+		return -1;
+	}
+	if (packed->sorted) {
+		// bisect on bytes, then back up to the start of the record
+		const char *lo = packed->records, *hi = end;
+		while (lo < hi && !found) {
+			const char* mid = lo + (hi - lo) / 2;
+			const char* rec = mid;
+			int cmp;
+			while (rec > lo && rec[-1] != '\n') {
+				--rec;
+			}
+			if (*rec == '^' && rec > lo) {
+				for (--rec; rec > lo && rec[-1] != '\n'; --rec);
+			}
+			p = packed_record(packed, rec, &ref);
+			if (!ref.name) {
+				return -1;
+			}
+			cmp = namecmp(&ref, name, namelen);
+			if (cmp == 0) {
+				found = rec;
+			} else if (cmp < 0) {
+				lo = p;
+			} else {
+				hi = rec;
+			}
+		}
+	} else {
+		while (p < end && !found) {
+			const char* rec = p;
+			p = packed_record(packed, rec, &ref);
+			if (ref.name && namecmp(&ref, name, namelen) == 0) {
+				found = rec;
+			}
+		}
+	}
+
+	if (!found || hex2oid(ref.oid, oid, packed->rawsz) != 0) {
+		return -1;
+	}
+	if (peeled && (!ref.peeled || hex2oid(ref.peeled, peeled, packed->rawsz) != 0)) {
+		// fully peeled files say so for every record that peels to itself
+		if (!packed->peeled || ref.peeled) {
+			return 1;
+		}
+		memcpy(peeled, oid, packed->rawsz);
+	}
+	return 0;
+}
+
+// HEAD, pseudo refs and a few namespaces live in the work tree's own git dir
+static const char* ref_dir(const git_repo* repo, const char* name) {
+	return strncmp(name, "refs/", 5) != 0 ||
+		strncmp(name, "refs/bisect/", 12) == 0 ||
+		strncmp(name, "refs/worktree/", 14) == 0 ||
+		strncmp(name, "refs/rewritten/", 15) == 0 ?
+		repo->gitdir : repo->commondir;
+}
+
+static int ref_path(const git_repo* repo, const char* name, char* path) {
+	const char* dir = ref_dir(repo, name);
+	if (strlen(dir) + strlen(name) + 2 > PATH_MAX) {
+		return -1;
+	}
+	strcpy(path, dir);
+	strcat(path, "/");
+	strcat(path, name);
+	return 0;
+}
+
+// per work tree refs of linked work trees have a stack of their own
+static int reftable_dir(const git_repo* repo, const char* name, char* path) {
+	const char* dir = ref_dir(repo, name);
+	if (strlen(dir) + 10 > PATH_MAX) {
+		return -1;
+	}
+	strcpy(path, dir);
+	strcat(path, "/reftable");
+	return 0;
+}
+
+int ref_symbolic(const git_repo* repo, const char* name, char* target, size_t size) {
+	char path[PATH_MAX], buf[PATH_MAX];
+	unsigned char oid[GIT_MAX_RAWSZ];
+	ssize_t n;
+
+	if (repo->reftable) {
+		return reftable_dir(repo, name, path) == 0 &&
+			reftable_lookup(path, name, repo->rawsz, oid, target, size) == 1 ? 0 : -1;
+	}
+
+	if (ref_path(repo, name, path) != 0) {
+		return -1;
+	}
+	// symlinked symbolic refs predate "ref: " files
+	if ((n = readlink(path, buf, sizeof buf - 1)) > 0) {
+		buf[n] = 0;
+		if (strncmp(buf, "refs/", 5) != 0 || n >= size) {
+			return -1;
+		}
+		strcpy(target, buf);
+		return 0;
+	}
+	if (readref(path, buf, sizeof buf) < 5 || strncmp(buf, "ref: ", 5) != 0 || strlen(buf + 5) >= size) {
+		return -1;
+	}
+	strcpy(target, buf + 5);
+	return 0;
+}
+
+int ref_resolve(const git_repo* repo, const char* name, unsigned char* oid) {
+	char path[PATH_MAX], buf[PATH_MAX], ref[PATH_MAX];
+	int depth;
+
+	strcpy(ref, name);
+	for (depth = 0; depth < 5; ++depth) {
+		int n;
+		if (repo->reftable) {
+			if (reftable_dir(repo, ref, path) != 0 ||
+					(n = reftable_lookup(path, ref, repo->rawsz, oid, buf, sizeof buf)) < 0) {
+				return -1;
+			}
+			if (n == 0) {
+				return 0;
+			}
+			strcpy(ref, buf);
+			continue;
+		}
+		if (ref_path(repo, ref, path) != 0) {
+			return -1;
+		}
+		if ((n = readref(path, buf, sizeof buf)) < 0) {
+			packed_refs packed;
+			int found = -1;
+			if (packed_open(&packed, repo) == 0) {
+				found = packed_find(&packed, ref, oid, NULL);
+				packed_close(&packed);
+			}
+			return found;
+		}
+		if (strncmp(buf, "ref: ", 5) != 0) {
+			return n == 2 * repo->rawsz ? hex2oid(buf, oid, repo->rawsz) : -1;
+		}
+		strcpy(ref, buf + 5);
+	}
+	return -1;
+}
+
+typedef struct {
+	const char* branch;
+	char remote[256];
+	char merge[PATH_MAX];
+	char* upstream;
+	size_t size;
+	int found;
+} upstream_config;
+
+static int branch_config(const char* key, const char* value, void* data) {
+	upstream_config* up = data;
+	int len = strlen(up->branch);
+
+	if (!value || strncmp(key, "branch.", 7) != 0 || strncmp(key + 7, up->branch, len) != 0 || key[7 + len] != '.') {
+		return 0;
+	}
+	key += 8 + len;
+	if (strcmp(key, "remote") == 0 && strlen(value) < sizeof up->remote) {
+		strcpy(up->remote, value);
+	} else if (strcmp(key, "merge") == 0 && strlen(value) < sizeof up->merge) {
+		strcpy(up->merge, value);
+	}
+	return 0;
+}
+
+// the first fetch refspec of the remote that maps the merge ref names its tracking ref
+static int remote_config(const char* key, const char* value, void* data) {
+	upstream_config* up = data;
+	const char *src, *dst, *star;
+	int len = strlen(up->remote), srclen, prefix, suffix, mlen;
+
+	if (!value || strncmp(key, "remote.", 7) != 0 || strncmp(key + 7, up->remote, len) != 0 ||
+			strcmp(key + 7 + len, ".fetch") != 0 || *value == '^') {
+		return 0;
+	}
+	src = *value == '+' ? value + 1 : value;
+	if (!(dst = strchr(src, ':')) || !*++dst) {
+		return 0;
+	}
+	srclen = dst - 1 - src;
+	mlen = strlen(up->merge);
+	if (!(star = memchr(src, '*', srclen))) {
+		if (srclen != mlen || strncmp(src, up->merge, mlen) != 0 || strlen(dst) >= up->size) {
+			return 0;
+		}
+		strcpy(up->upstream, dst);
+		up->found = 1;
+		return 1;
+	}
+	prefix = star - src;
+	suffix = srclen - prefix - 1;
+	if (mlen < prefix + suffix || strncmp(up->merge, src, prefix) != 0 ||
+			strncmp(up->merge + mlen - suffix, star + 1, suffix) != 0 || !(star = strchr(dst, '*')) ||
+			strlen(dst) + mlen - prefix - suffix >= up->size) {
+		return 0;
+	}
+	memcpy(up->upstream, dst, star - dst);
+	memcpy(up->upstream + (star - dst), up->merge + prefix, mlen - prefix - suffix);
+	strcpy(up->upstream + (star - dst) + (mlen - prefix - suffix), star + 1);
+	up->found = 1;
+	return 1;
+}
+
+// what @{upstream} names for a branch, -1 when it has none
+int ref_upstream(const git_repo* repo, const char* branch, char* upstream, size_t size) {
+	upstream_config up;
+
+	if (strncmp(branch, "refs/heads/", 11) != 0) {
+		return -1;
+	}
+	memset(&up, 0, sizeof up);
+	up.branch = branch + 11;
+	up.upstream = upstream;
+	up.size = size;
+	repo_config_each(repo, branch_config, &up);
+	if (!*up.remote || !*up.merge) {
+		return -1;
+	}
+	// a local upstream is the merge ref itself
+	if (strcmp(up.remote, ".") == 0) {
+		if (strlen(up.merge) >= size) {
+			return -1;
+		}
+		strcpy(upstream, up.merge);
+		return 0;
+	}
+	repo_config_each(repo, remote_config, &up);
+	return up.found ? 0 : -1;
+}
+
+#define PEEL_BUDGET 256
+
+typedef struct {
+	const git_repo* repo;
+	const unsigned char* oid;
+	char best[PATH_MAX];
+	int kind;
+	int count;
+	int peels;
+} ref_names;
+
+// the order git describe --contains --all prefers them in when they name the same commit
+enum { KIND_TAG, KIND_HEAD, KIND_REMOTE };
+
+static int ref_kind(const char* name) {
+	return strncmp(name, "refs/tags/", 10) == 0 ? KIND_TAG :
+		strncmp(name, "refs/heads/", 11) == 0 ? KIND_HEAD :
+		strncmp(name, "refs/remotes/", 13) == 0 ? KIND_REMOTE :
+		-1;
+}
+
+// follows annotated tags down to what they point at, within the budget
+static int peel(ref_names* names, const unsigned char* oid, unsigned char* peeled) {
+	const int rawsz = names->repo->rawsz;
+	int depth;
+
+	memcpy(peeled, oid, rawsz);
+	for (depth = 0; depth < 8; ++depth) {
+		size_t size;
+		int type;
+		char* buf;
+
+		if (++names->peels > PEEL_BUDGET || !(buf = odb_read(names->repo, peeled, &type, &size))) {
+			return -1;
+		}
+		if (type != OBJ_TAG) {
+			free(buf);
+			return depth > 0;
+		}
+		if (size < 7 + 2 * rawsz || strncmp(buf, "object ", 7) != 0 || hex2oid(buf + 7, peeled, rawsz) != 0) {
+			free(buf);
+			return -1;
+		}
+		free(buf);
+	}
+	return -1;
+}
+
+// keeps the name if the ref points at the commit and git would prefer it to the one kept so far
+static int add_name(ref_names* names, const char* name, int len, const unsigned char* oid, int annotated) {
+	int kind = ref_kind(name), skip;
+	char short_name[PATH_MAX];
+
+	if (kind < 0) {
+		return 0;
+	}
+	if (++names->count > NAME_BUDGET) {
+		return -1;
+	}
+	if (memcmp(oid, names->oid, names->repo->rawsz) != 0) {
+		return 0;
+	}
+	// how git names them: tags/<tag>[^0], <branch>, remotes/<remote>/<branch>
+	skip = kind == KIND_HEAD ? 11 : 5;
+	if (len - skip + 3 > (int)sizeof short_name) {
+		return 0;
+	}
+	memcpy(short_name, name + skip, len - skip);
+	strcpy(short_name + len - skip, annotated ? "^0" : "");
+	if (!*names->best || kind < names->kind || (kind == names->kind && strcmp(short_name, names->best) < 0)) {
+		strcpy(names->best, short_name);
+		names->kind = kind;
+	}
+	return 0;
+}
+
+// a loose ref hides the packed one of the same name, whatever it points at
+static int has_loose(const ref_names* names, const char* name) {
+	char path[PATH_MAX], buf[2 * GIT_MAX_RAWSZ + 8];
+	return ref_path(names->repo, name, path) == 0 && readref(path, buf, sizeof buf) > 0;
+}
+
+static int add_loose(ref_names* names, char* path, int base, int len) {
+	const git_repo* repo = names->repo;
+	DIR* dir;
+	struct dirent* de;
+	int result = 0;
+
+	if (!(dir = opendir(path))) {
+		return 0;
+	}
+	while (result == 0 && (de = readdir(dir))) {
+		int namelen = strlen(de->d_name);
+		struct stat st;
+
+		if (*de->d_name == '.' || len + namelen + 2 > PATH_MAX) {
+			continue;
+		}
+		path[len] = '/';
+		strcpy(path + len + 1, de->d_name);
+		if (stat(path, &st) != 0) {
+			continue;
+		}
+		if (S_ISDIR(st.st_mode)) {
+			result = add_loose(names, path, base, len + 1 + namelen);
+		} else if (S_ISREG(st.st_mode)) {
+			unsigned char oid[GIT_MAX_RAWSZ], peeled[GIT_MAX_RAWSZ];
+			char buf[2 * GIT_MAX_RAWSZ + 8];
+			int annotated = 0;
+			if (readref(path, buf, sizeof buf) != 2 * repo->rawsz || hex2oid(buf, oid, repo->rawsz) != 0) {
+				continue;
+			}
+			if (ref_kind(path + base) == KIND_TAG) {
+				if ((annotated = peel(names, oid, peeled)) < 0) {
+					result = -1;
+					break;
+				}
+				memcpy(oid, peeled, repo->rawsz);
+			}
+			result = add_name(names, path + base, len + 1 + namelen - base, oid, annotated);
+		}
+	}
+	path[len] = 0;
+	closedir(dir);
+	return result;
+}
+
+static int add_packed(ref_names* names) {
+	const git_repo* repo = names->repo;
+	packed_refs packed;
+	const char *p, *end;
+	int result = 0;
+
+	if (packed_open(&packed, repo) != 0) {
+		return 0;
+	}
+	for (p = packed.records, end = packed.map + packed.size; p < end && result == 0; ) {
+		unsigned char oid[GIT_MAX_RAWSZ], peeled[GIT_MAX_RAWSZ];
+		char name[PATH_MAX];
+		packed_ref ref;
+		int annotated = 0;
+
+		p = packed_record(&packed, p, &ref);
+		if (!ref.name || ref.namelen >= sizeof name || hex2oid(ref.oid, oid, repo->rawsz) != 0) {
+			continue;
+		}
+		memcpy(name, ref.name, ref.namelen);
+		name[ref.namelen] = 0;
+		if (ref_kind(name) < 0) {
+			continue;
+		}
+		if (ref.peeled) {
+			annotated = hex2oid(ref.peeled, oid, repo->rawsz) == 0;
+		} else if (ref_kind(name) == KIND_TAG && !packed.peeled) {
+			// older files only peel what they were asked to
+			if ((annotated = peel(names, oid, peeled)) < 0) {
+				result = -1;
+				break;
+			}
+			memcpy(oid, peeled, repo->rawsz);
+		}
+		// only a ref that would be kept is looked for among the loose ones
+		if (memcmp(oid, names->oid, repo->rawsz) == 0 && has_loose(names, name)) {
+			continue;
+		}
+		result = add_name(names, name, ref.namelen, oid, annotated);
+	}
+	packed_close(&packed);
+	return result;
+}
+
+int ref_name_commit(const git_repo* repo, const unsigned char* oid, char* buf, size_t size) {
+	static const char* const dirs[] = {"/refs/tags", "/refs/heads", "/refs/remotes"};
+	char path[PATH_MAX];
+	ref_names names;
+	int n;
+
+	// reftable stacks would have to be merged, names are only looked up in files
+	if (repo->reftable || strlen(repo->commondir) + 14 > sizeof path) {
+		return -1;
+	}
+	memset(&names, 0, sizeof names);
+	names.repo = repo;
+	names.oid = oid;
+	for (n = 0; n < 3; ++n) {
+		int len = strlen(repo->commondir);
+		strcpy(path, repo->commondir);
+		strcpy(path + len, dirs[n]);
+		if (add_loose(&names, path, len + 1, len + strlen(dirs[n])) != 0) {
+			return -1;
+		}
+	}
+	if (add_packed(&names) != 0 || !*names.best || strlen(names.best) >= size) {
+		return -1;
+	}
+	strcpy(buf, names.best);
+	return 0;
+}
@@ -0,0 +1,356 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "git.h"
+
+#define REFTABLE_MAXKEY 4096
+
+typedef struct {
+	const unsigned char* map;
+	size_t size;
+	int header;
+	int rawsz;
+	uint64_t ref_index;
+	size_t ref_end;
+} reftable;
+
+typedef struct {
+	const unsigned char* base;
+	size_t start;
+	size_t end;
+	size_t restarts;
+	int count;
+	int type;
+} reftable_block;
+
+static uint64_t get_be64(const unsigned char* p) {
+	return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+static uint32_t get_be24(const unsigned char* p) {
+	return (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+}
+
+static int varint(const unsigned char* p, size_t* pos, size_t end, uint64_t* val) {
+	unsigned char c;
+
+	if (*pos >= end) {
+		return -1;
+	}
+	c = p[(*pos)++];
+	*val = c & 127;
+	while (c & 128) {
+		if (*pos >= end) {
+			return -1;
+		}
+		c = p[(*pos)++];
+		*val = ((*val + 1) << 7) | (c & 127);
+	}
+	return 0;
+}
+
+static int table_open(reftable* table, const unsigned char* map, size_t size, int rawsz) {
+	int version, footer;
+	const unsigned char* f;
+	uint64_t positions[3];
+	int n;
+
+	if (size < 24 || memcmp(map, "REFT", 4) != 0) {
+		return -1;
+	}
+	version = map[4];
+	if (version == 1) {
+		table->header = 24;
+		footer = 68;
+		if (rawsz != 20) {
+			return -1;
+		}
+	} else if (version == 2) {
+		table->header = 28;
+		footer = 72;
+		if (size < 28 || memcmp(map + 24, rawsz == 32 ? "s256" : "sha1", 4) != 0) {
+			return -1;
+		}
+	} else {
+		return -1;
+	}
+	if (size < table->header + footer) {
+		return -1;
+	}
+
+	// the footer repeats the header, then points at the sections after the ref blocks
+	f = map + size - footer + table->header;
+	table->map = map;
+	table->size = size;
+	table->rawsz = rawsz;
+	table->ref_index = get_be64(f);
+	positions[0] = table->ref_index;
+	positions[1] = get_be64(f + 8) >> 5;
+	positions[2] = get_be64(f + 24);
+	table->ref_end = size - footer;
+	for (n = 0; n < 3; ++n) {
+		if (positions[n] && positions[n] < table->ref_end) {
+			table->ref_end = positions[n];
+		}
+	}
+	return 0;
+}
+
+static int block_open(const reftable* table, size_t off, reftable_block* block) {
+	// the first block shares its bytes with the file header
+	size_t start = off == 0 ? table->header : 0;
+	uint32_t len;
+
+	if (off + start + 4 > table->size) {
+		return -1;
+	}
+	block->base = table->map + off;
+	block->type = block->base[start];
+	len = get_be24(block->base + start + 1);
+	if (len < start + 6 || off + len > table->size) {
+		return -1;
+	}
+	block->count = get_be16(block->base + len - 2);
+	if (block->count == 0 || start + 4 + 3 * block->count + 2 > len) {
+		return -1;
+	}
+	block->start = start + 4;
+	block->restarts = len - 2 - 3 * block->count;
+	block->end = len;
+	return 0;
+}
+
+// decodes a key at *pos on top of the previous one, leaves *pos at the value
+static int block_key(const reftable_block* block, size_t* pos, char* key, int* keylen, int* type) {
+	uint64_t prefix, suffix;
+
+	if (varint(block->base, pos, block->restarts, &prefix) != 0 ||
+			varint(block->base, pos, block->restarts, &suffix) != 0) {
+		return -1;
+	}
+	*type = suffix & 7;
+	suffix >>= 3;
+	if (prefix > *keylen || prefix + suffix >= REFTABLE_MAXKEY || *pos + suffix > block->restarts) {
+		return -1;
+	}
+	memcpy(key + prefix, block->base + *pos, suffix);
+	*pos += suffix;
+	*keylen = prefix + suffix;
+	key[*keylen] = 0;
+	return 0;
+}
+
+// steps over the value of a record so the next key can be decoded
+static int block_skip(const reftable* table, const reftable_block* block, size_t* pos, int type) {
+	uint64_t val;
+
+	if (block->type == 'i') {
+		return varint(block->base, pos, block->restarts, &val);
+	}
+	if (varint(block->base, pos, block->restarts, &val) != 0) {
+		return -1;
+	}
+	switch (type) {
+	case 0:
+		return 0;
+	case 1:
+		*pos += table->rawsz;
+		break;
+	case 2:
+		*pos += 2 * table->rawsz;
+		break;
+	case 3:
+		if (varint(block->base, pos, block->restarts, &val) != 0) {
+			return -1;
+		}
+		*pos += val;
+		break;
+	default:
+		return -1;
+	}
+	return *pos <= block->restarts ? 0 : -1;
+}
+
+static int keycmp(const char* key, int keylen, const char* name, int namelen) {
+	int cmp = memcmp(key, name, keylen < namelen ? keylen : namelen);
+	return cmp ? cmp : keylen - namelen;
+}
+
+// finds the first record whose key is not less than name, 1 when every key is less
+static int block_seek(const reftable* table, const reftable_block* block, const char* name, char* key, int* keylen, size_t* pos, int* type) {
+	int namelen = strlen(name);
+	int lo = 0, hi = block->count;
+
+	// restart points hold full keys, bisect them for the last one before name
+	while (hi - lo > 1) {
+		int mid = lo + (hi - lo) / 2;
+		size_t p = get_be24(block->base + block->restarts + 3 * mid);
+		int len = 0, t;
+		if (p < block->start || p >= block->restarts || block_key(block, &p, key, &len, &t) != 0) {
+			return -1;
+		}
+		if (keycmp(key, len, name, namelen) < 0) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	*pos = get_be24(block->base + block->restarts + 3 * lo);
+	if (*pos < block->start) {
+		return -1;
+	}
+	*keylen = 0;
+	while (*pos < block->restarts) {
+		if (block_key(block, pos, key, keylen, type) != 0) {
+			return -1;
+		}
+		if (keycmp(key, *keylen, name, namelen) >= 0) {
+			return 0;
+		}
+		if (block_skip(table, block, pos, *type) != 0) {
+			return -1;
+		}
+	}
+	return 1;
+}
+
+// 0 with the object id, 1 with a symref target, 2 when deleted here, 3 when this table does not know the ref and
+// -1 when it can't be read
+static int table_lookup(const reftable* table, const char* name, unsigned char* oid, char* target, size_t size) {
+	char key[REFTABLE_MAXKEY];
+	reftable_block block;
+	size_t off = table->ref_index ? table->ref_index : 0, pos;
+	int keylen, type, found;
+	uint64_t val;
+
+	for (;;) {
+		if (off >= table->size || block_open(table, off, &block) != 0) {
+			return -1;
+		}
+		found = block_seek(table, &block, name, key, &keylen, &pos, &type);
+		if (found < 0) {
+			return -1;
+		}
+		if (block.type == 'i') {
+			// index keys are the last name of the block they point at
+			if (found) {
+				return 3;
+			}
+			if (varint(block.base, &pos, block.restarts, &val) != 0) {
+				return -1;
+			}
+			off = val;
+		} else if (block.type != 'r') {
+			return -1;
+		} else if (found == 0 || table->ref_index) {
+			break;
+		} else {
+			// without an index the ref blocks follow each other, padding aside
+			off += block.end;
+			while (off < table->ref_end && table->map[off] == 0) {
+				++off;
+			}
+			if (off >= table->ref_end) {
+				return 3;
+			}
+		}
+	}
+
+	if (found || strcmp(key, name) != 0) {
+		return 3;
+	}
+	if (varint(block.base, &pos, block.restarts, &val) != 0) {
+		return -1;
+	}
+	switch (type) {
+	case 0:
+		return 2;
+	case 1:
+	case 2:
+		if (pos + table->rawsz > block.restarts) {
+			return -1;
+		}
+		memcpy(oid, block.base + pos, table->rawsz);
+		return 0;
+	case 3:
+		if (varint(block.base, &pos, block.restarts, &val) != 0 || pos + val > block.restarts || val >= size) {
+			return -1;
+		}
+		memcpy(target, block.base + pos, val);
+		target[val] = 0;
+		return 1;
+	}
+	return -1;
+}
+
+// a table that can't be read fails the lookup, an older one answering in its place would show a stale ref
+int reftable_lookup(const char* dir, const char* name, int rawsz, unsigned char* oid, char* target, size_t size) {
+	char path[PATH_MAX];
+	char *list, *line;
+	struct stat st;
+	ssize_t n = 0, r;
+	int fd, len = strlen(dir), result = 3;
+
+	if (len + 14 > sizeof path) {
+		return -1;
+	}
+	strcpy(path, dir);
+	strcpy(path + len, "/tables.list");
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		return -1;
+	}
+	// git replaces the list by renaming a new one over it, what this descriptor reads stays whole
+	if (fstat(fd, &st) != 0 || !(list = malloc(st.st_size + 1))) {
+		close(fd);
+		return -1;
+	}
+	while (n < st.st_size && (r = read(fd, list + n, st.st_size - n)) > 0) {
+		n += r;
+	}
+	close(fd);
+	if (n != st.st_size) {
+		free(list);
+		return -1;
+	}
+	list[n] = 0;
+
+	// newest table last, the first one to know the ref wins
+	while (result == 3 && n > 0) {
+		unsigned char* map;
+		reftable table;
+
+		while (n > 0 && list[n - 1] == '\n') {
+			list[--n] = 0;
+		}
+		for (line = list + n; line > list && line[-1] != '\n'; --line);
+		n = line - list;
+		if (!*line) {
+			continue;
+		}
+		if (len + 2 + strlen(line) > sizeof path) {
+			result = -1;
+			break;
+		}
+		path[len] = '/';
+		strcpy(path + len + 1, line);
+		if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+			result = -1;
+			break;
+		}
+		if (fstat(fd, &st) != 0 || st.st_size == 0 ||
+				(map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+			close(fd);
+			result = -1;
+			break;
+		}
+		close(fd);
+		result = table_open(&table, map, st.st_size, rawsz) == 0 ? table_lookup(&table, name, oid, target, size) : -1;
+		munmap(map, st.st_size);
+	}
+	free(list);
+	return result == 2 || result == 3 ? -1 : result;
+}
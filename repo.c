@@ -0,0 +1,358 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "git.h"
+
+static int isdir(const char* path) {
+	struct stat st;
+	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static int exists(const char* path) {
+	struct stat st;
+	return lstat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+static const char* join(char* buf, const char* dir, const char* name) {
+	strcpy(buf, dir);
+	strcat(buf, name);
+	return buf;
+}
+
+static int within(const char* path, const char* dir) {
+	int len = strlen(dir);
+	return strncmp(path, dir, len) == 0 && (path[len] == 0 || path[len] == '/' || (len == 1 && *dir == '/'));
+}
+
+// joins a path found in a file or the config to the directory it is relative to and normalizes it
+static int resolve(const char* base, const char* path, char* out) {
+	char tmp[PATH_MAX];
+
+	if (*path != '/') {
+		if (strlen(base) + strlen(path) + 2 > sizeof tmp) {
+			return -1;
+		}
+		strcpy(tmp, base);
+		strcat(tmp, "/");
+		strcat(tmp, path);
+		path = tmp;
+	}
+	return realpath(path, out) ? 0 : -1;
+}
+
+static int readline(const char* path, char* buf, size_t size) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	int n = 0, r;
+
+	if (fd == -1) {
+		return -1;
+	}
+	while (n < size - 1 && (r = read(fd, buf + n, size - 1 - n)) > 0) {
+		n += r;
+	}
+	close(fd);
+	while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == '\r')) {
+		--n;
+	}
+	buf[n] = 0;
+	return n;
+}
+
+// where objects and refs live, the git dir itself unless it belongs to a linked work tree
+static int common_dir(const char* gitdir, char* common) {
+	char tpath[PATH_MAX], tmp[PATH_MAX];
+	const char* env = getenv("GIT_COMMON_DIR");
+
+	if (env) {
+		return resolve(gitdir, env, common);
+	}
+	if (strlen(gitdir) + 11 > sizeof tpath) {
+		return -1;
+	}
+	strcpy(tpath, gitdir);
+	strcat(tpath, "/commondir");
+	if (readline(tpath, tmp, sizeof tmp) > 0) {
+		return resolve(gitdir, tmp, common);
+	}
+	strcpy(common, gitdir);
+	return 0;
+}
+
+static int is_git_dir(const char* dir) {
+	char tpath[PATH_MAX], common[PATH_MAX];
+	struct stat st;
+	int len = strlen(dir);
+
+	if (len + 12 > sizeof tpath) {
+		return 0;
+	}
+	strcpy(tpath, dir);
+	strcpy(tpath + len, "/HEAD");
+	if (lstat(tpath, &st) != 0 || !(S_ISREG(st.st_mode) || S_ISLNK(st.st_mode))) {
+		return 0;
+	}
+	if (common_dir(dir, common) != 0 || strlen(common) + 9 > sizeof tpath) {
+		return 0;
+	}
+	strcpy(tpath, common);
+	strcat(tpath, "/refs");
+	if (!isdir(tpath)) {
+		return 0;
+	}
+	if (getenv("GIT_OBJECT_DIRECTORY")) {
+		return 1;
+	}
+	strcpy(tpath, common);
+	strcat(tpath, "/objects");
+	return isdir(tpath);
+}
+
+// the longest of GIT_CEILING_DIRECTORIES that is a parent of cwd, the walk never goes up to it
+static int ceiling(const char* cwd) {
+	const char* env = getenv("GIT_CEILING_DIRECTORIES");
+	int best = -1;
+
+	while (env && *env) {
+		const char* end = strchr(env, ':');
+		int len = end ? end - env : strlen(env);
+		while (len > 1 && env[len - 1] == '/') {
+			--len;
+		}
+		if (*env == '/' && len < strlen(cwd) && strncmp(cwd, env, len) == 0 &&
+				(cwd[len] == '/' || len == 1) && len > best) {
+			best = len;
+		}
+		env = end ? end + 1 : NULL;
+	}
+	return best;
+}
+
+// gitfile is the .git file that led to the git dir, empty when it was a directory
+static int find_git_dir(const char* cwd, char* gitdir, char* top, char* gitfile) {
+	char dir[PATH_MAX], tpath[PATH_MAX], tmp[PATH_MAX];
+	const char* across = getenv("GIT_DISCOVERY_ACROSS_FILESYSTEM");
+	int limit = ceiling(cwd);
+	struct stat st;
+	dev_t dev;
+
+	if (strlen(cwd) + 6 > sizeof dir || stat(cwd, &st) != 0) {
+		return -1;
+	}
+	strcpy(dir, cwd);
+	dev = st.st_dev;
+	*gitfile = 0;
+
+	for (;;) {
+		int len = strlen(dir);
+		char* slash;
+
+		strcpy(tpath, dir);
+		strcpy(tpath + (len == 1 ? 0 : len), "/.git");
+		if (stat(tpath, &st) == 0) {
+			if (S_ISREG(st.st_mode)) {
+				// "gitdir: <path>" points at the real git dir
+				if (readline(tpath, tmp, sizeof tmp) > 8 && strncmp(tmp, "gitdir: ", 8) == 0 &&
+						resolve(dir, tmp + 8, gitdir) == 0 && is_git_dir(gitdir)) {
+					strcpy(top, dir);
+					strcpy(gitfile, tpath);
+					return 0;
+				}
+				return -1;
+			}
+			if (S_ISDIR(st.st_mode) && is_git_dir(tpath)) {
+				strcpy(gitdir, tpath);
+				strcpy(top, dir);
+				return 0;
+			}
+		}
+		if (is_git_dir(dir)) {
+			strcpy(gitdir, dir);
+			*top = 0;
+			return 0;
+		}
+
+		slash = strrchr(dir, '/');
+		if (len == 1 || !slash || (slash - dir) <= limit) {
+			return -1;
+		}
+		if (slash == dir) {
+			++slash;
+		}
+		*slash = 0;
+		if (!config_bool(across, 0) && (stat(dir, &st) != 0 || st.st_dev != dev)) {
+			return -1;
+		}
+	}
+}
+
+// under sudo it is the user sudo was run by, as git has it
+static int owned(const char* path) {
+	const char* sudo = getenv("SUDO_UID");
+	uid_t euid = geteuid();
+	struct stat st;
+
+	if (euid == 0 && sudo && *sudo) {
+		euid = strtoul(sudo, NULL, 10);
+	}
+	return lstat(path, &st) == 0 && st.st_uid == euid;
+}
+
+// git only reads the config of a repository, and runs the hooks it names, when its work tree, git dir and
+// .git file belong to whoever runs it, or safe.directory says otherwise
+static int trusted(const char* gitfile, const char* top, const char* gitdir) {
+	if ((!*gitfile || owned(gitfile)) && (!*top || owned(top)) && owned(gitdir)) {
+		return 1;
+	}
+	return config_safe_directory(*top ? top : gitdir);
+}
+
+// the keys discovery needs, all read in one pass over the repository's config
+typedef struct {
+	char format[16];
+	char refs[16];
+	char bare[16];
+	char worktree[PATH_MAX];
+	char worktree_config[16];
+	int has_bare;
+	int has_worktree;
+} repo_format;
+
+static int format_key(char* buf, size_t size, const char* value) {
+	if (!value) {
+		value = "true";
+	}
+	if (strlen(value) >= size) {
+		return 0;
+	}
+	strcpy(buf, value);
+	return 1;
+}
+
+static int format_config(const char* key, const char* value, void* data) {
+	repo_format* format = data;
+
+	if (strcmp(key, "extensions.objectformat") == 0) {
+		format_key(format->format, sizeof format->format, value);
+	} else if (strcmp(key, "extensions.refstorage") == 0) {
+		format_key(format->refs, sizeof format->refs, value);
+	} else if (strcmp(key, "extensions.worktreeconfig") == 0) {
+		format_key(format->worktree_config, sizeof format->worktree_config, value);
+	} else if (strcmp(key, "core.bare") == 0) {
+		format->has_bare |= format_key(format->bare, sizeof format->bare, value);
+	} else if (strcmp(key, "core.worktree") == 0) {
+		format->has_worktree |= format_key(format->worktree, sizeof format->worktree, value);
+	}
+	return 0;
+}
+
+int repo_discover(git_repo* repo, const char* cwd) {
+	char top[PATH_MAX], config[PATH_MAX + 8], gitfile[PATH_MAX];
+	const char* env = getenv("GIT_DIR");
+	const char* worktree = getenv("GIT_WORK_TREE");
+	repo_format format;
+	int len;
+
+	memset(repo, 0, sizeof *repo);
+	if (env) {
+		// an explicit git dir makes the current directory the top of the work tree, git trusts it whoever owns it
+		if (resolve(cwd, env, repo->gitdir) != 0 || !is_git_dir(repo->gitdir)) {
+			return -1;
+		}
+		strcpy(top, cwd);
+	} else if (find_git_dir(cwd, repo->gitdir, top, gitfile) != 0) {
+		return -1;
+	} else if (!trusted(gitfile, top, repo->gitdir)) {
+		// a repository someone else owns is none at all, as git status has it, before any of its config is read
+		return -1;
+	}
+
+	if (common_dir(repo->gitdir, repo->commondir) != 0) {
+		return -1;
+	}
+	if ((env = getenv("GIT_OBJECT_DIRECTORY"))) {
+		if (resolve(cwd, env, repo->objdir) != 0) {
+			return -1;
+		}
+	} else {
+		strcpy(repo->objdir, repo->commondir);
+		strcat(repo->objdir, "/objects");
+	}
+
+	// the repository format comes from the repository's own config only
+	strcpy(config, repo->commondir);
+	strcat(config, "/config");
+	memset(&format, 0, sizeof format);
+	config_parse(config, repo->gitdir, format_config, &format);
+	repo->rawsz = strcmp(format.format, "sha256") == 0 ? 32 : 20;
+	repo->reftable = strcmp(format.refs, "reftable") == 0;
+	repo->worktree_config = config_bool(format.worktree_config, 0);
+
+	if (worktree) {
+		if (resolve(cwd, worktree, repo->worktree) != 0) {
+			*repo->worktree = 0;
+		}
+	} else if (format.has_worktree) {
+		if (resolve(repo->gitdir, format.worktree, repo->worktree) != 0) {
+			*repo->worktree = 0;
+		}
+	} else if (!config_bool(format.has_bare ? format.bare : NULL, 0)) {
+		strcpy(repo->worktree, top);
+	}
+
+	// without core.bare a git dir not called .git is taken to be bare
+	len = strlen(repo->gitdir);
+	repo->bare = !*repo->worktree &&
+		config_bool(format.has_bare ? format.bare : NULL, len < 5 || strcmp(repo->gitdir + len - 5, "/.git") != 0);
+	repo->inside = within(cwd, repo->gitdir);
+	repo->intree = !repo->inside && *repo->worktree && within(cwd, repo->worktree);
+	return 0;
+}
+
+// the operation in progress as the prompt shows it, "|REBASE 2/5" and the like, and the branch a rebase is on
+void repo_operation(const char* gitdir, char* op, size_t size, char* branch, size_t bsize) {
+	char tpath[PATH_MAX], step[32], total[32];
+	const char* kind = NULL;
+
+	*op = *branch = 0;
+	if (strlen(gitdir) + 32 > sizeof tpath) {
+		return;
+	}
+	if (isdir(join(tpath, gitdir, "/rebase-merge"))) {
+		readline(join(tpath, gitdir, "/rebase-merge/head-name"), branch, bsize);
+		return;
+	}
+	if (isdir(join(tpath, gitdir, "/rebase-apply"))) {
+		if (exists(join(tpath, gitdir, "/rebase-apply/rebasing"))) {
+			readline(join(tpath, gitdir, "/rebase-apply/head-name"), branch, bsize);
+			kind = "|REBASE";
+		} else if (exists(join(tpath, gitdir, "/rebase-apply/applying"))) {
+			kind = "|AM";
+		} else {
+			kind = "|AM/REBASE";
+		}
+		// a missing file still shows, as an empty count
+		if (readline(join(tpath, gitdir, "/rebase-apply/next"), step, sizeof step) < 0) {
+			*step = 0;
+		}
+		if (readline(join(tpath, gitdir, "/rebase-apply/last"), total, sizeof total) < 0) {
+			*total = 0;
+		}
+		snprintf(op, size, "%s %s/%s", kind, step, total);
+		return;
+	}
+	if (exists(join(tpath, gitdir, "/MERGE_HEAD"))) {
+		kind = "|MERGING";
+	} else if (exists(join(tpath, gitdir, "/CHERRY_PICK_HEAD"))) {
+		kind = "|CHERRY-PICKING";
+	} else if (exists(join(tpath, gitdir, "/REVERT_HEAD"))) {
+		kind = "|REVERTING";
+	} else if (exists(join(tpath, gitdir, "/BISECT_LOG"))) {
+		kind = "|BISECTING";
+	}
+	if (kind && strlen(kind) < size) {
+		strcpy(op, kind);
+	}
+}
@@ -0,0 +1,351 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "git.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HASH_SHANI
+#elif defined(__aarch64__) && defined(__GNUC__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#include <arm_neon.h>
+#define HASH_ARMV8
+#endif
+
+typedef void (*compress_fn)(uint32_t* state, const unsigned char* data, size_t blocks);
+
+static const uint32_t K256[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROL(x, n) ((x) << (n) | (x) >> (32 - (n)))
+#define ROR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+static void sha1_scalar(uint32_t* state, const unsigned char* data, size_t blocks) {
+	for (; blocks; --blocks, data += 64) {
+		uint32_t w[80], a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+		int i;
+
+		for (i = 0; i < 16; ++i) {
+			w[i] = get_be32(data + 4 * i);
+		}
+		for (; i < 80; ++i) {
+			w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+		}
+		for (i = 0; i < 80; ++i) {
+			uint32_t f, k, t;
+			if (i < 20) {
+				f = (b & c) | (~b & d);
+				k = 0x5a827999;
+			} else if (i < 40) {
+				f = b ^ c ^ d;
+				k = 0x6ed9eba1;
+			} else if (i < 60) {
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8f1bbcdc;
+			} else {
+				f = b ^ c ^ d;
+				k = 0xca62c1d6;
+			}
+			t = ROL(a, 5) + f + e + k + w[i];
+			e = d;
+			d = c;
+			c = ROL(b, 30);
+			b = a;
+			a = t;
+		}
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+	}
+}
+
+static void sha256_scalar(uint32_t* state, const unsigned char* data, size_t blocks) {
+	for (; blocks; --blocks, data += 64) {
+		uint32_t w[64], a, b, c, d, e, f, g, h;
+		int i;
+
+		for (i = 0; i < 16; ++i) {
+			w[i] = get_be32(data + 4 * i);
+		}
+		for (; i < 64; ++i) {
+			uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+		a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+		for (i = 0; i < 64; ++i) {
+			uint32_t t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + K256[i] + w[i];
+			uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+	}
+}
+
+#ifdef HASH_SHANI
+// four rounds per sha1rnds4, the schedule runs three groups ahead of them
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha1_shani(uint32_t* state, const unsigned char* data, size_t blocks) {
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0x1b);
+	__m128i e0 = _mm_set_epi32(state[4], 0, 0, 0), e1, abcd_save, e0_save, msg[4];
+	int j;
+
+	for (; blocks; --blocks, data += 64) {
+		abcd_save = abcd;
+		e0_save = e0;
+		for (j = 0; j < 4; ++j) {
+			msg[j] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16 * j)), mask);
+		}
+#pragma GCC unroll 20
+		for (j = 0; j < 20; ++j) {
+			__m128i* e = j & 1 ? &e1 : &e0;
+			if (j == 0) {
+				e0 = _mm_add_epi32(e0, msg[0]);
+			} else {
+				*e = _mm_sha1nexte_epu32(*e, msg[j % 4]);
+			}
+			*(j & 1 ? &e0 : &e1) = abcd;
+			if (j >= 3 && j <= 18) {
+				msg[(j + 1) % 4] = _mm_sha1msg2_epu32(msg[(j + 1) % 4], msg[j % 4]);
+			}
+			switch (j / 5) {
+			case 0:
+				abcd = _mm_sha1rnds4_epu32(abcd, *e, 0);
+				break;
+			case 1:
+				abcd = _mm_sha1rnds4_epu32(abcd, *e, 1);
+				break;
+			case 2:
+				abcd = _mm_sha1rnds4_epu32(abcd, *e, 2);
+				break;
+			default:
+				abcd = _mm_sha1rnds4_epu32(abcd, *e, 3);
+				break;
+			}
+			if (j >= 1 && j <= 16) {
+				msg[(j + 3) % 4] = _mm_sha1msg1_epu32(msg[(j + 3) % 4], msg[j % 4]);
+			}
+			if (j >= 2 && j <= 17) {
+				msg[(j + 2) % 4] = _mm_xor_si128(msg[(j + 2) % 4], msg[j % 4]);
+			}
+		}
+		e0 = _mm_sha1nexte_epu32(e0, e0_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+	}
+	_mm_storeu_si128((__m128i*)state, _mm_shuffle_epi32(abcd, 0x1b));
+	state[4] = _mm_extract_epi32(e0, 3);
+}
+
+// the state is kept as ABEF and CDGH, two rounds per sha256rnds2
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_shani(uint32_t* state, const unsigned char* data, size_t blocks) {
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0xb1);
+	__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(state + 4)), 0x1b);
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8), abef_save, cdgh_save, msg[4], m;
+	int j;
+
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+	for (; blocks; --blocks, data += 64) {
+		abef_save = state0;
+		cdgh_save = state1;
+		for (j = 0; j < 4; ++j) {
+			msg[j] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16 * j)), mask);
+		}
+#pragma GCC unroll 16
+		for (j = 0; j < 16; ++j) {
+			m = _mm_add_epi32(msg[j % 4], _mm_loadu_si128((const __m128i*)(K256 + 4 * j)));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+			if (j >= 3 && j <= 14) {
+				msg[(j + 1) % 4] = _mm_add_epi32(msg[(j + 1) % 4], _mm_alignr_epi8(msg[j % 4], msg[(j + 3) % 4], 4));
+				msg[(j + 1) % 4] = _mm_sha256msg2_epu32(msg[(j + 1) % 4], msg[j % 4]);
+			}
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(m, 0x0e));
+			if (j >= 1 && j <= 12) {
+				msg[(j + 3) % 4] = _mm_sha256msg1_epu32(msg[(j + 3) % 4], msg[j % 4]);
+			}
+		}
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+	}
+	tmp = _mm_shuffle_epi32(state0, 0x1b);
+	state1 = _mm_shuffle_epi32(state1, 0xb1);
+	_mm_storeu_si128((__m128i*)state, _mm_blend_epi16(tmp, state1, 0xf0));
+	_mm_storeu_si128((__m128i*)(state + 4), _mm_alignr_epi8(state1, tmp, 8));
+}
+
+static int shani_supported() {
+	unsigned a, b, c, d;
+
+	// SHA extensions in leaf 7, SSSE3 and SSE4.1 in leaf 1
+	return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b >> 29 & 1) &&
+		__get_cpuid(1, &a, &b, &c, &d) && (c >> 9 & 1) && (c >> 19 & 1);
+}
+#endif
+
+#ifdef HASH_ARMV8
+__attribute__((target("+crypto")))
+static void sha1_armv8(uint32_t* state, const unsigned char* data, size_t blocks) {
+	static const uint32_t k[4] = {0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6};
+	uint32x4_t abcd = vld1q_u32(state), abcd_save, msg[4], w;
+	uint32_t e0 = state[4], e0_save, e1;
+	int j;
+
+	for (; blocks; --blocks, data += 64) {
+		abcd_save = abcd;
+		e0_save = e0;
+		for (j = 0; j < 4; ++j) {
+			msg[j] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * j)));
+		}
+		for (j = 0; j < 20; ++j) {
+			w = vaddq_u32(msg[j % 4], vdupq_n_u32(k[j / 5]));
+			e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+			abcd = j < 5 ? vsha1cq_u32(abcd, e0, w) : j >= 10 && j < 15 ? vsha1mq_u32(abcd, e0, w) : vsha1pq_u32(abcd, e0, w);
+			e0 = e1;
+			if (j < 16) {
+				msg[j % 4] = vsha1su1q_u32(vsha1su0q_u32(msg[j % 4], msg[(j + 1) % 4], msg[(j + 2) % 4]), msg[(j + 3) % 4]);
+			}
+		}
+		abcd = vaddq_u32(abcd, abcd_save);
+		e0 += e0_save;
+	}
+	vst1q_u32(state, abcd);
+	state[4] = e0;
+}
+
+__attribute__((target("+crypto")))
+static void sha256_armv8(uint32_t* state, const unsigned char* data, size_t blocks) {
+	uint32x4_t state0 = vld1q_u32(state), state1 = vld1q_u32(state + 4), save0, save1, msg[4], w, tmp;
+	int j;
+
+	for (; blocks; --blocks, data += 64) {
+		save0 = state0;
+		save1 = state1;
+		for (j = 0; j < 4; ++j) {
+			msg[j] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * j)));
+		}
+		for (j = 0; j < 16; ++j) {
+			w = vaddq_u32(msg[j % 4], vld1q_u32(K256 + 4 * j));
+			tmp = state0;
+			state0 = vsha256hq_u32(state0, state1, w);
+			state1 = vsha256h2q_u32(state1, tmp, w);
+			if (j < 12) {
+				msg[j % 4] = vsha256su1q_u32(vsha256su0q_u32(msg[j % 4], msg[(j + 1) % 4]), msg[(j + 2) % 4], msg[(j + 3) % 4]);
+			}
+		}
+		state0 = vaddq_u32(state0, save0);
+		state1 = vaddq_u32(state1, save1);
+	}
+	vst1q_u32(state, state0);
+	vst1q_u32(state + 4, state1);
+}
+#endif
+
+static compress_fn compress_pick(int rawsz) {
+#ifdef HASH_SHANI
+	if (shani_supported()) {
+		return rawsz == 32 ? sha256_shani : sha1_shani;
+	}
+#endif
+#ifdef HASH_ARMV8
+	if (getauxval(AT_HWCAP) & (rawsz == 32 ? HWCAP_SHA2 : HWCAP_SHA1)) {
+		return rawsz == 32 ? sha256_armv8 : sha1_armv8;
+	}
+#endif
+	return rawsz == 32 ? sha256_scalar : sha1_scalar;
+}
+
+static compress_fn compress_get(int rawsz) {
+	static compress_fn picked[2];
+	compress_fn* slot = &picked[rawsz == 32];
+	compress_fn fn = __atomic_load_n(slot, __ATOMIC_RELAXED);
+
+	if (!fn) {
+		fn = compress_pick(rawsz);
+		__atomic_store_n(slot, fn, __ATOMIC_RELAXED);
+	}
+	return fn;
+}
+
+// SHA-1 for 20 byte object ids, SHA-256 for 32 byte ones
+void hash_init(git_hash* ctx, int rawsz) {
+	static const uint32_t sha1[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+	static const uint32_t sha256[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memset(ctx, 0, sizeof *ctx);
+	ctx->rawsz = rawsz;
+	memcpy(ctx->state, rawsz == 32 ? sha256 : sha1, rawsz == 32 ? sizeof sha256 : sizeof sha1);
+}
+
+void hash_update(git_hash* ctx, const void* data, size_t len) {
+	compress_fn compress = compress_get(ctx->rawsz);
+	const unsigned char* p = data;
+	size_t used = ctx->len % 64;
+
+	ctx->len += len;
+	if (used) {
+		size_t n = 64 - used < len ? 64 - used : len;
+		memcpy(ctx->buf + used, p, n);
+		p += n;
+		len -= n;
+		if (used + n < 64) {
+			return;
+		}
+		compress(ctx->state, ctx->buf, 1);
+	}
+	// whole blocks straight from the caller's buffer
+	if (len >= 64) {
+		compress(ctx->state, p, len / 64);
+		p += len & ~(size_t)63;
+		len %= 64;
+	}
+	memcpy(ctx->buf, p, len);
+}
+
+void hash_final(git_hash* ctx, unsigned char* out) {
+	static const unsigned char pad[64] = {0x80};
+	unsigned char bits[8];
+	uint64_t len = ctx->len * 8;
+	int n;
+
+	for (n = 0; n < 8; ++n) {
+		bits[n] = len >> (56 - 8 * n);
+	}
+	hash_update(ctx, pad, 1 + (119 - ctx->len % 64) % 64);
+	hash_update(ctx, bits, 8);
+	for (n = 0; n < ctx->rawsz / 4; ++n) {
+		out[4 * n] = ctx->state[n] >> 24;
+		out[4 * n + 1] = ctx->state[n] >> 16;
+		out[4 * n + 2] = ctx->state[n] >> 8;
+		out[4 * n + 3] = ctx->state[n];
+	}
+}
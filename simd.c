@@ -0,0 +1,105 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "git.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STAT_SIMD
+#endif
+
+typedef void (*compare_fn)(const uint32_t* index, size_t stride, const uint32_t* stat, size_t statstride,
+	uint32_t racy, size_t count, unsigned char* out);
+
+static void compare_scalar(const uint32_t* index, size_t stride, const uint32_t* stat, size_t statstride,
+		uint32_t racy, size_t count, unsigned char* out) {
+	size_t n;
+	int c;
+
+	for (n = 0; n < count; ++n) {
+		uint32_t diff = 0;
+		for (c = 0; c < STAT_COLUMNS; ++c) {
+			diff |= index[c * stride + n] ^ stat[c * statstride + n];
+		}
+		out[n] = diff != 0 || index[COL_MTIME_SEC * stride + n] >= racy;
+	}
+}
+
+#ifdef STAT_SIMD
+// lanes differ when any column differs, or when the entry is racily clean: mtime_sec >= racy, unsigned
+__attribute__((target("sse4.2")))
+static void compare_sse42(const uint32_t* index, size_t stride, const uint32_t* stat, size_t statstride,
+		uint32_t racy, size_t count, unsigned char* out) {
+	const __m128i zero = _mm_setzero_si128(), limit = _mm_set1_epi32(racy);
+	size_t n;
+	int c;
+
+	for (n = 0; n + 4 <= count; n += 4) {
+		__m128i diff = zero, mtime, same;
+		int mask;
+		for (c = 0; c < STAT_COLUMNS; ++c) {
+			diff = _mm_or_si128(diff, _mm_xor_si128(
+				_mm_loadu_si128((const __m128i*)(index + c * stride + n)),
+				_mm_loadu_si128((const __m128i*)(stat + c * statstride + n))));
+		}
+		mtime = _mm_loadu_si128((const __m128i*)(index + COL_MTIME_SEC * stride + n));
+		same = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_max_epu32(mtime, limit), mtime), _mm_cmpeq_epi32(diff, zero));
+		mask = _mm_movemask_ps(_mm_castsi128_ps(same));
+		for (c = 0; c < 4; ++c) {
+			out[n + c] = !(mask >> c & 1);
+		}
+	}
+	compare_scalar(index + n, stride, stat + n, statstride, racy, count - n, out + n);
+}
+
+__attribute__((target("avx2")))
+static void compare_avx2(const uint32_t* index, size_t stride, const uint32_t* stat, size_t statstride,
+		uint32_t racy, size_t count, unsigned char* out) {
+	const __m256i zero = _mm256_setzero_si256(), limit = _mm256_set1_epi32(racy);
+	size_t n;
+	int c;
+
+	for (n = 0; n + 8 <= count; n += 8) {
+		__m256i diff = zero, mtime, same;
+		int mask;
+		for (c = 0; c < STAT_COLUMNS; ++c) {
+			diff = _mm256_or_si256(diff, _mm256_xor_si256(
+				_mm256_loadu_si256((const __m256i*)(index + c * stride + n)),
+				_mm256_loadu_si256((const __m256i*)(stat + c * statstride + n))));
+		}
+		mtime = _mm256_loadu_si256((const __m256i*)(index + COL_MTIME_SEC * stride + n));
+		same = _mm256_andnot_si256(_mm256_cmpeq_epi32(_mm256_max_epu32(mtime, limit), mtime),
+			_mm256_cmpeq_epi32(diff, zero));
+		mask = _mm256_movemask_ps(_mm256_castsi256_ps(same));
+		for (c = 0; c < 8; ++c) {
+			out[n + c] = !(mask >> c & 1);
+		}
+	}
+	compare_scalar(index + n, stride, stat + n, statstride, racy, count - n, out + n);
+}
+#endif
+
+static compare_fn compare_pick() {
+#ifdef STAT_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return compare_avx2;
+	}
+	if (__builtin_cpu_supports("sse4.2")) {
+		return compare_sse42;
+	}
+#endif
+	return compare_scalar;
+}
+
+// out[n] is 1 when entry n's columns don't match the stat data gathered for it, or it is racily clean
+void stat_compare(const uint32_t* index, size_t stride, const uint32_t* stat, size_t statstride,
+		uint32_t racy, size_t count, unsigned char* out) {
+	static compare_fn compare;
+	compare_fn fn = __atomic_load_n(&compare, __ATOMIC_RELAXED);
+
+	if (!fn) {
+		fn = compare_pick();
+		__atomic_store_n(&compare, fn, __ATOMIC_RELAXED);
+	}
+	fn(index, stride, stat, statstride, racy, count, out);
+}
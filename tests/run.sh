@@ -0,0 +1,268 @@
+#!/bin/sh
+# builds fixture repositories with git and checks that the native backend shows what the cli one, which leaves the
+# work tree to git status, does; usage: tests/run.sh [prompt] [backend ...], the backends named being held to what the
+# native one shows too
+set -u
+
+PROMPT=$(cd "$(dirname "${1:-./prompt}")" && pwd)/$(basename "${1:-./prompt}")
+shift $(($# < 1 ? $# : 1))
+BACKENDS="$*"
+# backends named here are let off the checks, for what they can't read
+unsupported=
+TESTS=$(cd "$(dirname "$0")" && pwd)
+T=$(mktemp -d)
+daemon=
+trap '[ -z "$daemon" ] || kill $daemon 2> /dev/null; rm -rf "$T"' EXIT
+failed=0
+
+# nothing of the user's own configuration, and a GIT_CONFIG variable set keeps a running daemon out of it
+export HOME="$T" USER=test GIT_CONFIG_NOSYSTEM=1 GIT_CONFIG_GLOBAL="$T/gitconfig" PROMPT_DEADLINE_MS=0
+export GIT_AUTHOR_NAME=test GIT_AUTHOR_EMAIL=test@example.com GIT_COMMITTER_NAME=test GIT_COMMITTER_EMAIL=test@example.com
+unset GIT_DIR GIT_WORK_TREE GIT_INDEX_FILE PROMPT_BACKEND PROMPT_STALE
+git config --global init.defaultBranch master
+git config --global advice.detachedHead false
+
+# the prompt's text without the escapes around it
+show() {
+	(cd "$1" && PWD="$1" PROMPT_BACKEND="$2" "$PROMPT" 0) | sed 's/\\\[[^\\]*\\\]//g'
+}
+
+# where the native backend is to tell without git, a git that fails shows if it ran
+mkdir "$T/nogit"
+printf '#!/bin/sh\nexit 1\n' > "$T/nogit/git"
+chmod +x "$T/nogit/git"
+
+# check <name> <dir> <what the git section shows> [git, when the native backend needs it there]
+check() {
+	if [ "${4:-}" = git ]; then
+		native=$(show "$2" native)
+	else
+		native=$(PATH="$T/nogit:$PATH" show "$2" native)
+	fi
+	cli=$(show "$2" cli)
+	for backend in $BACKENDS; do
+		case " $unsupported " in *" $backend "*) continue;; esac
+		other=$(show "$2" $backend)
+		if [ "$native" != "$other" ]; then
+			echo "FAIL $1: native '$native', $backend '$other'"
+			failed=1
+		fi
+	done
+	if [ "$native" != "$cli" ]; then
+		echo "FAIL $1: native '$native', cli '$cli'"
+		failed=1
+	elif case "$native" in *" $3 "*) false;; *) true;; esac; then
+		echo "FAIL $1: '$native' doesn't show '$3'"
+		failed=1
+	else
+		echo "ok   $1"
+	fi
+}
+
+# differs <name> <dir> <what native shows> <what cli shows>, where git looks further than the native backend does
+differs() {
+	native=$(PATH="$T/nogit:$PATH" show "$2" native)
+	cli=$(show "$2" cli)
+	for backend in $BACKENDS; do
+		other=$(show "$2" $backend)
+		if [ "$native" != "$other" ]; then
+			echo "FAIL $1: native '$native', $backend '$other'"
+			failed=1
+		fi
+	done
+	if case "$native" in *" $3 "*) false;; *) true;; esac; then
+		echo "FAIL $1: native '$native' doesn't show '$3'"
+		failed=1
+	elif case "$cli" in *" $4 "*) false;; *) true;; esac; then
+		echo "FAIL $1: cli '$cli' doesn't show '$4'"
+		failed=1
+	else
+		echo "ok   $1"
+	fi
+}
+
+# repo <dir> [git init options]: a repository with a couple of commits
+repo() {
+	dir=$1
+	shift
+	git init -q "$@" "$dir"
+	mkdir -p "$dir/d/e"
+	echo one > "$dir/a"
+	echo two > "$dir/d/b"
+	echo three > "$dir/d/e/c"
+	git -C "$dir" add .
+	git -C "$dir" commit -qm one
+	echo four >> "$dir/a"
+	git -C "$dir" commit -qam two
+}
+
+repo "$T/clean"
+check clean "$T/clean" "master"
+check subdirectory "$T/clean/d/e" "master"
+
+repo "$T/dirty"
+echo five >> "$T/dirty/d/b"
+check dirty "$T/dirty" "master *"
+
+repo "$T/stash"
+echo five >> "$T/stash/a"
+git -C "$T/stash" stash -q
+check stash "$T/stash" 'master \$'
+check gitdir "$T/stash/.git" "GIT_DIR!"
+git clone -q --bare "$T/stash" "$T/bare.git"
+check bare "$T/bare.git" "BARE:master"
+
+repo "$T/staged"
+echo new > "$T/staged/new"
+git -C "$T/staged" add new
+check staged "$T/staged" "master +"
+
+repo "$T/same-size"
+echo owt > "$T/same-size/d/b"
+git -C "$T/same-size" add d/b
+echo tow > "$T/same-size/d/b"
+check same-size "$T/same-size" "master *+" git
+
+repo "$T/untracked"
+git -C "$T/untracked" config bash.showUntrackedFiles true
+echo new > "$T/untracked/d/new"
+check untracked "$T/untracked" "master %"
+
+# the untracked cache answers for untracked files without turning the marker on; the files it has go away and
+# the ignored one turns up after git status last wrote it
+repo "$T/ucache"
+git -C "$T/ucache" config core.untrackedCache true
+echo '*.log' > "$T/ucache/d/.gitignore"
+git -C "$T/ucache" add d/.gitignore
+git -C "$T/ucache" commit -qm ignore
+git -C "$T/ucache" update-index --untracked-cache
+echo new > "$T/ucache/new"
+sleep 1
+git -C "$T/ucache" status > /dev/null
+if ! grep -q UNTR "$T/ucache/.git/index"; then
+	echo "FAIL untracked-cache: git didn't write one"
+	failed=1
+fi
+check untracked-cache-unasked "$T/ucache" "master"
+git -C "$T/ucache" config bash.showUntrackedFiles true
+check untracked-cache "$T/ucache" "master %"
+rm "$T/ucache/new"
+echo log > "$T/ucache/d/x.log"
+check untracked-cache-ignored "$T/ucache" "master"
+rm "$T/ucache/d/b"
+check untracked-cache-removed "$T/ucache" "master *"
+
+# libgit2 reads neither split indexes nor sha256 repositories
+unsupported=libgit2
+repo "$T/split"
+git -C "$T/split" config core.splitIndex true
+git -C "$T/split" update-index --split-index
+echo five >> "$T/split/a"
+git -C "$T/split" commit -qam three
+check split-index "$T/split" "master"
+echo new > "$T/split/new"
+git -C "$T/split" add new
+git -C "$T/split" rm -q --cached d/e/c
+echo six >> "$T/split/d/b"
+check split-index-changed "$T/split" "master *+"
+
+repo "$T/v4"
+git -C "$T/v4" update-index --index-version 4
+check index-v4 "$T/v4" "master"
+echo five >> "$T/v4/d/e/c"
+check index-v4-dirty "$T/v4" "master *"
+
+repo "$T/sha256" --object-format=sha256
+check sha256 "$T/sha256" "master"
+echo new > "$T/sha256/new"
+git -C "$T/sha256" add new
+check sha256-staged "$T/sha256" "master +"
+unsupported=
+
+repo "$T/main"
+git -C "$T/main" worktree add -q -b topic "$T/linked"
+check worktree "$T/linked" "topic"
+echo five >> "$T/linked/a"
+check worktree-dirty "$T/linked" "topic *"
+check worktree-main "$T/main" "master"
+
+repo "$T/detached"
+git -C "$T/detached" tag v1 HEAD~1
+git -C "$T/detached" checkout -q --detach HEAD~1
+check detached-tag "$T/detached" "(tags/v1)"
+git -C "$T/detached" tag -d v1 > /dev/null
+differs detached-behind "$T/detached" "($(git -C "$T/detached" rev-parse --short HEAD)...)" "(master~1)"
+
+# reftable stacks, where this git writes them; the stash is dropped in a table newer than the one pack-refs left
+if git init -q --ref-format=reftable "$T/reftable-probe" 2> /dev/null; then
+	repo "$T/reftable" --ref-format=reftable
+	check reftable "$T/reftable" "master"
+	echo five >> "$T/reftable/a"
+	git -C "$T/reftable" stash -q
+	check reftable-stash "$T/reftable" 'master \$'
+	git -C "$T/reftable" pack-refs --all
+	git -C "$T/reftable" stash drop -q
+	check reftable-deleted "$T/reftable" "master"
+	git -C "$T/reftable" checkout -q --detach HEAD~1
+	differs reftable-detached "$T/reftable" "($(git -C "$T/reftable" rev-parse --short HEAD)...)" "(master~1)"
+else
+	echo "skip reftable: git can't write reftable stacks"
+fi
+
+# a change the hook doesn't list is trusted to be none, by git and the prompt alike; libgit2 doesn't run the hook
+unsupported=libgit2
+repo "$T/fsmonitor"
+git -C "$T/fsmonitor" config core.fsmonitor "sh '$TESTS/fsmonitor-hook'"
+git -C "$T/fsmonitor" config core.fsmonitorHookVersion 2
+git -C "$T/fsmonitor" update-index --fsmonitor
+sleep 1
+git -C "$T/fsmonitor" status > /dev/null
+echo five >> "$T/fsmonitor/d/b"
+check fsmonitor-unlisted "$T/fsmonitor" "master"
+echo d/b > "$T/fsmonitor/.git/fsmonitor-changed"
+check fsmonitor-listed "$T/fsmonitor" "master *"
+unsupported=
+
+# prompts in parallel against a daemon, whose threads mustn't share what they read; packed repositories, so that
+# objects come out of packs, each with a staged change, so that HEAD's tree is read
+for n in 1 2 3 4; do
+	repo "$T/packed$n"
+	git -C "$T/packed$n" gc -q
+	echo new > "$T/packed$n/new"
+	git -C "$T/packed$n" add new
+done
+"$PROMPT" --daemon &
+daemon=$!
+sleep 1
+if ! kill -0 $daemon 2> /dev/null; then
+	# the socket is one per user, the user's own daemon has it
+	echo "skip daemon: another one is running"
+	daemon=
+else
+	jobs=
+	k=0
+	for n in 1 2 3 4 1 2 3 4; do
+		k=$((k + 1))
+		(
+			for i in 1 2 3 4 5 6 7 8 9 10; do
+				# without GIT_CONFIG variables the prompt asks the daemon
+				env -u GIT_CONFIG_GLOBAL -u GIT_CONFIG_NOSYSTEM sh -c \
+					'cd "$1" && PWD="$1" "$2" 0' sh "$T/packed$n" "$PROMPT" | sed 's/\\\[[^\\]*\\\]//g'
+				echo
+			done
+		) > "$T/daemon$k.out" &
+		jobs="$jobs $!"
+	done
+	wait $jobs
+	if ! kill -0 $daemon 2> /dev/null; then
+		echo "FAIL daemon: it died"
+		failed=1
+	elif grep -v -e '^$' -e ' master + ' "$T"/daemon*.out > /dev/null; then
+		echo "FAIL daemon: $(grep -v -e '^$' -e ' master + ' "$T"/daemon*.out | head -1)"
+		failed=1
+	else
+		echo "ok   daemon"
+	fi
+fi
+
+exit $failed
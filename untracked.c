@@ -0,0 +1,425 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include "git.h"
+
+// the flags git status writes the cache with: untracked directories shown as such, empty ones hidden
+#define UNTRACKED_FLAGS 6
+#define ONDISK_STAT 36
+#define UNTRACKED_MAXDIRS (1 << 20)
+
+typedef struct {
+	const char* name;
+	uint32_t untracked;
+	uint32_t children;
+	uint32_t next;
+	const unsigned char* stat;
+	const unsigned char* oid;
+} untracked_dir;
+
+typedef struct {
+	const git_index* index;
+	const git_repo* repo;
+	untracked_dir* dirs;
+	uint32_t count;
+	int dirfd;
+	ignore ignore;
+	int ignoring;
+} untracked_cache;
+
+static uint64_t varint(const unsigned char** p, const unsigned char* end) {
+	const unsigned char* q = *p;
+	uint64_t val;
+	unsigned char c;
+
+	if (q >= end) {
+		return UINT64_MAX;
+	}
+	c = *q++;
+	val = c & 127;
+	while (c & 128) {
+		if (q >= end) {
+			return UINT64_MAX;
+		}
+		c = *q++;
+		val = ((val + 1) << 7) | (c & 127);
+	}
+	*p = q;
+	return val;
+}
+
+static const char* string(const unsigned char** p, const unsigned char* end) {
+	const char* s = (const char*)*p;
+	const unsigned char* nul = memchr(*p, 0, end - *p);
+
+	if (!nul) {
+		return NULL;
+	}
+	*p = nul + 1;
+	return s;
+}
+
+// directories come depth first: counts, name, untracked names, then the subdirectories
+static int parse_dir(untracked_cache* uc, const unsigned char** p, const unsigned char* end, uint32_t max) {
+	uint64_t untracked = varint(p, end), children = varint(p, end), n;
+	uint32_t pos = uc->count;
+	untracked_dir* dir;
+
+	if (pos == max || untracked == UINT64_MAX || children == UINT64_MAX || children > max) {
+		return -1;
+	}
+	dir = &uc->dirs[uc->count++];
+	dir->untracked = untracked;
+	dir->children = children;
+	if (!(dir->name = string(p, end))) {
+		return -1;
+	}
+	for (n = 0; n < untracked; ++n) {
+		if (!string(p, end)) {
+			return -1;
+		}
+	}
+	for (n = 0; n < children; ++n) {
+		if (parse_dir(uc, p, end, max) != 0) {
+			return -1;
+		}
+	}
+	uc->dirs[pos].next = uc->count;
+	return 0;
+}
+
+static int bit(const uint64_t* bitmap, uint32_t bits, uint32_t n) {
+	return n < bits && (bitmap[n / 64] >> (n % 64) & 1);
+}
+
+// same stat data as ondisk: ctime, mtime, dev, ino, uid, gid, size; dev is left out like the index check does
+static int stat_matches(const unsigned char* sd, const struct stat* st) {
+	return get_be32(sd) == (uint32_t)st->st_ctim.tv_sec && get_be32(sd + 4) == (uint32_t)st->st_ctim.tv_nsec &&
+		get_be32(sd + 8) == (uint32_t)st->st_mtim.tv_sec && get_be32(sd + 12) == (uint32_t)st->st_mtim.tv_nsec &&
+		get_be32(sd + 20) == (uint32_t)st->st_ino && get_be32(sd + 24) == (uint32_t)st->st_uid &&
+		get_be32(sd + 28) == (uint32_t)st->st_gid && get_be32(sd + 32) == (uint32_t)st->st_size;
+}
+
+// a missing exclude file is recorded as all zeroes
+static int exclude_matches(const unsigned char* sd, const char* path) {
+	static const unsigned char zero[ONDISK_STAT];
+	struct stat st;
+
+	if (!path || stat(path, &st) != 0) {
+		return memcmp(sd, zero, sizeof zero) == 0;
+	}
+	return stat_matches(sd, &st);
+}
+
+static int tracked(const git_index* index, const char* path, int len) {
+	uint32_t n = index_find(index, path, len);
+	return n < index->count && index->entries[n].len == len && memcmp(index->entries[n].path, path, len) == 0;
+}
+
+static int tracked_dir(const git_index* index, const char* path, int len) {
+	uint32_t n = index_find(index, path, len);
+	return n < index->count && index->entries[n].len > len && memcmp(index->entries[n].path, path, len) == 0;
+}
+
+// 1 when the directory's .gitignore is what the cache saw, 0 when it changed, -1 when that takes hashing
+static int gitignore_matches(const untracked_cache* uc, const untracked_dir* dir, char* path, int len) {
+	const git_index* index = uc->index;
+	uint32_t n;
+
+	strcpy(path + len, ".gitignore");
+	n = index_find(index, path, len + 10);
+	if (n < index->count && index->entries[n].len == len + 10 && memcmp(index->entries[n].path, path, len + 10) == 0) {
+		if (index_entry_clean(index, n, uc->dirfd) != 1) {
+			return -1;
+		}
+		return dir->oid && memcmp(dir->oid, index->entries[n].oid, index->rawsz) == 0;
+	}
+	if (faccessat(uc->dirfd, path, F_OK, AT_SYMLINK_NOFOLLOW) == 0) {
+		return -1;
+	}
+	return !dir->oid;
+}
+
+static int check_dir(untracked_cache* uc, uint32_t pos, char* path, int len, int invalid);
+
+static int untracked_entry(untracked_cache* uc, char* path, int len, int isdir);
+
+// an untracked directory shows when anything in it isn't ignored, a nested repository always does
+static int untracked_contents(untracked_cache* uc, char* path, int len) {
+	int fd, result = 0;
+	struct dirent* de;
+	DIR* d;
+
+	if ((fd = openat(uc->dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+		return errno == ENOENT || errno == ENOTDIR ? 0 : -1;
+	}
+	if (!(d = fdopendir(fd))) {
+		close(fd);
+		return -1;
+	}
+	while (result != 1 && (de = readdir(d))) {
+		int namelen = strlen(de->d_name), isdir;
+		struct stat st;
+
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+			continue;
+		}
+		if (strcmp(de->d_name, ".git") == 0) {
+			result = 1;
+			break;
+		}
+		if (len + namelen + 2 > PATH_MAX) {
+			result = -1;
+			break;
+		}
+		memcpy(path + len, de->d_name, namelen + 1);
+		isdir = de->d_type == DT_DIR ||
+			(de->d_type == DT_UNKNOWN && fstatat(uc->dirfd, path, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode));
+		switch (untracked_entry(uc, path, len + namelen, isdir)) {
+		case 1:
+			result = 1;
+			break;
+		case -1:
+			result = -1;
+			break;
+		}
+	}
+	closedir(d);
+	path[len] = 0;
+	return result;
+}
+
+// 1 when a path that isn't in the index shows as untracked, 0 when it is ignored or an empty directory
+static int untracked_entry(untracked_cache* uc, char* path, int len, int isdir) {
+	int ignored;
+
+	if (!uc->ignoring) {
+		if (ignore_open(&uc->ignore, uc->repo, uc->dirfd) != 0) {
+			return -1;
+		}
+		uc->ignoring = 1;
+	}
+	if ((ignored = ignore_match(&uc->ignore, path, isdir)) != 0) {
+		return ignored == 1 ? 0 : -1;
+	}
+	if (!isdir) {
+		return 1;
+	}
+	path[len] = '/';
+	path[len + 1] = 0;
+	return untracked_contents(uc, path, len + 1);
+}
+
+// reads a directory the cache can't vouch for
+static int walk_dir(untracked_cache* uc, uint32_t pos, char* path, int len, int invalid) {
+	const untracked_dir* dir = pos < uc->count ? &uc->dirs[pos] : NULL;
+	int fd, result = 0;
+	struct dirent* de;
+	DIR* d;
+
+	if ((fd = openat(uc->dirfd, len ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+		return errno == ENOENT || errno == ENOTDIR ? 0 : -1;
+	}
+	if (!(d = fdopendir(fd))) {
+		close(fd);
+		return -1;
+	}
+	while (result != 1 && (de = readdir(d))) {
+		int namelen = strlen(de->d_name), isdir;
+		uint32_t child;
+		struct stat st;
+
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 || strcmp(de->d_name, ".git") == 0) {
+			continue;
+		}
+		if (len + namelen + 2 > PATH_MAX) {
+			result = -1;
+			break;
+		}
+		memcpy(path + len, de->d_name, namelen + 1);
+		if (tracked(uc->index, path, len + namelen)) {
+			continue;
+		}
+		isdir = de->d_type == DT_DIR ||
+			(de->d_type == DT_UNKNOWN && fstatat(uc->dirfd, path, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode));
+		path[len + namelen] = '/';
+		path[len + namelen + 1] = 0;
+		if (!isdir || !tracked_dir(uc->index, path, len + namelen + 1)) {
+			path[len + namelen] = 0;
+			switch (untracked_entry(uc, path, len + namelen, isdir)) {
+			case 1:
+				result = 1;
+				break;
+			case -1:
+				result = -1;
+				break;
+			}
+			continue;
+		}
+		// tracked directories keep using the cache below them, unless a .gitignore above changed
+		for (child = dir ? pos + 1 : uc->count; dir && child < dir->next; child = uc->dirs[child].next) {
+			if (strcmp(uc->dirs[child].name, de->d_name) == 0) {
+				break;
+			}
+		}
+		switch (check_dir(uc, dir && child < dir->next ? child : uc->count, path, len + namelen + 1, invalid)) {
+		case 1:
+			result = 1;
+			break;
+		case -1:
+			result = -1;
+			break;
+		}
+	}
+	closedir(d);
+	path[len] = 0;
+	return result;
+}
+
+static int check_dir(untracked_cache* uc, uint32_t pos, char* path, int len, int invalid) {
+	const untracked_dir* dir = pos < uc->count ? &uc->dirs[pos] : NULL;
+	uint32_t child;
+	struct stat st;
+	int result = 0, same;
+
+	if (!dir || invalid || !dir->stat) {
+		return walk_dir(uc, pos, path, len, invalid);
+	}
+	if (fstatat(uc->dirfd, len ? path : ".", &st, 0) != 0) {
+		return errno == ENOENT || errno == ENOTDIR ? 0 : -1;
+	}
+	// a changed .gitignore spoils everything below it
+	if ((same = gitignore_matches(uc, dir, path, len)) < 0) {
+		return -1;
+	}
+	path[len] = 0;
+	if (!same) {
+		return walk_dir(uc, pos, path, len, 1);
+	}
+	// racily clean directories could have changed in the second the index was written
+	if (!stat_matches(dir->stat, &st) || (uint32_t)uc->index->mtime.tv_sec <= (uint32_t)st.st_mtim.tv_sec) {
+		return walk_dir(uc, pos, path, len, 0);
+	}
+	if (dir->untracked) {
+		return 1;
+	}
+	for (child = pos + 1; child < dir->next; child = uc->dirs[child].next) {
+		int namelen = strlen(uc->dirs[child].name);
+		if (len + namelen + 2 > PATH_MAX) {
+			return -1;
+		}
+		memcpy(path + len, uc->dirs[child].name, namelen);
+		path[len + namelen] = '/';
+		path[len + namelen + 1] = 0;
+		switch (check_dir(uc, child, path, len + namelen + 1, 0)) {
+		case 1:
+			path[len] = 0;
+			return 1;
+		case -1:
+			result = -1;
+			break;
+		}
+	}
+	path[len] = 0;
+	return result;
+}
+
+// 1 when the work tree has untracked files, 0 when it has none, -1 when the untracked cache can't tell
+int index_untracked(const git_index* index, const git_repo* repo) {
+	char path[PATH_MAX], ident[PATH_MAX + 128];
+	uint64_t *valid = NULL, *check_only = NULL, *oid_valid = NULL;
+	uint32_t valid_bits, check_bits, oid_bits, n;
+	const unsigned char *p, *end, *info_stat, *excludes_stat;
+	const char* per_dir;
+	untracked_cache uc;
+	struct utsname un;
+	uint64_t len;
+	size_t size;
+	int result = -1;
+
+	if (!(p = index_extension(index, "UNTR", &size)) || uname(&un) != 0) {
+		return -1;
+	}
+	end = p + size;
+
+	// the cache only holds for the work tree and system it was written on
+	len = varint(&p, end);
+	snprintf(ident, sizeof ident, "Location %s, system %s", repo->worktree, un.sysname);
+	if (len == UINT64_MAX || len > end - p || len != strlen(ident) + 1 || memcmp(p, ident, len) != 0) {
+		return -1;
+	}
+	p += len;
+	if (end - p < 2 * ONDISK_STAT + 4 + 2 * index->rawsz) {
+		return -1;
+	}
+	info_stat = p;
+	excludes_stat = p + ONDISK_STAT;
+	if (get_be32(p + 2 * ONDISK_STAT) != UNTRACKED_FLAGS) {
+		return -1;
+	}
+	p += 2 * ONDISK_STAT + 4 + 2 * index->rawsz;
+	if (!(per_dir = string(&p, end)) || strcmp(per_dir, ".gitignore") != 0) {
+		return -1;
+	}
+
+	// changes to info/exclude or core.excludesFile would need every directory looked at again
+	if (strlen(repo->commondir) + 14 > sizeof path) {
+		return -1;
+	}
+	strcpy(path, repo->commondir);
+	strcat(path, "/info/exclude");
+	if (!exclude_matches(info_stat, path) || !exclude_matches(excludes_stat, excludes_file(repo, path))) {
+		return -1;
+	}
+
+	memset(&uc, 0, sizeof uc);
+	uc.index = index;
+	uc.repo = repo;
+	if ((len = varint(&p, end)) == UINT64_MAX || len == 0 || len > UNTRACKED_MAXDIRS ||
+			!(uc.dirs = calloc(len, sizeof *uc.dirs)) || parse_dir(&uc, &p, end, len) != 0 || uc.count != len ||
+			!(valid = ewah_decode(&p, end, &valid_bits)) || !(check_only = ewah_decode(&p, end, &check_bits)) ||
+			!(oid_valid = ewah_decode(&p, end, &oid_bits))) {
+		goto done;
+	}
+	// then the stat data of the valid directories, and the .gitignore oids of those that had one
+	for (n = 0; n < uc.count; ++n) {
+		if (bit(valid, valid_bits, n)) {
+			if (end - p < ONDISK_STAT) {
+				goto done;
+			}
+			uc.dirs[n].stat = p;
+			p += ONDISK_STAT;
+		}
+	}
+	for (n = 0; n < uc.count; ++n) {
+		if (bit(oid_valid, oid_bits, n)) {
+			if (end - p < index->rawsz) {
+				goto done;
+			}
+			uc.dirs[n].oid = p;
+			p += index->rawsz;
+		}
+	}
+
+	if ((uc.dirfd = open(repo->worktree, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1) {
+		*path = 0;
+		result = check_dir(&uc, 0, path, 0, 0);
+		close(uc.dirfd);
+	}
+
+done:
+	free(oid_valid);
+	free(check_only);
+	free(valid);
+	free(uc.dirs);
+	if (uc.ignoring) {
+		ignore_close(&uc.ignore);
+	}
+	return result;
+}
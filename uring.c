@@ -0,0 +1,136 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "git.h"
+
+// no liburing, the three system calls and the shared rings are all it takes
+static int uring_setup(unsigned entries, struct io_uring_params* params) {
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+	return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+int uring_open(uring* ring, unsigned entries) {
+	struct io_uring_params params;
+
+	memset(ring, 0, sizeof *ring);
+	memset(&params, 0, sizeof params);
+	if ((ring->fd = uring_setup(entries, &params)) < 0) {
+		// ENOSYS on old kernels, EPERM where it is disabled or filtered
+		ring->fd = -1;
+		return -1;
+	}
+	ring->sqsize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	ring->cqsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cqsize > ring->sqsize) {
+			ring->sqsize = ring->cqsize;
+		}
+		ring->cqsize = 0;
+	}
+	ring->sq = mmap(NULL, ring->sqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq = ring->cqsize ?
+		mmap(NULL, ring->cqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING) :
+		ring->sq;
+	ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sq == MAP_FAILED || ring->cq == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		if (ring->cq == MAP_FAILED) {
+			ring->cq = NULL;
+		}
+		if (ring->sqes == MAP_FAILED) {
+			ring->sqes = NULL;
+		}
+		if (ring->sq == MAP_FAILED) {
+			ring->sq = NULL;
+		}
+		uring_close(ring);
+		return -1;
+	}
+	ring->entries = params.sq_entries;
+	ring->sqhead = (uint32_t*)((char*)ring->sq + params.sq_off.head);
+	ring->sqtail = (uint32_t*)((char*)ring->sq + params.sq_off.tail);
+	ring->sqmask = *(uint32_t*)((char*)ring->sq + params.sq_off.ring_mask);
+	ring->sqarray = (uint32_t*)((char*)ring->sq + params.sq_off.array);
+	ring->cqhead = (uint32_t*)((char*)ring->cq + params.cq_off.head);
+	ring->cqtail = (uint32_t*)((char*)ring->cq + params.cq_off.tail);
+	ring->cqmask = *(uint32_t*)((char*)ring->cq + params.cq_off.ring_mask);
+	ring->cqes = (char*)ring->cq + params.cq_off.cqes;
+	return 0;
+}
+
+void uring_close(uring* ring) {
+	if (ring->sqes) {
+		munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+	}
+	if (ring->cq && ring->cq != ring->sq) {
+		munmap(ring->cq, ring->cqsize);
+	}
+	if (ring->sq) {
+		munmap(ring->sq, ring->sqsize);
+	}
+	if (ring->fd != -1) {
+		close(ring->fd);
+	}
+	memset(ring, 0, sizeof *ring);
+	ring->fd = -1;
+}
+
+// queues an lstat-like statx relative to dirfd, -1 when the submission ring is full
+int uring_statx(uring* ring, int dirfd, const char* path, void* buf, uint64_t data) {
+	uint32_t tail = *ring->sqtail, index = tail & ring->sqmask;
+	struct io_uring_sqe* sqe = (struct io_uring_sqe*)ring->sqes + index;
+
+	if (tail - __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE) >= ring->entries) {
+		return -1;
+	}
+	memset(sqe, 0, sizeof *sqe);
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = dirfd;
+	sqe->addr = (uintptr_t)path;
+	sqe->len = STATX_BASIC_STATS;
+	sqe->off = (uintptr_t)buf;
+	sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+	sqe->user_data = data;
+	ring->sqarray[index] = index;
+	__atomic_store_n(ring->sqtail, tail + 1, __ATOMIC_RELEASE);
+	++ring->pending;
+	return 0;
+}
+
+// hands the queued submissions to the kernel and waits for at least wait completions
+int uring_submit(uring* ring, unsigned wait) {
+	int n;
+
+	do {
+		n = uring_enter(ring->fd, ring->pending, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		return -1;
+	}
+	ring->pending -= n;
+	return n;
+}
+
+// the next completion, 0 when there is none yet
+int uring_reap(uring* ring, uint64_t* data, int* result) {
+	uint32_t head = *ring->cqhead;
+	const struct io_uring_cqe* cqe;
+
+	if (head == __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	cqe = (const struct io_uring_cqe*)ring->cqes + (head & ring->cqmask);
+	*data = cqe->user_data;
+	*result = cqe->res;
+	__atomic_store_n(ring->cqhead, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
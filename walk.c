@@ -0,0 +1,317 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "git.h"
+
+// large enough for most directories in one system call
+#define WALK_BUFSIZE 65536
+#define WALK_MAXTHREADS 8
+
+typedef struct {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+} linux_dirent64;
+
+typedef struct {
+	// the index entries below a tracked directory, an untracked one has none
+	uint32_t lo, hi;
+	int tracked;
+	int len;
+	char path[];
+} walk_dir;
+
+// the owner pushes and pops at the tail, depth first, the others steal from the head
+typedef struct {
+	pthread_mutex_t lock;
+	walk_dir** dirs;
+	size_t head, tail, cap;
+} walk_deque;
+
+typedef struct {
+	const git_index* index;
+	const git_repo* repo;
+	int dirfd;
+	walk_deque deques[WALK_MAXTHREADS];
+	int threads;
+	atomic_int pending;
+	atomic_int stop;
+	atomic_int result;
+	struct timespec deadline;
+} walk_pool;
+
+typedef struct {
+	walk_pool* pool;
+	int self;
+} walk_thread;
+
+// the first entry in [lo, hi) whose path sorts at or after path
+static uint32_t find(const git_index* index, uint32_t lo, uint32_t hi, const char* path, int len) {
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		const index_entry* e = &index->entries[mid];
+		int cmp = memcmp(e->path, path, e->len < len ? e->len : len);
+		if (cmp < 0 || (cmp == 0 && e->len < len)) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static void finish(walk_pool* pool, int result) {
+	int clean = 0;
+
+	// an untracked file settles it, whatever else went wrong
+	if (result == 1) {
+		atomic_store(&pool->result, 1);
+	} else {
+		atomic_compare_exchange_strong(&pool->result, &clean, -1);
+	}
+	atomic_store_explicit(&pool->stop, 1, memory_order_relaxed);
+}
+
+static int push(walk_pool* pool, int self, const char* path, int len, int tracked, uint32_t lo, uint32_t hi) {
+	walk_deque* deque = &pool->deques[self];
+	walk_dir* dir = malloc(sizeof *dir + len + 1);
+
+	if (!dir) {
+		return -1;
+	}
+	dir->lo = lo;
+	dir->hi = hi;
+	dir->tracked = tracked;
+	dir->len = len;
+	memcpy(dir->path, path, len);
+	dir->path[len] = 0;
+
+	pthread_mutex_lock(&deque->lock);
+	if (deque->tail == deque->cap) {
+		walk_dir** dirs;
+		size_t count = deque->tail - deque->head;
+		// room is made by moving what's left to the front, or by growing
+		if (deque->head) {
+			memmove(deque->dirs, deque->dirs + deque->head, count * sizeof *dirs);
+		} else if ((dirs = realloc(deque->dirs, (deque->cap ? deque->cap * 2 : 64) * sizeof *dirs))) {
+			deque->dirs = dirs;
+			deque->cap = deque->cap ? deque->cap * 2 : 64;
+		} else {
+			pthread_mutex_unlock(&deque->lock);
+			free(dir);
+			return -1;
+		}
+		deque->head = 0;
+		deque->tail = count;
+	}
+	deque->dirs[deque->tail++] = dir;
+	atomic_fetch_add(&pool->pending, 1);
+	pthread_mutex_unlock(&deque->lock);
+	return 0;
+}
+
+static walk_dir* take(walk_pool* pool, int self) {
+	walk_dir* dir = NULL;
+	int n;
+
+	for (n = 0; n < pool->threads && !dir; ++n) {
+		walk_deque* deque = &pool->deques[(self + n) % pool->threads];
+		pthread_mutex_lock(&deque->lock);
+		if (deque->head != deque->tail) {
+			dir = n ? deque->dirs[deque->head++] : deque->dirs[--deque->tail];
+		}
+		pthread_mutex_unlock(&deque->lock);
+	}
+	return dir;
+}
+
+// 1 on an untracked file that isn't ignored, 0 when the directory has none of its own, -1 when it can't be told
+static int walk_read(walk_pool* pool, int self, const walk_dir* dir, char* buf, ignore* ig, int* ignoring) {
+	const git_index* index = pool->index;
+	char path[PATH_MAX];
+	int fd, result = 0;
+	long size = 0;
+
+	if ((fd = openat(pool->dirfd, dir->len ? dir->path : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) == -1) {
+		return errno == ENOENT || errno == ENOTDIR ? 0 : -1;
+	}
+	memcpy(path, dir->path, dir->len);
+	while (result == 0 && !atomic_load_explicit(&pool->stop, memory_order_relaxed) &&
+			(size = syscall(SYS_getdents64, fd, buf, WALK_BUFSIZE)) > 0) {
+		long off;
+		for (off = 0; off < size && result == 0; off += ((linux_dirent64*)(buf + off))->d_reclen) {
+			const linux_dirent64* de = (const linux_dirent64*)(buf + off);
+			const char* name = de->d_name;
+			int namelen = strlen(name), len = dir->len + namelen, isdir;
+			uint32_t lo, hi;
+			struct stat st;
+
+			if ((name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) ||
+					(!dir->len && strcmp(name, ".git") == 0)) {
+				continue;
+			}
+			// a repository nested in an untracked directory shows as that directory
+			if (!dir->tracked && strcmp(name, ".git") == 0) {
+				result = 1;
+				break;
+			}
+			if (len + 2 > sizeof path) {
+				result = -1;
+				break;
+			}
+			memcpy(path + dir->len, name, namelen + 1);
+			// d_type saves the stat call, except on file systems that don't fill it in
+			isdir = de->d_type == DT_DIR ||
+				(de->d_type == DT_UNKNOWN && fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode));
+
+			if (dir->tracked) {
+				lo = find(index, dir->lo, dir->hi, path, len);
+				if (lo < dir->hi && index->entries[lo].len == len && memcmp(index->entries[lo].path, path, len) == 0) {
+					continue;
+				}
+				if (isdir) {
+					// the entries below it sort between "name/" and "name0"
+					path[len] = '/';
+					lo = find(index, lo, dir->hi, path, len + 1);
+					path[len] = '0';
+					hi = find(index, lo, dir->hi, path, len + 1);
+					path[len] = '/';
+					if (lo < hi) {
+						// a sparse directory entry has nothing checked out below it
+						if (index->entries[lo].len == len + 1 || push(pool, self, path, len + 1, 1, lo, hi) != 0) {
+							result = -1;
+						}
+						continue;
+					}
+					path[len] = 0;
+				}
+			}
+
+			if (!*ignoring) {
+				if (ignore_open(ig, pool->repo, pool->dirfd) != 0) {
+					result = -1;
+					break;
+				}
+				*ignoring = 1;
+			}
+			switch (ignore_match(ig, path, isdir)) {
+			case 0:
+				if (!isdir) {
+					result = 1;
+				} else {
+					// untracked directories only show with something in them
+					path[len] = '/';
+					result = push(pool, self, path, len + 1, 0, 0, 0);
+					path[len] = 0;
+				}
+				break;
+			case -1:
+				result = -1;
+				break;
+			}
+		}
+	}
+	if (size < 0 && result == 0) {
+		result = -1;
+	}
+	close(fd);
+	return result;
+}
+
+static void* walk_worker(void* data) {
+	walk_pool* pool = ((walk_thread*)data)->pool;
+	int self = ((walk_thread*)data)->self, ignoring = 0;
+	char* buf = malloc(WALK_BUFSIZE);
+	ignore* ig = malloc(sizeof *ig);
+
+	deadline_adopt(pool->deadline);
+	if (!buf || !ig) {
+		finish(pool, -1);
+	}
+	// pending only drops to zero once every directory is read, including the ones in flight
+	while (!atomic_load_explicit(&pool->stop, memory_order_relaxed) && atomic_load(&pool->pending)) {
+		walk_dir* dir = take(pool, self);
+		int result;
+		if (deadline_left() == 0) {
+			finish(pool, -1);
+			break;
+		}
+		if (!dir) {
+			sched_yield();
+			continue;
+		}
+		if ((result = walk_read(pool, self, dir, buf, ig, &ignoring)) != 0) {
+			finish(pool, result);
+		}
+		free(dir);
+		atomic_fetch_sub(&pool->pending, 1);
+	}
+	if (ignoring) {
+		ignore_close(ig);
+	}
+	free(ig);
+	free(buf);
+	return NULL;
+}
+
+// 1 when the work tree has an untracked file that isn't ignored, 0 when it has none, -1 when it can't be told
+int worktree_untracked(const git_index* index, const git_repo* repo) {
+	pthread_t threads[WALK_MAXTHREADS];
+	walk_thread args[WALK_MAXTHREADS];
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	walk_pool pool;
+	int started = 0, n;
+
+	memset(&pool, 0, sizeof pool);
+	pool.index = index;
+	pool.repo = repo;
+	pool.deadline = deadline_get();
+	pool.threads = cpus < 1 ? 1 : cpus > WALK_MAXTHREADS ? WALK_MAXTHREADS : cpus;
+	if ((pool.dirfd = open(repo->worktree, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+		return -1;
+	}
+	for (n = 0; n < pool.threads; ++n) {
+		pthread_mutex_init(&pool.deques[n].lock, NULL);
+	}
+	atomic_init(&pool.pending, 0);
+	atomic_init(&pool.stop, 0);
+	atomic_init(&pool.result, 0);
+
+	// the calling thread is worker 0 and starts out with the top of the work tree
+	if (push(&pool, 0, "", 0, 1, 0, index->count) != 0) {
+		finish(&pool, -1);
+	}
+	for (n = 0; n < pool.threads; ++n) {
+		args[n].pool = &pool;
+		args[n].self = n;
+	}
+	while (started < pool.threads - 1 && pthread_create(&threads[started], NULL, walk_worker, &args[started + 1]) == 0) {
+		++started;
+	}
+	walk_worker(&args[0]);
+	for (n = 0; n < started; ++n) {
+		pthread_join(threads[n], NULL);
+	}
+
+	for (n = 0; n < pool.threads; ++n) {
+		walk_deque* deque = &pool.deques[n];
+		while (deque->head != deque->tail) {
+			free(deque->dirs[deque->head++]);
+		}
+		free(deque->dirs);
+		pthread_mutex_destroy(&deque->lock);
+	}
+	close(pool.dirfd);
+	return atomic_load(&pool.result);
+}
@@ -0,0 +1,421 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "git.h"
+
+// work trees watched at once, the one least recently asked about makes room
+#define WATCH_TREES 16
+// past this the paths touched are forgotten, the next check is a full one
+#define WATCH_TOUCHED (4 << 20)
+#define WATCH_BUFSIZE 65536
+
+#define WATCH_EVENTS (IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+	IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW)
+#define WATCH_FANEVENTS (FAN_ATTRIB | FAN_MODIFY | FAN_CLOSE_WRITE | FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | \
+	FAN_MOVED_TO | FAN_ONDIR)
+
+typedef struct {
+	char worktree[PATH_MAX];
+	// fanotify reports directories by their real path
+	char root[PATH_MAX];
+	int rootlen;
+	// inotify, or fanotify on the whole file system where the daemon may; -1 once it can't be relied on
+	int fd;
+	int fan;
+	int top;
+	// inotify's directories by watch descriptor, relative to the work tree
+	char** dirs;
+	int ndirs;
+	// the paths touched since the last check, relative to the work tree and NUL separated
+	char* touched;
+	size_t size, cap, last;
+	int lost;
+	// the last scan found the work tree clean against the index with this checksum
+	int valid;
+	unsigned char checksum[GIT_MAX_RAWSZ];
+	// the index the watches were last brought in line with
+	unsigned char synced[GIT_MAX_RAWSZ];
+	unsigned long generation, used;
+} watcher;
+
+static watcher watchers[WATCH_TREES];
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long watch_tick;
+static int epfd = -1;
+
+// events are lost, the next check stats everything and the watches are put back in line with the index
+static void lose(watcher* w) {
+	w->lost = 1;
+	w->size = 0;
+	memset(w->synced, 0, sizeof w->synced);
+}
+
+static void fail(watcher* w) {
+	int n;
+
+	if (w->fd != -1) {
+		close(w->fd);
+	}
+	if (w->fan) {
+		close(w->top);
+	}
+	for (n = 0; n < w->ndirs; ++n) {
+		free(w->dirs[n]);
+	}
+	free(w->dirs);
+	free(w->touched);
+	w->fd = -1;
+	w->fan = 0;
+	w->dirs = NULL;
+	w->ndirs = 0;
+	w->touched = NULL;
+	w->size = w->cap = 0;
+	w->valid = 0;
+}
+
+static void touch(watcher* w, const char* path, int len) {
+	// a file being written comes as a run of events
+	if (w->lost || (w->size && strcmp(w->touched + w->last, path) == 0)) {
+		return;
+	}
+	if (w->size + len + 1 > w->cap) {
+		char* tmp;
+		if (w->cap >= WATCH_TOUCHED || !(tmp = realloc(w->touched, w->cap ? w->cap * 2 : 4096))) {
+			lose(w);
+			return;
+		}
+		w->touched = tmp;
+		w->cap = w->cap ? w->cap * 2 : 4096;
+		if (w->size + len + 1 > w->cap) {
+			lose(w);
+			return;
+		}
+	}
+	w->last = w->size;
+	memcpy(w->touched + w->size, path, len + 1);
+	w->size += len + 1;
+}
+
+static void drain_inotify(watcher* w) {
+	char buf[WATCH_BUFSIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+	char path[PATH_MAX];
+	ssize_t size;
+
+	while ((size = read(w->fd, buf, sizeof buf)) > 0) {
+		const struct inotify_event* ev;
+		char* p;
+		for (p = buf; p < buf + size; p += sizeof *ev + ev->len) {
+			const char* dir;
+			int len;
+			ev = (const struct inotify_event*)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				lose(w);
+				continue;
+			}
+			if (ev->wd < 0 || ev->wd >= w->ndirs || !(dir = w->dirs[ev->wd])) {
+				continue;
+			}
+			if (ev->mask & IN_IGNORED) {
+				free(w->dirs[ev->wd]);
+				w->dirs[ev->wd] = NULL;
+				continue;
+			}
+			if (ev->mask & IN_MOVE_SELF) {
+				// where it went is only known to its parent, which tells of it as a name of its own
+				if (!*dir) {
+					fail(w);
+					return;
+				}
+				inotify_rm_watch(w->fd, ev->wd);
+				continue;
+			}
+			if (!ev->len) {
+				continue;
+			}
+			if ((len = snprintf(path, sizeof path, "%s%s%s", dir, *dir ? "/" : "", ev->name)) >= sizeof path) {
+				lose(w);
+				continue;
+			}
+			touch(w, path, len);
+		}
+	}
+}
+
+static void drain_fanotify(watcher* w) {
+	char buf[WATCH_BUFSIZE] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+	char proc[32], dir[PATH_MAX], path[PATH_MAX];
+	ssize_t size;
+
+	while ((size = read(w->fd, buf, sizeof buf)) > 0) {
+		const struct fanotify_event_metadata* ev;
+		for (ev = (const struct fanotify_event_metadata*)buf; FAN_EVENT_OK(ev, size); ev = FAN_EVENT_NEXT(ev, size)) {
+			const struct fanotify_event_info_fid* fid = (const struct fanotify_event_info_fid*)(ev + 1);
+			struct file_handle* handle;
+			const char* name;
+			ssize_t dirlen;
+			int fd, len;
+
+			if (ev->mask & FAN_Q_OVERFLOW) {
+				lose(w);
+				continue;
+			}
+			if (ev->event_len < ev->metadata_len + sizeof *fid || fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) {
+				continue;
+			}
+			handle = (struct file_handle*)fid->handle;
+			name = (const char*)handle->f_handle + handle->handle_bytes;
+			// the whole file system is marked, what is outside the work tree is dropped here
+			if ((fd = open_by_handle_at(w->top, handle, O_PATH | O_CLOEXEC)) == -1) {
+				// a directory already gone, the event in its parent says so
+				if (errno != ESTALE && errno != ENOENT) {
+					lose(w);
+				}
+				continue;
+			}
+			snprintf(proc, sizeof proc, "/proc/self/fd/%d", fd);
+			dirlen = readlink(proc, dir, sizeof dir - 1);
+			close(fd);
+			if (dirlen < w->rootlen || memcmp(dir, w->root, w->rootlen) != 0 ||
+					(dirlen > w->rootlen && dir[w->rootlen] != '/')) {
+				continue;
+			}
+			dir[dirlen] = 0;
+			if ((len = snprintf(path, sizeof path, "%s%s%s", dir + w->rootlen + (dirlen > w->rootlen),
+					dirlen > w->rootlen ? "/" : "", name)) >= sizeof path) {
+				lose(w);
+				continue;
+			}
+			touch(w, path, len);
+		}
+	}
+}
+
+static void drain(watcher* w) {
+	if (w->fd != -1) {
+		if (w->fan) {
+			drain_fanotify(w);
+		} else {
+			drain_inotify(w);
+		}
+	}
+}
+
+// the events are read as they come, so the queue doesn't overflow between prompts
+static void* watch_thread(void* data) {
+	struct epoll_event events[WATCH_TREES];
+	int n, i;
+
+	for (;;) {
+		if ((n = epoll_wait(epfd, events, WATCH_TREES, -1)) <= 0) {
+			continue;
+		}
+		pthread_mutex_lock(&watch_lock);
+		for (i = 0; i < n; ++i) {
+			drain(events[i].data.ptr);
+		}
+		pthread_mutex_unlock(&watch_lock);
+	}
+	return NULL;
+}
+
+// -1 when the directory can't be watched, as when the watch limit is hit
+static int watch_add(watcher* w, const char* dir, int len) {
+	char path[PATH_MAX];
+	int wd, worktreelen = strlen(w->worktree);
+
+	if (worktreelen + 1 + len >= sizeof path) {
+		return -1;
+	}
+	memcpy(path, w->worktree, worktreelen);
+	path[worktreelen] = '/';
+	memcpy(path + worktreelen + 1, dir, len);
+	path[worktreelen + 1 + len] = 0;
+	if ((wd = inotify_add_watch(w->fd, path, WATCH_EVENTS)) == -1) {
+		// one that isn't there has its files changed already, its parent tells when it is back
+		return errno == ENOENT || errno == ENOTDIR ? 0 : -1;
+	}
+	if (wd >= w->ndirs) {
+		int count = wd + 1 > w->ndirs * 2 ? wd + 1 : w->ndirs * 2;
+		char** dirs = realloc(w->dirs, count * sizeof *dirs);
+		if (!dirs) {
+			return -1;
+		}
+		memset(dirs + w->ndirs, 0, (count - w->ndirs) * sizeof *dirs);
+		w->dirs = dirs;
+		w->ndirs = count;
+	}
+	// the same directory gets the same descriptor again
+	free(w->dirs[wd]);
+	return (w->dirs[wd] = strndup(dir, len)) ? 0 : -1;
+}
+
+// the directories the entries in [lo, hi) are in, and the ones those are in
+static int watch_dirs(watcher* w, const git_index* index, uint32_t lo, uint32_t hi) {
+	const index_entry* prev = NULL;
+	uint32_t n;
+	int p;
+
+	for (n = lo; n < hi; ++n) {
+		const index_entry* e = &index->entries[n];
+		if (e->xflags & CE_SKIP_WORKTREE) {
+			continue;
+		}
+		// the entries are sorted, a directory the one before shares is watched already
+		for (p = 0; p < e->len; ++p) {
+			if (e->path[p] == '/' && !(prev && prev->len > p && memcmp(prev->path, e->path, p + 1) == 0) &&
+					watch_add(w, e->path, p) != 0) {
+				return -1;
+			}
+		}
+		prev = e;
+	}
+	return 0;
+}
+
+// a directory that turned up again gets its watches back, for the tracked files below it
+static int watch_below(watcher* w, const git_index* index, char* path, int len) {
+	uint32_t lo, hi;
+
+	path[len] = '/';
+	lo = index_find(index, path, len + 1);
+	path[len] = '0';
+	hi = index_find(index, path, len + 1);
+	path[len] = 0;
+	return lo < hi ? watch_dirs(w, index, lo, hi) : 0;
+}
+
+static int watch_start(watcher* w, const git_repo* repo) {
+	struct epoll_event ev;
+	pthread_t thread;
+
+	memset(w, 0, sizeof *w);
+	w->fd = -1;
+	strcpy(w->worktree, repo->worktree);
+	if (epfd == -1) {
+		if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+			return -1;
+		}
+		if (pthread_create(&thread, NULL, watch_thread, NULL) != 0) {
+			close(epfd);
+			epfd = -1;
+			return -1;
+		}
+		pthread_detach(thread);
+	}
+	// a mark on the whole file system has no watch limit to run into, but takes CAP_SYS_ADMIN
+	if ((w->fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_NONBLOCK | FAN_CLOEXEC, O_RDONLY)) != -1) {
+		if (realpath(repo->worktree, w->root) && (w->top = open(w->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1) {
+			w->fan = 1;
+			w->rootlen = strlen(w->root);
+		}
+		if (!w->fan || fanotify_mark(w->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, WATCH_FANEVENTS, AT_FDCWD, w->root) != 0) {
+			fail(w);
+		}
+	}
+	if (w->fd == -1) {
+		w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = w;
+	if (w->fd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, w->fd, &ev) != 0) {
+		fail(w);
+		return -1;
+	}
+	return 0;
+}
+
+// the entries the dirty check still has to stat, those touched since a check that found the work tree clean; NULL
+// when it has to stat them all. what the check found goes to watch_settle with the generation
+uint64_t* watch_check(const git_index* index, const git_repo* repo, unsigned long* generation) {
+	const unsigned char* checksum = (const unsigned char*)index->map + index->mapsize - index->rawsz;
+	size_t words = ((size_t)index->count + 63) / 64, off;
+	uint64_t* check = NULL;
+	watcher* w = NULL;
+	int n;
+
+	*generation = 0;
+	if (index->mapsize < index->rawsz || !*repo->worktree || strlen(repo->worktree) >= sizeof w->root) {
+		return NULL;
+	}
+	pthread_mutex_lock(&watch_lock);
+	for (n = 0; n < WATCH_TREES && !w; ++n) {
+		if (watchers[n].used && strcmp(watchers[n].worktree, repo->worktree) == 0) {
+			w = &watchers[n];
+		}
+	}
+	if (!w) {
+		for (n = 0; n < WATCH_TREES; ++n) {
+			if (!w || watchers[n].used < w->used) {
+				w = &watchers[n];
+			}
+		}
+		if (w->used) {
+			fail(w);
+		}
+		watch_start(w, repo);
+	}
+	w->used = ++watch_tick;
+	drain(w);
+
+	// files the index has in directories not watched yet can't be vouched for, nor anything once the limit is hit
+	if (w->fd != -1 && !w->fan && memcmp(w->synced, checksum, index->rawsz) != 0) {
+		if (watch_add(w, "", 0) != 0 || watch_dirs(w, index, 0, index->count) != 0) {
+			fail(w);
+		} else {
+			memcpy(w->synced, checksum, index->rawsz);
+		}
+	}
+	if (w->fd != -1 && w->valid && !w->lost && memcmp(w->checksum, checksum, index->rawsz) == 0) {
+		check = calloc(words + 1, sizeof *check);
+	}
+	for (off = 0; w->fd != -1 && off < w->size; off += strlen(w->touched + off) + 1) {
+		char* path = w->touched + off;
+		int len = strlen(path);
+		if (!w->fan && watch_below(w, index, path, len) != 0) {
+			fail(w);
+			free(check);
+			check = NULL;
+		} else if (check) {
+			index_mark(index, check, path, len);
+		}
+	}
+	// submodules change in repositories of their own
+	for (n = 0; check && n < index->count; ++n) {
+		if ((index->entries[n].mode & S_IFMT) == 0160000) {
+			check[n / 64] |= (uint64_t)1 << (n % 64);
+		}
+	}
+
+	if (w->fd != -1) {
+		*generation = w->generation = ++watch_tick;
+	}
+	w->size = 0;
+	w->lost = 0;
+	w->valid = 0;
+	pthread_mutex_unlock(&watch_lock);
+	return check;
+}
+
+// with nothing lost in between, a clean work tree is what the next check starts from
+void watch_settle(unsigned long generation, const git_index* index, int clean) {
+	int n;
+
+	pthread_mutex_lock(&watch_lock);
+	for (n = 0; n < WATCH_TREES; ++n) {
+		watcher* w = &watchers[n];
+		if (generation && w->generation == generation && w->fd != -1 && !w->lost && clean == 1) {
+			w->valid = 1;
+			memcpy(w->checksum, (const unsigned char*)index->map + index->mapsize - index->rawsz, index->rawsz);
+		}
+	}
+	pthread_mutex_unlock(&watch_lock);
+}